@@ -3,41 +3,29 @@
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <stdarg.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include "decoder.h"
 
 #define SAMPLESIZE 11
 
-#define VERBOSE_SDRAM (1<<0)
-#define VERBOSE_LEQ (1<<1)
-#define VERBOSE_GEQ (1<<2)
-#define VERBOSE_READS (1<<3)
-#define VERBOSE_WRITES (1<<4)
-#define VERBOSE_VERIFY (1<<5)
-#define VERBOSE_ADDRESS (1<<6)
-#define VERBOSE_COMPACT (1<<7)
+// Decoder checkpoints, see checkpoint_write
+#define CHECKPOINTMAGIC 0x4B435452
+#define CHECKPOINTMARKER 0x54504B43
+#define CHECKPOINTVERSION 3
+#define CHECKPOINTWINDOW 32768
+#define CHECKPOINTFIELDS 65
+#define CHECKPOINTINTERVAL (16 * 1024 * 1024)
+#define MAXJOBS 64
 
 typedef struct
 {
-	unsigned int type;
-	unsigned int curaddress;
-	unsigned int orgaddress;
-	unsigned int size;
-	unsigned int capacity;
-	unsigned char* buffer;
-} rwaccumulator;
-
-typedef struct
-{
-	unsigned int active;
-	unsigned int row;
-	unsigned int column;
-	unsigned int bank;
-	unsigned int cs;
-	unsigned int address;
-} entryrwqueue;
-
-typedef struct
-{
-	unsigned char* memory;
+	rammemory memory;
 	unsigned int state;
 	rwaccumulator acc;
 	entryrwqueue readqueue[7];
@@ -47,219 +35,174 @@ typedef struct
 	unsigned int lastcolumn;
 	unsigned int lastbank;
 	unsigned int bankrowtable[8];
-	unsigned int sampleindex;
+	unsigned long long sampleindex;
 	unsigned int samplerestsize;
 	unsigned char samplerestdata[SAMPLESIZE];
 	unsigned int verbose;
-	unsigned int verboseleq;
-	unsigned int verbosegeq;
+	unsigned long long verboseleq;
+	unsigned long long verbosegeq;
 	unsigned int verboseaddress;
 	unsigned long long stopindex;
+	outbuffer out;
+	outbuffer events;
+	watchlist watch;
+	unsigned int pipeline;
+	unsigned char* dirty;
+	FILE* checkpointfile;
+	unsigned long long checkpointinterval;
 } ramcontext;
 
-typedef enum commands
-{
-	UNKNOWN = 0,
-	NOP,
-	MSR,
-	ACTIVATE,
-	PRECHARGE,
-	WRITE,
-	BST,
-	READ
-};
-
-typedef enum states
-{
-	IDLING,
-	READING,
-	WRITING,
-};
-
-unsigned char shuffle(unsigned int order, unsigned char c)
+/*
+ * A place in the trace where decoding can pick up again: a deflate block
+ * boundary 'outoffset' bytes into the inflated trace, 'bits' bits before byte
+ * 'inoffset' of the trace file, and the inflated data of up to 32 KB before it.
+ */
+typedef struct
 {
-	unsigned char out = 0;
-	int i;
-	for (i = 0; i < 8; i++) {
-		out |= ((c >> ((order >> (i*4)) & 0xF)) & 1) << i;
-	}
-	return out;
-}
-
-void fix_data_order(unsigned int *mask, unsigned char *data)
+	unsigned long long sampleindex;
+	unsigned long long outoffset;
+	unsigned long long inoffset;
+	unsigned int bits;
+	unsigned int windowsize;
+	unsigned char* window;
+} checkpoint;
+
+/*
+ * The last 32 KB of inflated trace, needed to inflate from a checkpoint.
+ */
+typedef struct
 {
-	unsigned char input_data[8];
-
-	*mask = ((*mask << 2) | (*mask >> 6)) & 0xFF;
+	unsigned char* data;
+	unsigned int pos;
+	unsigned int size;
+} tracewindow;
 
-	memcpy(input_data, data, 8);
-	data[0] = input_data[6];
-	data[1] = input_data[7];
-	data[2] = input_data[0];
-	data[3] = input_data[1];
-	data[4] = input_data[2];
-	data[5] = input_data[3];
-	data[6] = input_data[4];
-	data[7] = input_data[5];
-}
+// Bit orders of the odd data bytes for fix_data_order_more, filled in by main
+static unsigned char shuffle1[256];
+static unsigned char shuffle3[256];
 
 void fix_data_order_more(unsigned char *data)
 {
-	data[1] = shuffle(0x76542130, data[1]);
-	data[3] = shuffle(0x67543210, data[3]);
-	data[5] = shuffle(0x76542130, data[5]);
-	data[7] = shuffle(0x67543210, data[7]);
+	data[1] = shuffle1[data[1]];
+	data[3] = shuffle3[data[3]];
+	data[5] = shuffle1[data[5]];
+	data[7] = shuffle3[data[7]];
 }
 
 
-void rwacc_init(rwaccumulator* acc)
+unsigned int sdram_command(unsigned int control)
 {
-	acc->type = ~0;
-	acc->curaddress = 0;
-	acc->orgaddress = 0;
-	acc->size = 0;
-	acc->capacity = 0;
-	acc->buffer = 0;
-}
-
-void rwacc_destroy(rwaccumulator* acc)
-{
-	free(acc->buffer);
-}
-
-int rwacc_sametransaction(rwaccumulator* acc, unsigned int type, unsigned int address)
-{
-	return (acc->type == type && address == acc->curaddress);
+	switch( (control >> 2) & 7 )
+	{
+		case 0: return MSR;
+		case 1: return PRECHARGE;
+		case 2: return READ;
+		case 4: return WRITE;
+		case 5: return BST;
+		case 6: return ACTIVATE;
+		case 7: return NOP;
+		default: return UNKNOWN;
+	}
 }
 
-#define DUMPWIDTH 32
-void rwacc_printascii(unsigned char c)
+/*
+ * Moves the read and write queues on by one sample, and follows the SDRAM
+ * command in 'control' to queue the accesses of the next samples.
+ */
+void sdram_advance(ramcontext* context, unsigned int control)
 {
-	if (c >= 0x20 && c <= 0x7e)
-		printf("%c", c);
-	else
-		printf(".");
-}
-void rwacc_dump(rwaccumulator* acc, unsigned int sampleindex)
-{
-	unsigned int i,j;
-	unsigned char data[DUMPWIDTH];
-	unsigned int x = 0;
-	unsigned int y = 0;
-	unsigned int address = acc->orgaddress;
-
-	if (acc->size == 0)
-		return;
-
+	unsigned int address = (control >> 9) & 0x7FFF;
+	unsigned int bank = (address>>13)&3;
+	unsigned int column = address & 0xFF;
+	unsigned int row = address & 0x1FFF;
+	unsigned int unk = (control >> 5) & 0xF;
+	unsigned int cs0 = control & 1;
+	unsigned int cs1 = (control>>1) & 1;
+	unsigned int command = sdram_command(control);
+	unsigned int i;
 
+	for(i=6; i>=1; i--)
+		context->readqueue[i] = context->readqueue[i-1];
+	context->readqueue[0].active = 0;
+	context->writequeue[0].active = 0;
 
-	for(i=0; i<acc->size; i++)
+	if ( (!cs0 || !cs1) && (command == WRITE) )
 	{
-		if (x == 0)
-		{
-			//if (y == 0)
-			{
-				if (acc->type == READ)
-					printf("RD ");
-				else if (acc->type == WRITE)
-					printf("WR ");
-				printf("%08X", address);
-			}
-			//else
-			//{
-			//	printf("   ");
-			//	printf("%08X", address);
-			//}
-		}
-		
-		data[x] = acc->buffer[i];
-		address++;
-		printf(" %02X", data[x]);
-		x++;
-		if (x >= DUMPWIDTH)
+		context->state = WRITING;
+		context->lastcolumn = column;
+		context->lastbank = bank;
+		context->lastrow = context->bankrowtable[bank + cs0*4];
+		context->lastcs = cs0;
+	}
+	else if ( (!cs0 || !cs1) && (command == READ) )
+	{
+		context->state = READING;
+		context->lastcolumn = column;
+		context->lastbank = bank;
+		context->lastrow = context->bankrowtable[bank + cs0*4];
+		context->lastcs = cs0;
+	}
+	else if ( (!cs0 || !cs1) && (command == BST) )
+	{
+		context->state = IDLING;
+	}
+	else if ( (!cs0 || !cs1) && (command == PRECHARGE) )
+	{
+		if (address & (1<<10))
+			context->state = IDLING;
+		else if (bank == context->lastbank)
+			context->state = IDLING;
+
+		if ( ((unk & 1)==0) && (context->state == IDLING) )
 		{
-			printf("  ");
-			for(j=0; j<DUMPWIDTH; j++)
-				rwacc_printascii(data[j]);
-
-			printf("  %08x", sampleindex);
-			x = 0;
-			y++;
-			printf("\n");
+			for(i=0; i<5; i++)
+				context->readqueue[i].active = 0;
 		}
 	}
-
-	if (x)
+	else if ( (!cs0 || !cs1) && (command == ACTIVATE) )
 	{
-		for(j=x; j<DUMPWIDTH; j++)
-			printf("   ");
-		printf("  ");
-		for(j=0; j<x; j++)
-			rwacc_printascii(data[j]);
-
-		printf("  %08x", sampleindex);
-		printf("\n");
+		context->bankrowtable[bank + cs0*4] = row;
 	}
-}
-
-void rwacc_settransaction(rwaccumulator* acc, unsigned int type, unsigned int address)
-{
-	acc->type = type;
-	acc->orgaddress = address;
-	acc->curaddress = address;
-	acc->size = 0;
-}
 
-void rwacc_addbuffer(rwaccumulator* acc, unsigned char* buffer, unsigned int size)
-{
-	unsigned int available = acc->capacity - acc->size;
-	
-
-	if (available < size)
+	if (context->state == READING)
 	{
-		unsigned char* newbuffer = 0;
-		unsigned int newcapacity = acc->capacity * 2;
-
-		if (newcapacity <= 0)
-			newcapacity = 2;
-
-		while( (newcapacity - acc->size) < size )
-			newcapacity *= 2;
-
-		
-		newbuffer = malloc(newcapacity);
-
-		if (acc->buffer)
+		if ( (unk & 1) == 0 )
 		{
-			memcpy(newbuffer, acc->buffer, acc->capacity);
-
-			free(acc->buffer);
+			context->readqueue[0].active = 1;
+			context->readqueue[0].address = context->lastcolumn | (context->lastbank<<8) | (context->lastrow<<10) | (context->lastcs<<23);
+			context->readqueue[0].row = context->lastrow;
+			context->readqueue[0].column = context->lastcolumn;
+			context->readqueue[0].bank = context->lastbank;
+			context->readqueue[0].cs = context->lastcs;
 		}
-
-		acc->capacity = newcapacity;
-		acc->buffer = newbuffer;
+		else
+		{
+			context->readqueue[4].active = 1;
+			context->readqueue[4].address = context->lastcolumn | (context->lastbank<<8) | (context->lastrow<<10) | (context->lastcs<<23);
+			context->readqueue[4].row = context->lastrow;
+			context->readqueue[4].column = context->lastcolumn;
+			context->readqueue[4].bank = context->lastbank;
+			context->readqueue[4].cs = context->lastcs;
+		}
+		context->lastcolumn++;
+		context->lastcolumn &= 0xFF;
 	}
-
-	memcpy(acc->buffer + acc->size, buffer, size);
-
-	acc->size += size;
-	acc->curaddress += size;
-}
-
-void rwacc_addsample(rwaccumulator* acc, unsigned int sampleindex, unsigned int type, unsigned int address, unsigned char* data, unsigned int size)
-{
-	if (!rwacc_sametransaction(acc, type, address))
+	else if (context->state == WRITING)
 	{
-		rwacc_dump(acc, sampleindex);
-		rwacc_settransaction(acc, type, address);
+		context->writequeue[0].active = 1;
+		context->writequeue[0].address = context->lastcolumn | (context->lastbank<<8) | (context->lastrow<<10) | (context->lastcs<<23);
+		context->writequeue[0].row = context->lastrow;
+		context->writequeue[0].column = context->lastcolumn;
+		context->writequeue[0].bank = context->lastbank;
+		context->writequeue[0].cs = context->lastcs;
+		context->lastcolumn++;
+		context->lastcolumn &= 0xFF;
 	}
-
-	rwacc_addbuffer(acc, data, size);
 }
 
 int processsample(ramcontext* context, unsigned char* sampledata)
 {
-	unsigned int sampleindex = context->sampleindex;
+	unsigned long long sampleindex = context->sampleindex;
 
 	unsigned int i;
 	unsigned int control;
@@ -274,6 +217,7 @@ int processsample(ramcontext* context, unsigned char* sampledata)
 	unsigned int verbose = 0;
 	unsigned int diff = 0;
 	entryrwqueue* rwentry = 0;
+	char* p;
 
 
 	if (context->sampleindex >= context->stopindex)
@@ -304,17 +248,7 @@ int processsample(ramcontext* context, unsigned char* sampledata)
 	//fix_data_order_more(sampledata+3);
 
 
-	switch( (control >> 2) & 7 )
-	{
-		case 0: command = MSR; break;
-		case 1: command = PRECHARGE; break;
-		case 2: command = READ; break;
-		case 4: command = WRITE; break;
-		case 5: command = BST; break;
-		case 6: command = ACTIVATE; break;
-		case 7: command = NOP; break;
-		default: command = UNKNOWN; break;
-	}
+	command = sdram_command(control);
 
 	rwentry = &context->readqueue[6];
 	if (rwentry->active)
@@ -323,38 +257,48 @@ int processsample(ramcontext* context, unsigned char* sampledata)
 			verbose |= VERBOSE_READS;
 
 		//if (verbose & VERBOSE_COMPACT)
-		//	rwacc_addsample(&context->acc, sampleindex, READ, rwentry->address*8, sampledata+3, 8);
+		//	rwacc_addsample(&context->acc, &context->out, sampleindex, READ, rwentry->address*8, sampledata+3, 8);
 		
 		if (verbose & VERBOSE_READS)
 		{
-			printf("% 9d: ", sampleindex);
-			printf("READ ");
-			for(i=0; i<8; i++)
-			{
-				if (i != 0)
-					printf(".");
-				printf("%02X", sampledata[3+i]);
-			}
-			printf(" unk=");
-			for(i=0; i<4; i++)
-				printf("%d", (unk>>(3-i))&1);
-			printf(" mask=");
-			for(i=0; i<8; i++)
-				printf("%d", (mask>>(7-i))&1);
-			printf(" address=%08x bank=%04x row=%04x column=%04x\n", rwentry->address, rwentry->bank, rwentry->row, rwentry->column);
+			p = out_reserve(&context->out, OUTLINEMAX);
+			p = fmt_index(p, sampleindex);
+			p = fmt_str(p, ": READ ");
+			p = fmt_data(p, sampledata+3);
+			p = fmt_str(p, " unk=");
+			p = fmt_bits(p, unk, 3, 4);
+			p = fmt_str(p, " mask=");
+			p = fmt_bits(p, mask, 7, 8);
+			p = fmt_str(p, " address=");
+			p = fmt_hex(p, rwentry->address, 8, hexlower);
+			p = fmt_str(p, " bank=");
+			p = fmt_hex(p, rwentry->bank, 4, hexlower);
+			p = fmt_str(p, " row=");
+			p = fmt_hex(p, rwentry->row, 4, hexlower);
+			p = fmt_str(p, " column=");
+			p = fmt_hex(p, rwentry->column, 4, hexlower);
+			*p++ = '\n';
+			out_commit(&context->out, p);
 		}
 
+		if (verbose & VERBOSE_EVENTS)
+			out_event(&context->events, sampleindex, EVENT_READ, rwentry->address*8, mask, sampledata+3);
+
+		if (context->watch.count)
+			watch_access(&context->watch, &context->memory, &context->out, sampleindex, READ, rwentry->address*8, sampledata+3, mask);
+
 		if (verbose & VERBOSE_VERIFY)
 		{
-			if (0 != memcmp(context->memory + rwentry->address*8, sampledata+3, 8))
+			unsigned char expected[8];
+
+			if (mem_verify(&context->memory, rwentry->address*8, sampledata+3, expected))
 			{
-				printf("Verify mismatch sample %d, address %08x:\n", sampleindex, rwentry->address);
-				for(i=0; i<8; i++)
-					printf("%02X ", context->memory[rwentry->address*8 + i]);
-				printf("vs ");
-				for(i=0; i<8; i++)
-					printf("%02X ", sampledata[3+i]);
-				printf("\n");
+				unsigned char* data = sampledata+3;
+
+				out_printf(&context->out, "Verify mismatch sample %llu, address %08x:\n"
+						   "%02X %02X %02X %02X %02X %02X %02X %02X vs %02X %02X %02X %02X %02X %02X %02X %02X \n", sampleindex, rwentry->address,
+						   expected[0], expected[1], expected[2], expected[3], expected[4], expected[5], expected[6], expected[7],
+						   data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7]);
 			}
 		}
 	}
@@ -370,258 +314,619 @@ int processsample(ramcontext* context, unsigned char* sampledata)
 			for(i=0; i<8; i++)
 			{
 				if ((mask & (1<<i)) == 0)
-					rwacc_addsample(&context->acc, sampleindex, WRITE, rwentry->address*8+i, sampledata+3+i, 1);
+					rwacc_addsample(&context->acc, &context->out, sampleindex, WRITE, rwentry->address*8+i, sampledata+3+i, 1);
 			}
 		}
 
 		if (verbose & VERBOSE_WRITES)
 		{
-			printf("% 9d: ", sampleindex);
-			printf("WRITE ");
-			for(i=0; i<8; i++)
+			p = out_reserve(&context->out, OUTLINEMAX);
+			p = fmt_index(p, sampleindex);
+			p = fmt_str(p, ": WRITE ");
+			p = fmt_data(p, sampledata+3);
+			p = fmt_str(p, " unk=");
+			p = fmt_bits(p, unk, 3, 4);
+			p = fmt_str(p, " mask=");
+			p = fmt_bits(p, mask, 7, 8);
+			p = fmt_str(p, " address=");
+			p = fmt_hex(p, rwentry->address, 8, hexlower);
+			p = fmt_str(p, " bank=");
+			p = fmt_hex(p, rwentry->bank, 4, hexlower);
+			p = fmt_str(p, " row=");
+			p = fmt_hex(p, rwentry->row, 4, hexlower);
+			p = fmt_str(p, " column=");
+			p = fmt_hex(p, rwentry->column, 4, hexlower);
+			*p++ = '\n';
+			out_commit(&context->out, p);
+		}
+
+		if (verbose & VERBOSE_EVENTS)
+			out_event(&context->events, sampleindex, EVENT_WRITE, rwentry->address*8, mask, sampledata+3);
+
+		if (context->watch.count)
+			watch_access(&context->watch, &context->memory, &context->out, sampleindex, WRITE, rwentry->address*8, sampledata+3, mask);
+
+		mem_write(&context->memory, rwentry->address*8, sampledata+3, mask);
+		context->dirty[((rwentry->address*8) & context->memory.addressmask) >> MEMORYPAGESHIFT] = 1;
+	}
+
+	sdram_advance(context, control);
+
+	diff = 0;
+	for(i=0; i<8; i++)
+		if (sampledata[3+i] != 0)
+			diff = 1;
+
+	if ((!cs0 || !cs1) && ((command != NOP) || diff))
+	{
+		if (verbose & VERBOSE_SDRAM)
+		{
+			p = out_reserve(&context->out, OUTLINEMAX);
+			p = fmt_index(p, sampleindex);
+			p = fmt_str(p, ": ");
+			p = fmt_bits(p, control, 1, 2);
+			*p++ = ' ';
+			p = fmt_bits(p, control, 4, 3);
+			*p++ = ' ';
+			p = fmt_bits(p, control, 8, 4);
+			*p++ = ' ';
+			p = fmt_bits(p, control, 21, 13);
+			*p++ = ' ';
+			p = fmt_bits(p, control, 23, 2);
+			*p++ = ' ';
+			p = fmt_data(p, sampledata+3);
+			*p++ = ' ';
+
+			if (command == ACTIVATE)
 			{
-				if (i != 0)
-					printf(".");
-				printf("%02X", sampledata[3+i]);
+				p = fmt_str(p, "ACT bank=");
+				*p++ = '0' + bank;
+				p = fmt_str(p, " row=");
+				p = fmt_hex(p, row, 4, hexlower);
 			}
-			printf(" unk=");
-			for(i=0; i<4; i++)
-				printf("%d", (unk>>(3-i))&1);
-			printf(" mask=");
-			for(i=0; i<8; i++)
-				printf("%d", (mask>>(7-i))&1);
-			printf(" address=%08x bank=%04x row=%04x column=%04x\n", rwentry->address, rwentry->bank, rwentry->row, rwentry->column);
+			else if (command == PRECHARGE)
+			{
+				p = fmt_str(p, "PRECHARGE");
+				if (address & (1<<10))
+					p = fmt_str(p, " all banks");
+				else
+				{
+					p = fmt_str(p, " bank=");
+					*p++ = '0' + bank;
+				}
+			}
+			else if (command == WRITE || command == READ)
+			{
+				p = fmt_str(p, (command == WRITE)? "WRITE bank=" : "READ bank=");
+				*p++ = '0' + bank;
+				p = fmt_str(p, " column=");
+				p = fmt_hex(p, column, 4, hexlower);
+			}
+			else if (command == NOP)
+				p = fmt_str(p, "NOP");
+			else if (command == BST)
+				p = fmt_str(p, "BST");
+			else if (command == MSR)
+				p = fmt_str(p, "MSR");
+			else
+				p = fmt_str(p, "UNKNOWN");
+
+			*p++ = '\n';
+			out_commit(&context->out, p);
 		}
+	}
+
+	return 1;
+}
+
+/*
+ * processsample for samples that can't produce any output: only the SDRAM
+ * state, the access queues and the memory are kept up to date.
+ */
+void processquiet(ramcontext* context, unsigned char* sampledata)
+{
+	unsigned int control = (sampledata[0]<<0) | (sampledata[1]<<8) | (sampledata[2]<<16);
+	unsigned int mask = (control >> 11) & 0xFF;
+	entryrwqueue* rwentry = &context->writequeue[0];
+
+	fix_data_order(&mask, sampledata+3);
 
-		for(i=0; i<8; i++)
+	if (rwentry->active)
+	{
+		mem_write(&context->memory, rwentry->address*8, sampledata+3, mask);
+		context->dirty[((rwentry->address*8) & context->memory.addressmask) >> MEMORYPAGESHIFT] = 1;
+	}
+
+	sdram_advance(context, control);
+}
+
+/*
+ * Runs the samples that can't produce output through processquiet, up to
+ * 'count' of them. Outside the --verbose-geq/--verbose-leq window nothing is
+ * printed, and inside it with only --verbose-address just the accesses to
+ * that address are. Accesses to pages in the --watch list always go through
+ * processsample. Returns the number of samples taken, the sample after them
+ * needs processsample.
+ */
+unsigned int fastforward(ramcontext* context, unsigned char* samples, unsigned int count)
+{
+	unsigned int loud = context->verbose & (VERBOSE_SDRAM | VERBOSE_READS | VERBOSE_WRITES | VERBOSE_VERIFY | VERBOSE_COMPACT | VERBOSE_EVENTS);
+	unsigned int watch = context->verbose & VERBOSE_ADDRESS;
+	unsigned int i;
+
+	for(i=0; i<count; i++)
+	{
+		if (context->sampleindex >= context->stopindex)
+			break;
+
+		if (context->readqueue[6].active && watch_page(&context->watch, context->readqueue[6].address*8))
+			break;
+		if (context->writequeue[0].active && watch_page(&context->watch, context->writequeue[0].address*8))
+			break;
+
+		if ( !((context->verbose & VERBOSE_LEQ) && (context->sampleindex > context->verboseleq)) &&
+			 !((context->verbose & VERBOSE_GEQ) && (context->sampleindex < context->verbosegeq)) )
 		{
-			if ((mask & (1<<i)) == 0)
-				memcpy(context->memory + rwentry->address*8 + i, sampledata+3+i, 1);
+			if (loud)
+				break;
+			if (watch && context->readqueue[6].active && context->readqueue[6].address == context->verboseaddress)
+				break;
+			if (watch && context->writequeue[0].active && context->writequeue[0].address == context->verboseaddress)
+				break;
 		}
+
+		processquiet(context, samples + i*SAMPLESIZE);
+		context->sampleindex++;
 	}
 
-	for(i=6; i>=1; i--)
-		context->readqueue[i] = context->readqueue[i-1];
-	context->readqueue[0].active = 0;
-	context->writequeue[0].active = 0;
+	return i;
+}
 
-	if ( (!cs0 || !cs1) && (command == WRITE) )
+// Sample stream handling shared by the decoders, built around processsample
+#define DECODER_FASTFORWARD
+#include "decoderstream.h"
+
+void window_add(tracewindow* window, unsigned char* data, unsigned int size)
+{
+	unsigned int copysize;
+
+	if (size >= CHECKPOINTWINDOW)
 	{
-		context->state = WRITING;
-		context->lastcolumn = column;
-		context->lastbank = bank;
-		context->lastrow = context->bankrowtable[bank + cs0*4];
-		context->lastcs = cs0;
+		memcpy(window->data, data + size - CHECKPOINTWINDOW, CHECKPOINTWINDOW);
+		window->pos = 0;
+		window->size = CHECKPOINTWINDOW;
+		return;
 	}
-	else if ( (!cs0 || !cs1) && (command == READ) )
+
+	copysize = CHECKPOINTWINDOW - window->pos;
+	if (copysize > size)
+		copysize = size;
+	memcpy(window->data + window->pos, data, copysize);
+	memcpy(window->data, data + copysize, size - copysize);
+	window->pos = (window->pos + size) % CHECKPOINTWINDOW;
+	window->size += size;
+	if (window->size > CHECKPOINTWINDOW)
+		window->size = CHECKPOINTWINDOW;
+}
+
+void fputle32(FILE* f, unsigned int value)
+{
+	unsigned char data[4];
+
+	data[0] = value;
+	data[1] = value >> 8;
+	data[2] = value >> 16;
+	data[3] = value >> 24;
+	fwrite(data, 1, 4, f);
+}
+
+void fputle64(FILE* f, unsigned long long value)
+{
+	fputle32(f, (unsigned int)value);
+	fputle32(f, (unsigned int)(value >> 32));
+}
+
+unsigned int fgetle32(FILE* f)
+{
+	unsigned char data[4];
+
+	if (fread(data, 1, 4, f) != 4)
+		return 0;
+	return data[0] | (data[1]<<8) | (data[2]<<16) | ((unsigned int)data[3]<<24);
+}
+
+unsigned long long fgetle64(FILE* f)
+{
+	unsigned long long low = fgetle32(f);
+
+	return low | ((unsigned long long)fgetle32(f) << 32);
+}
+
+/*
+ * Lists the decoder state saved with a checkpoint, in the order it's stored.
+ */
+unsigned int checkpoint_fields(ramcontext* context, unsigned int** fields)
+{
+	unsigned int count = 0;
+	unsigned int i;
+	entryrwqueue* entry;
+
+	fields[count++] = &context->state;
+	fields[count++] = &context->lastcs;
+	fields[count++] = &context->lastrow;
+	fields[count++] = &context->lastcolumn;
+	fields[count++] = &context->lastbank;
+	for(i=0; i<8; i++)
+		fields[count++] = &context->bankrowtable[i];
+	for(i=0; i<8; i++)
 	{
-		context->state = READING;
-		context->lastcolumn = column;
-		context->lastbank = bank;
-		context->lastrow = context->bankrowtable[bank + cs0*4];
-		context->lastcs = cs0;
+		entry = (i < 7)? &context->readqueue[i] : &context->writequeue[0];
+		fields[count++] = &entry->active;
+		fields[count++] = &entry->row;
+		fields[count++] = &entry->column;
+		fields[count++] = &entry->bank;
+		fields[count++] = &entry->cs;
+		fields[count++] = &entry->address;
 	}
-	else if ( (!cs0 || !cs1) && (command == BST) )
+	fields[count++] = &context->acc.type;
+	fields[count++] = &context->acc.curaddress;
+	fields[count++] = &context->acc.orgaddress;
+	fields[count++] = &context->samplerestsize;
+
+	return count;
+}
+
+/*
+ * The compact accumulator saved with a checkpoint depends on which samples were
+ * accumulated, so it only fits runs with the same compact settings.
+ */
+void checkpoint_compact(ramcontext* context, unsigned long long* compact)
+{
+	compact[0] = 0;
+	compact[1] = 0;
+	compact[2] = 0;
+	if (context->verbose & VERBOSE_COMPACT)
 	{
-		context->state = IDLING;
+		compact[0] = context->verbose & (VERBOSE_COMPACT | VERBOSE_LEQ | VERBOSE_GEQ);
+		if (context->verbose & VERBOSE_LEQ)
+			compact[1] = context->verboseleq;
+		if (context->verbose & VERBOSE_GEQ)
+			compact[2] = context->verbosegeq;
 	}
-	else if ( (!cs0 || !cs1) && (command == PRECHARGE) )
-	{
-		if (address & (1<<10))
-			context->state = IDLING;
-		else if (bank == context->lastbank)
-			context->state = IDLING;
+}
+
+void checkpoint_writeheader(ramcontext* context)
+{
+	FILE* f = context->checkpointfile;
+	unsigned long long compact[3];
+
+	checkpoint_compact(context, compact);
+
+	fputle32(f, CHECKPOINTMAGIC);
+	fputle32(f, CHECKPOINTVERSION);
+	fputle32(f, SAMPLESIZE);
+	fputle32(f, MEMORYPAGESIZE);
+	fputle32(f, context->memory.addressbits);
+	fputle32(f, (unsigned int)compact[0]);
+	fputle64(f, compact[1]);
+	fputle64(f, compact[2]);
+}
+
+int checkpoint_readheader(FILE* f, unsigned int addressbits, unsigned long long* compact)
+{
+	if (fgetle32(f) != CHECKPOINTMAGIC || fgetle32(f) != CHECKPOINTVERSION)
+		return -1;
+	if (fgetle32(f) != SAMPLESIZE || fgetle32(f) != MEMORYPAGESIZE || fgetle32(f) != addressbits)
+		return -1;
+	compact[0] = fgetle32(f);
+	compact[1] = fgetle64(f);
+	compact[2] = fgetle64(f);
+	return feof(f)? -1 : 0;
+}
+
+/*
+ * Checkpoint file format, after a 40 byte header (magic, version, sample size,
+ * page size, address bits, compact settings), one record per checkpoint, all
+ * values little-endian:
+ *
+ *   le32  marker
+ *   le64  inflated trace offset
+ *   le64  compressed trace offset
+ *   le32  bits of the previous compressed byte still to inflate
+ *   le32  window size
+ *   le32  compact accumulator size
+ *   le32  page count
+ *   u8[]  window
+ *   le32  decoder state, CHECKPOINTFIELDS words, see checkpoint_fields
+ *   u8[]  partial sample, SAMPLESIZE bytes
+ *   u8[]  compact accumulator
+ *   pages, each a le32 page number and a memorypage
+ *
+ * Only the memory pages written since the previous checkpoint are stored, so
+ * the memory at a checkpoint is rebuilt from all records up to it.
+ */
+int checkpoint_write(ramcontext* context, tracewindow* window, unsigned long long outoffset, unsigned long long inoffset, unsigned int bits)
+{
+	FILE* f = context->checkpointfile;
+	unsigned int* fields[CHECKPOINTFIELDS];
+	unsigned int pagecount = 0;
+	unsigned int i;
 
-		if ( ((unk & 1)==0) && (context->state == IDLING) )
-		{
-			for(i=0; i<5; i++)
-				context->readqueue[i].active = 0;
-		}
+	for(i=0; i<context->memory.pagecount; i++)
+		if (context->dirty[i])
+			pagecount++;
+
+	fputle32(f, CHECKPOINTMARKER);
+	fputle64(f, outoffset);
+	fputle64(f, inoffset);
+	fputle32(f, bits);
+	fputle32(f, window->size);
+	fputle32(f, context->acc.size);
+	fputle32(f, pagecount);
+
+	if (window->size == CHECKPOINTWINDOW)
+	{
+		fwrite(window->data + window->pos, 1, CHECKPOINTWINDOW - window->pos, f);
+		fwrite(window->data, 1, window->pos, f);
 	}
-	else if ( (!cs0 || !cs1) && (command == ACTIVATE) )
+	else
 	{
-		context->bankrowtable[bank + cs0*4] = row;
+		fwrite(window->data, 1, window->size, f);
 	}
 
-	if (context->state == READING)
+	checkpoint_fields(context, fields);
+	for(i=0; i<CHECKPOINTFIELDS; i++)
+		fputle32(f, *fields[i]);
+	fwrite(context->samplerestdata, 1, SAMPLESIZE, f);
+	fwrite(context->acc.buffer, 1, context->acc.size, f);
+
+	for(i=0; i<context->memory.pagecount; i++)
 	{
-		if ( (unk & 1) == 0 )
+		if (context->dirty[i])
 		{
-			context->readqueue[0].active = 1;
-			context->readqueue[0].address = context->lastcolumn | (context->lastbank<<8) | (context->lastrow<<10) | (context->lastcs<<23);
-			context->readqueue[0].row = context->lastrow;
-			context->readqueue[0].column = context->lastcolumn;
-			context->readqueue[0].bank = context->lastbank;
-			context->readqueue[0].cs = context->lastcs;
-		}
-		else
-		{
-			context->readqueue[4].active = 1;
-			context->readqueue[4].address = context->lastcolumn | (context->lastbank<<8) | (context->lastrow<<10) | (context->lastcs<<23);
-			context->readqueue[4].row = context->lastrow;
-			context->readqueue[4].column = context->lastcolumn;
-			context->readqueue[4].bank = context->lastbank;
-			context->readqueue[4].cs = context->lastcs;
+			fputle32(f, i);
+			fwrite(context->memory.pages[i], sizeof(memorypage), 1, f);
+			context->dirty[i] = 0;
 		}
-		context->lastcolumn++;
-		context->lastcolumn &= 0xFF;
-	}
-	else if (context->state == WRITING)
-	{
-		context->writequeue[0].active = 1;
-		context->writequeue[0].address = context->lastcolumn | (context->lastbank<<8) | (context->lastrow<<10) | (context->lastcs<<23);
-		context->writequeue[0].row = context->lastrow;
-		context->writequeue[0].column = context->lastcolumn;
-		context->writequeue[0].bank = context->lastbank;
-		context->writequeue[0].cs = context->lastcs;
-		context->lastcolumn++;
-		context->lastcolumn &= 0xFF;
 	}
 
-	diff = 0;
-	for(i=0; i<8; i++)
-		if (sampledata[3+i] != 0)
-			diff = 1;
+	return ferror(f);
+}
 
-	if ((!cs0 || !cs1) && ((command != NOP) || diff))
+int checkpoint_readrecord(FILE* f, checkpoint* point, unsigned int* accsize, unsigned int* pagecount)
+{
+	if (fgetle32(f) != CHECKPOINTMARKER)
+		return -1;
+
+	point->outoffset = fgetle64(f);
+	point->sampleindex = point->outoffset / SAMPLESIZE;
+	point->inoffset = fgetle64(f);
+	point->bits = fgetle32(f);
+	point->windowsize = fgetle32(f);
+	*accsize = fgetle32(f);
+	*pagecount = fgetle32(f);
+
+	if (feof(f) || ferror(f) || point->bits > 7 || point->windowsize > CHECKPOINTWINDOW || *pagecount > (1U << (MEMORYMAXBITS - MEMORYPAGESHIFT)))
+		return -1;
+	return 0;
+}
+
+/*
+ * Reads where every checkpoint in the file is, without the decoder state.
+ */
+int checkpoint_index(FILE* f, unsigned int addressbits, checkpoint** points, unsigned int* count, unsigned long long* compact)
+{
+	unsigned int capacity = 0;
+	unsigned int accsize;
+	unsigned int pagecount;
+	checkpoint point;
+	long skip;
+
+	*points = 0;
+	*count = 0;
+
+	if (0 != checkpoint_readheader(f, addressbits, compact))
+		return -1;
+
+	while(0 == checkpoint_readrecord(f, &point, &accsize, &pagecount))
 	{
-		if (verbose & VERBOSE_SDRAM)
-		{
-			printf("% 9d: ", sampleindex);
-			for(i=0; i<2; i++)
-				printf("%d", (control>>(1-i))&1);
-			printf(" ");
-			for(i=0; i<3; i++)
-				printf("%d", (control>>(4-i))&1);
-			printf(" ");
-			for(i=0; i<4; i++)
-				printf("%d", (control>>(8-i))&1);
-			printf(" ");
-			for(i=0; i<13; i++)
-				printf("%d", (control>>(21-i))&1);
-			printf(" ");
-			for(i=0; i<2; i++)
-				printf("%d", (control>>(23-i))&1);
-			printf(" ");
-			for(i=0; i<8; i++)
-			{
-				if (i != 0)
-					printf(".");
-				printf("%02X", sampledata[3+i]);
-			}
-			printf(" ");
+		// A record cut short, as when the writing run was interrupted, ends the index
+		skip = point.windowsize + CHECKPOINTFIELDS*4 + SAMPLESIZE + accsize + pagecount * (4 + sizeof(memorypage));
+		if (0 != fseek(f, skip - 1, SEEK_CUR) || getc(f) == EOF)
+			break;
 
-			if (command == ACTIVATE)
-				printf("ACT bank=%d row=%04x", bank, row);
-			else if (command == PRECHARGE)
-			{
-				printf("PRECHARGE");
-				if (address & (1<<10))
-					printf(" all banks");
-				else
-					printf(" bank=%d", bank);
-			}
-			else if (command == WRITE)
-				printf("WRITE bank=%d column=%04x", bank, column, bank);
-			else if (command == READ)
-				printf("READ bank=%d column=%04x", bank, column);
-			else if (command == NOP)
-				printf("NOP");
-			else if (command == BST)
-				printf("BST");
-			else if (command == MSR)
-				printf("MSR");
-			else
-				printf("UNKNOWN");
+		if (*count == capacity)
+		{
+			checkpoint* newpoints;
 
-			printf("\n");
+			capacity = capacity? capacity * 2 : 64;
+			newpoints = realloc(*points, capacity * sizeof(checkpoint));
+			if (newpoints == 0)
+				return -1;
+			*points = newpoints;
 		}
+
+		point.window = 0;
+		(*points)[(*count)++] = point;
 	}
 
-	return 1;
+	return ferror(f)? -1 : 0;
 }
 
-int processbuffer(ramcontext* context, unsigned char* buffer, unsigned int size)
+/*
+ * Restores the decoder state and memory at checkpoint 'target' of the file, and
+ * fills in 'point' so tracefrom can continue from there.
+ */
+int checkpoint_restore(FILE* f, ramcontext* context, unsigned int target, checkpoint* point)
 {
-	unsigned int samplecount;
-	unsigned int samplecopysize;
+	unsigned int* fields[CHECKPOINTFIELDS];
+	unsigned int values[CHECKPOINTFIELDS];
+	unsigned long long compact[3];
+	unsigned char* accdata = 0;
+	unsigned int accsize;
+	unsigned int pagecount;
+	unsigned int index;
+	unsigned int page;
 	unsigned int i;
 
+	if (0 != checkpoint_readheader(f, context->memory.addressbits, compact))
+		return -1;
 
-	if (context->samplerestsize)
+	for(index=0; index<=target; index++)
 	{
-		samplecopysize = SAMPLESIZE - context->samplerestsize;
-		if (samplecopysize > size)
-			samplecopysize = size;
+		if (0 != checkpoint_readrecord(f, point, &accsize, &pagecount))
+			return -1;
+
+		if (index < target)
+		{
+			if (0 != fseek(f, point->windowsize + CHECKPOINTFIELDS*4 + SAMPLESIZE + accsize, SEEK_CUR))
+				return -1;
+		}
+		else
+		{
+			point->window = malloc(CHECKPOINTWINDOW);
+			accdata = malloc(accsize + 1);
+			if (point->window == 0 || accdata == 0)
+			{
+				free(accdata);
+				return -1;
+			}
 
-		memcpy(context->samplerestdata + context->samplerestsize, buffer, samplecopysize);
+			fread(point->window, 1, point->windowsize, f);
+			for(i=0; i<CHECKPOINTFIELDS; i++)
+				values[i] = fgetle32(f);
+			fread(context->samplerestdata, 1, SAMPLESIZE, f);
+			fread(accdata, 1, accsize, f);
+		}
 
-		context->samplerestsize += samplecopysize;
-		buffer += samplecopysize;
-		size -= samplecopysize;
+		for(i=0; i<pagecount; i++)
+		{
+			page = fgetle32(f);
+			if (page >= context->memory.pagecount)
+				break;
+			fread(mem_page(&context->memory, page), sizeof(memorypage), 1, f);
+		}
 
-		if (context->samplerestsize == SAMPLESIZE)
+		if (feof(f) || ferror(f) || i != pagecount)
 		{
-			if (0 == processsample(context, context->samplerestdata))
-				return 0;
-			context->sampleindex++;
-			context->samplerestsize = 0;
+			free(accdata);
+			return -1;
 		}
 	}
 
-	if (size)
-	{
-		samplecount = size / SAMPLESIZE;
+	rwacc_settransaction(&context->acc, context->acc.type, 0);
+	rwacc_addbuffer(&context->acc, accdata, accsize);
+	free(accdata);
 
-		for(i=0; i<samplecount; i++)
-		{
-			if (0 == processsample(context, buffer + i*SAMPLESIZE))
-				return 0;
-			context->sampleindex++;
-		}
+	checkpoint_fields(context, fields);
+	for(i=0; i<CHECKPOINTFIELDS; i++)
+		*fields[i] = values[i];
+	if (context->samplerestsize >= SAMPLESIZE)
+		return -1;
+	context->sampleindex = point->sampleindex;
+
+	return 0;
+}
+
+/*
+ * Sets up the inflate stream to continue at a checkpoint. The stream must have
+ * been initialised for raw deflate data.
+ */
+int checkpoint_seek(z_stream* stream, FILE* f, checkpoint* point)
+{
+	int result;
+	int c;
 
-		context->samplerestsize = size - (samplecount * SAMPLESIZE);
-		memcpy(context->samplerestdata, buffer + samplecount*SAMPLESIZE, context->samplerestsize);
+	if (0 != seekfile(f, point->inoffset - (point->bits? 1 : 0)))
+		return Z_ERRNO;
+
+	if (point->bits)
+	{
+		c = getc(f);
+		if (c == EOF)
+			return Z_ERRNO;
+		result = inflatePrime(stream, point->bits, c >> (8 - point->bits));
+		if (result != Z_OK)
+			return result;
 	}
 
-	return 1;
+	return inflateSetDictionary(stream, point->window, point->windowsize);
 }
 
-int traceram(ramcontext* context, FILE* f)
+/*
+ * Inflates and decodes the trace on the calling thread, from the start or from
+ * checkpoint 'start'. With a checkpoint file to write, a checkpoint is saved at
+ * the first deflate block boundary after every checkpointinterval samples.
+ */
+int tracefrom(ramcontext* context, FILE* f, checkpoint* start)
 {
 	unsigned int inbuffersize = 64 * 1024;
 	unsigned int outbuffersize = 64 * 1024;
 	unsigned char* inbuffer = 0;
 	unsigned char* outbuffer = 0;
+	unsigned long long inoffset = 0;
+	unsigned long long outoffset = 0;
+	unsigned long long nextcheckpoint = 0;
+	tracewindow window;
 	z_stream stream;
+	int flush = Z_NO_FLUSH;
 	int result;
 	unsigned int have;
+	unsigned int avail;
+
+	window.data = 0;
 
     stream.zalloc = Z_NULL;
     stream.zfree = Z_NULL;
     stream.opaque = Z_NULL;
     stream.avail_in = 0;
     stream.next_in = Z_NULL;
-	result = inflateInit(&stream);
+	if (start)
+		result = inflateInit2(&stream, -15);
+	else
+		result = inflateInit(&stream);
     if (result != Z_OK)
 		goto clean;
 
 	inbuffer = malloc(inbuffersize);
 	outbuffer = malloc(outbuffersize);
 
+	if (start)
+	{
+		result = checkpoint_seek(&stream, f, start);
+		if (result != Z_OK)
+			goto clean;
+		inoffset = start->inoffset;
+		outoffset = start->outoffset;
+	}
+
+	// Checkpoints can only be taken between deflate blocks, so stop after each
+	if (context->checkpointfile)
+	{
+		window.data = malloc(CHECKPOINTWINDOW);
+		window.pos = 0;
+		window.size = 0;
+		flush = Z_BLOCK;
+		nextcheckpoint = (context->sampleindex / context->checkpointinterval + 1) * context->checkpointinterval;
+	}
+
 	do
 	{
-		stream.avail_in = fread(inbuffer, 1, inbuffersize, f);
-		stream.next_in = inbuffer;
 		if (stream.avail_in == 0)
-			break;
+		{
+			stream.avail_in = fread(inbuffer, 1, inbuffersize, f);
+			stream.next_in = inbuffer;
+			if (stream.avail_in == 0)
+				break;
+		}
 
 		do
 		{
 			stream.avail_out = outbuffersize;
 			stream.next_out = outbuffer;
 
-			result = inflate(&stream, Z_NO_FLUSH);
+			avail = stream.avail_in;
+			result = inflate(&stream, flush);
 
 			switch(result)
 			{
@@ -633,11 +938,26 @@ int traceram(ramcontext* context, FILE* f)
 			}
 
 			have = outbuffersize - stream.avail_out;
+			inoffset += avail - stream.avail_in;
+			outoffset += have;
+			if (window.data)
+				window_add(&window, outbuffer, have);
+
 			if (0 == processbuffer(context, outbuffer, have))
 			{
 				result = Z_OK;
 				goto clean;
 			}
+
+			if (window.data && (stream.data_type & 128) && !(stream.data_type & 64) && context->sampleindex >= nextcheckpoint)
+			{
+				if (0 != checkpoint_write(context, &window, outoffset, inoffset, stream.data_type & 7))
+				{
+					result = Z_ERRNO;
+					goto clean;
+				}
+				nextcheckpoint = context->sampleindex + context->checkpointinterval;
+			}
 		} while(stream.avail_out == 0);
 
 	} while(result != Z_STREAM_END);
@@ -647,11 +967,264 @@ int traceram(ramcontext* context, FILE* f)
 
 clean:
 	inflateEnd(&stream);
+	free(window.data);
 	free(outbuffer);
 	free(inbuffer);
 	return result;
 }
 
+int tracesequential(ramcontext* context, FILE* f)
+{
+	return tracefrom(context, f, 0);
+}
+
+int traceram(ramcontext* context, FILE* f)
+{
+	// Checkpoints are taken on the decode thread between deflate blocks
+	if (context->pipeline && context->checkpointfile == 0)
+		return tracepipelined(context, f);
+	else
+		return tracesequential(context, f);
+}
+
+void resetcontext(ramcontext* context)
+{
+	unsigned int i;
+
+	context->sampleindex = 0;
+	context->samplerestsize = 0;
+	context->state = IDLING;
+	context->lastcs = 0;
+	context->lastrow = 0;
+	context->lastcolumn = 0;
+	context->lastbank = 0;
+	for(i=0; i<8; i++)
+		context->bankrowtable[i] = 0;
+	for(i=0; i<7; i++)
+	{
+		context->readqueue[i].active = 0;
+		context->readqueue[i].address = 0;
+		context->readqueue[i].row = 0;
+		context->readqueue[i].column = 0;
+		context->readqueue[i].bank = 0;
+		context->readqueue[i].cs = 0;
+	}
+	for(i=0; i<1; i++)
+	{
+		context->writequeue[i].active = 0;
+		context->writequeue[i].address = 0;
+		context->writequeue[i].row = 0;
+		context->writequeue[i].column = 0;
+		context->writequeue[i].bank = 0;
+		context->writequeue[i].cs = 0;
+	}
+	rwacc_destroy(&context->acc);
+	rwacc_init(&context->acc);
+}
+
+typedef struct
+{
+	ramcontext context;
+	const char* tracefname;
+	const char* checkpointfname;
+	int checkpointindex;
+	int result;
+	int started;
+	pthread_t thread;
+} decodejob;
+
+/*
+ * Decodes the samples of one job, from its checkpoint up to its stopindex, or
+ * from the start of the trace when it has no checkpoint.
+ */
+void* decodethread(void* arg)
+{
+	decodejob* job = arg;
+	FILE* ftrace = 0;
+	FILE* fcheckpoint = 0;
+	checkpoint point;
+
+	point.window = 0;
+	job->result = Z_ERRNO;
+
+	ftrace = fopen(job->tracefname, "rb");
+	if (ftrace == 0)
+		goto clean;
+
+	if (job->checkpointindex >= 0)
+	{
+		fcheckpoint = fopen(job->checkpointfname, "rb");
+		if (fcheckpoint == 0 || 0 != checkpoint_restore(fcheckpoint, &job->context, job->checkpointindex, &point))
+		{
+			job->result = Z_DATA_ERROR;
+			goto clean;
+		}
+	}
+
+	job->result = tracefrom(&job->context, ftrace, (job->checkpointindex >= 0)? &point : 0);
+
+clean:
+	if (fcheckpoint)
+		fclose(fcheckpoint);
+	if (ftrace)
+		fclose(ftrace);
+	free(point.window);
+	return 0;
+}
+
+/*
+ * Decodes the trace in up to 'jobcount' parts at once, each starting from a
+ * checkpoint written by an earlier run. Decoding starts at the last checkpoint
+ * before --verbose-geq, so a window late in the trace is reached quickly. Every
+ * job writes its output to a temporary file, and the files are joined in order
+ * afterwards, which gives the same output a sequential run would.
+ */
+int traceparallel(ramcontext* context, const char* tracefname, const char* checkpointfname, unsigned int jobcount)
+{
+	decodejob* jobs = 0;
+	checkpoint* points = 0;
+	unsigned int pointcount = 0;
+	unsigned long long compact[3];
+	unsigned long long ourcompact[3];
+	unsigned int startcount;
+	int first = -1;
+	int last;
+	unsigned int i;
+	FILE* f;
+	int result = Z_OK;
+
+	f = fopen(checkpointfname, "rb");
+	if (f == 0 || 0 != checkpoint_index(f, context->memory.addressbits, &points, &pointcount, compact))
+	{
+		printf("error reading checkpoint file\n");
+		if (f)
+			fclose(f);
+		free(points);
+		return Z_DATA_ERROR;
+	}
+	fclose(f);
+
+	checkpoint_compact(context, ourcompact);
+	if ((context->verbose & VERBOSE_COMPACT) && memcmp(compact, ourcompact, sizeof(compact)) != 0)
+	{
+		fprintf(stderr, "Checkpoints were written with other compact settings, decoding from the start.\n");
+		pointcount = 0;
+	}
+
+	for(i=0; i<pointcount; i++)
+	{
+		if ((context->verbose & VERBOSE_GEQ) && points[i].sampleindex <= context->verbosegeq && points[i].sampleindex <= context->stopindex)
+			first = i;
+	}
+	last = first;
+	while(last + 1 < (int)pointcount && points[last + 1].sampleindex < context->stopindex)
+		last++;
+
+	// Jobs start at evenly spread checkpoints between the first and the last
+	startcount = last - first + 1;
+	if (jobcount > startcount)
+		jobcount = startcount;
+
+	jobs = calloc(jobcount, sizeof(decodejob));
+	if (jobs == 0)
+	{
+		free(points);
+		return Z_MEM_ERROR;
+	}
+
+	for(i=0; i<jobcount; i++)
+	{
+		decodejob* job = &jobs[i];
+		ramcontext* jobcontext = &job->context;
+
+		job->tracefname = tracefname;
+		job->checkpointfname = checkpointfname;
+		job->checkpointindex = first + (startcount * i) / jobcount;
+
+		rwacc_init(&jobcontext->acc);
+		resetcontext(jobcontext);
+		mem_init(&jobcontext->memory, context->memory.addressbits);
+		jobcontext->dirty = calloc(1, context->memory.pagecount);
+		jobcontext->verbose = context->verbose;
+		jobcontext->verboseleq = context->verboseleq;
+		jobcontext->verbosegeq = context->verbosegeq;
+		jobcontext->verboseaddress = context->verboseaddress;
+		jobcontext->watch = context->watch;
+		jobcontext->stopindex = context->stopindex;
+		if (i > 0)
+			jobs[i - 1].context.stopindex = points[job->checkpointindex].sampleindex;
+
+		out_init(&jobcontext->out, tmpfile(), OUTBUFFERSIZE);
+		if (context->events.f)
+			out_init(&jobcontext->events, tmpfile(), OUTBUFFERSIZE);
+
+		if (jobcontext->memory.pages == 0 || jobcontext->dirty == 0 || jobcontext->out.f == 0 || (context->events.f && jobcontext->events.f == 0))
+		{
+			printf("error allocating decode job %d\n", i);
+			jobcount = i + 1;
+			result = Z_MEM_ERROR;
+			goto clean;
+		}
+	}
+
+	for(i=0; i<jobcount; i++)
+	{
+		if (0 != pthread_create(&jobs[i].thread, NULL, decodethread, &jobs[i]))
+			decodethread(&jobs[i]);
+		else
+			jobs[i].started = 1;
+	}
+
+	for(i=0; i<jobcount; i++)
+	{
+		decodejob* job = &jobs[i];
+
+		if (job->started)
+			pthread_join(job->thread, 0);
+		if (result == Z_OK)
+			result = job->result;
+		if (result != Z_OK)
+			continue;
+
+		out_flush(&job->context.out);
+		out_append(&context->out, job->context.out.f);
+		if (job->context.events.f)
+		{
+			out_flush(&job->context.events);
+			out_append(&context->events, job->context.events.f);
+		}
+	}
+
+	// The memory contents at the end are those of the last job
+	if (result == Z_OK)
+	{
+		rammemory memory = context->memory;
+
+		context->memory = jobs[jobcount - 1].context.memory;
+		context->sampleindex = jobs[jobcount - 1].context.sampleindex;
+		jobs[jobcount - 1].context.memory = memory;
+	}
+
+clean:
+	for(i=0; i<jobcount; i++)
+	{
+		ramcontext* jobcontext = &jobs[i].context;
+
+		mem_destroy(&jobcontext->memory);
+		free(jobcontext->dirty);
+		rwacc_destroy(&jobcontext->acc);
+		out_destroy(&jobcontext->out);
+		if (jobcontext->out.f)
+			fclose(jobcontext->out.f);
+		out_destroy(&jobcontext->events);
+		if (jobcontext->events.f)
+			fclose(jobcontext->events.f);
+	}
+	free(jobs);
+	free(points);
+	return result;
+}
+
 static void usage(const char *argv0)
 {
 	fprintf(stderr,
@@ -659,77 +1232,52 @@ static void usage(const char *argv0)
 		   "Usage: %s [options...] <trace file>\n"
            "\n"
            "Options:\n"
-           "  -h, --help              Print this help info.\n"
-		   "  -v, --verbose           Be verbose.\n"
-		   "      --verbose-leq=x     Sample index must be <= x to be verbose.\n"
-		   "      --verbose-geq=x     Sample index must be >= x to be verbose.\n"
-		   "      --verbose-address=x Sample must have an address related to reads/writes to be verbose.\n"
-		   "      --verbose-verify    Be verbose about verification.\n"
-		   "      --verbose-reads     Be verbose about reads.\n"
-		   "      --verbose-writes    Be verbose about writes.\n"
-		   "      --verbose-sdram     Be verbose about SDRAM commands.\n"
-		   "      --verbose-compact   Be verbose about the compact form.\n"
-		   "      --stop=x            Stop at sample index x.\n"
-		   "  -o, --out=file          Output final memory contents to file\n"
+		   DECODER_USAGE
+		   "      --write-checkpoints=file\n"
+		   "                          Save the decoder state to file every so often while decoding.\n"
+		   "      --checkpoint-interval=x\n"
+		   "                          Samples between checkpoints (default %d).\n"
+		   "      --read-checkpoints=file\n"
+		   "                          Start decoding at the last checkpoint before --verbose-geq.\n"
+		   "      --jobs=n            With --read-checkpoints, decode in n parts at once.\n"
            "\n",
-		   argv0);
+		   argv0, MEMORYBITS, CHECKPOINTINTERVAL);
    exit(1);
 }
 
 typedef enum opts
 {
-	OPT_VERBOSE = 'v',
-	OPT_HELP = 'h',
-	OPT_OUTPUT_MEMORY = 'o',
-	OPT_VERBOSE_LEQ = 256,
-	OPT_VERBOSE_GEQ = 257,
-	OPT_STOP = 258,
-	OPT_VERBOSE_ADDRESS = 259,
-	OPT_VERBOSE_SDRAM = 260,
-	OPT_VERBOSE_VERIFY = 261,
-	OPT_VERBOSE_READS = 262,
-	OPT_VERBOSE_WRITES = 263,
-	OPT_VERBOSE_COMPACT = 264,
+	OPT_WRITE_CHECKPOINTS = 271,
+	OPT_CHECKPOINT_INTERVAL = 272,
+	OPT_READ_CHECKPOINTS = 273,
+	OPT_JOBS = 274,
 };
 
 int main(int argc, char* argv[])
 {
 	char* tracefname = 0;
 	FILE* ftrace = 0;
-	unsigned int i;
 	ramcontext context;
-	FILE* fmem = 0;
+	decoderoptions options;
+	char* checkpointfname = 0;
+	unsigned int jobs = 1;
+	int result;
 	
+	shuffle_table(shuffle1, 0x76542130);
+	shuffle_table(shuffle3, 0x67543210);
+	decoder_initoptions(&options);
 	rwacc_init(&context.acc);
-	context.memory = malloc(128 * 1024 * 1024);
-	if (context.memory == 0)
-	{
-		printf("error allocating RAM memory\n");
-		goto clean;
-	}
+	out_init(&context.out, stdout, OUTBUFFERSIZE);
+	memset(&context.events, 0, sizeof(outbuffer));
+	memset(&context.watch, 0, sizeof(watchlist));
+	context.checkpointfile = 0;
+	context.checkpointinterval = CHECKPOINTINTERVAL;
+	context.memory.pages = 0;
+	context.dirty = 0;
 	context.verbose = 0;
-	context.sampleindex = 0;
-	context.samplerestsize = 0;
 	context.stopindex = ~0;
-	context.state = IDLING;
-	for(i=0; i<8; i++)
-		context.bankrowtable[i] = 0;
-	for(i=0; i<7; i++)
-	{
-		context.readqueue[i].active = 0;
-		context.readqueue[i].address = 0;
-		context.readqueue[i].row = 0;
-		context.readqueue[i].column = 0;
-		context.readqueue[i].bank = 0;
-	}
-	for(i=0; i<1; i++)
-	{
-		context.writequeue[i].active = 0;
-		context.writequeue[i].address = 0;
-		context.writequeue[i].row = 0;
-		context.writequeue[i].column = 0;
-		context.writequeue[i].bank = 0;
-	}
+	context.pipeline = 1;
+	resetcontext(&context);
 
 	
 	while (1) 
@@ -738,83 +1286,56 @@ int main(int argc, char* argv[])
 		int c;
 		static struct option long_options[] = 
 		{
-			{"verbose-leq", 1, NULL, OPT_VERBOSE_LEQ},
-			{"verbose-geq", 1, NULL, OPT_VERBOSE_GEQ},
-			{"verbose-address", 1, NULL, OPT_VERBOSE_ADDRESS},
-			{"verbose-sdram", 0, NULL, OPT_VERBOSE_SDRAM},
-			{"verbose-verify", 0, NULL, OPT_VERBOSE_VERIFY},
-			{"verbose-reads", 0, NULL, OPT_VERBOSE_READS},
-			{"verbose-writes", 0, NULL, OPT_VERBOSE_WRITES},
-			{"verbose-compact", 0, NULL, OPT_VERBOSE_COMPACT},
-			{"stop", 1, NULL, OPT_STOP},
-			{"verbose", 0, NULL, OPT_VERBOSE},
-			{"help", 0, NULL, OPT_HELP},
-			{"out", 1, NULL, OPT_OUTPUT_MEMORY},
+			DECODER_LONGOPTIONS,
+			{"write-checkpoints", 1, NULL, OPT_WRITE_CHECKPOINTS},
+			{"checkpoint-interval", 1, NULL, OPT_CHECKPOINT_INTERVAL},
+			{"read-checkpoints", 1, NULL, OPT_READ_CHECKPOINTS},
+			{"jobs", 1, NULL, OPT_JOBS},
 			{NULL},
 		};
 
-		c = getopt_long(argc, argv, "vho:", long_options, &option_index);
+		c = getopt_long(argc, argv, DECODER_SHORTOPTIONS, long_options, &option_index);
 		if (c == -1)
 			break;
 
 		switch (c) 
 		{
-			case OPT_OUTPUT_MEMORY:
-				fmem = fopen(optarg, "wb");
-				if (fmem == 0)
-					printf("error opening output file\n");
-			break;
-
-			case OPT_VERBOSE:
-				context.verbose |= VERBOSE_SDRAM | VERBOSE_READS | VERBOSE_WRITES | VERBOSE_VERIFY;
-			break;
-
-			case OPT_VERBOSE_SDRAM:
-				context.verbose |= VERBOSE_SDRAM;
-			break;
-
-			case OPT_VERBOSE_COMPACT:
-				context.verbose |= VERBOSE_COMPACT;
-			break;
-
-			case OPT_VERBOSE_READS:
-				context.verbose |= VERBOSE_READS;
-			break;
-
-			case OPT_VERBOSE_WRITES:
-				context.verbose |= VERBOSE_WRITES;
-			break;
-
-			case OPT_VERBOSE_ADDRESS:
-				context.verboseaddress = strtoul(optarg, 0, 0);
-				context.verbose |= VERBOSE_ADDRESS;
-			break;
-
-			case OPT_VERBOSE_VERIFY:
-				context.verbose |= VERBOSE_VERIFY;
-			break;
-
-			case OPT_VERBOSE_LEQ:
-				context.verboseleq = strtoul(optarg, 0, 0);
-				context.verbose |= VERBOSE_LEQ;
+			case OPT_WRITE_CHECKPOINTS:
+				if (context.checkpointfile == 0)
+				{
+					context.checkpointfile = fopen(optarg, "wb");
+					if (context.checkpointfile == 0)
+					{
+						printf("error opening checkpoint file\n");
+						goto clean;
+					}
+				}
 			break;
 
-			case OPT_VERBOSE_GEQ:
-				context.verbosegeq = strtoul(optarg, 0, 0);
-				context.verbose |= VERBOSE_GEQ;
+			case OPT_CHECKPOINT_INTERVAL:
+				context.checkpointinterval = strtoul(optarg, 0, 0);
+				if (context.checkpointinterval == 0)
+					context.checkpointinterval = 1;
 			break;
 
-			case OPT_STOP:
-				context.stopindex = strtoul(optarg, 0, 0);
+			case OPT_READ_CHECKPOINTS:
+				checkpointfname = optarg;
 			break;
 
-
-			case OPT_HELP:
-				usage(argv[0]);
+			case OPT_JOBS:
+				jobs = strtoul(optarg, 0, 0);
+				if (jobs < 1)
+					jobs = 1;
+				if (jobs > MAXJOBS)
+					jobs = MAXJOBS;
 			break;
 
 			default:
-				usage(argv[0]);
+				result = decoder_option(&context, &options, c, optarg);
+				if (result < 0)
+					goto clean;
+				if (result == 0)
+					usage(argv[0]);
 		}
 	}
 	if ( optind == argc - 1)
@@ -841,28 +1362,70 @@ int main(int argc, char* argv[])
 		goto clean;
 	}
 
-	if (Z_OK != traceram(&context, ftrace))
+	context.dirty = calloc(1, 1 << (options.addressbits - MEMORYPAGESHIFT));
+	if (0 != mem_init(&context.memory, options.addressbits) || context.dirty == 0)
 	{
-		printf("error processing file\n");
+		printf("error allocating RAM memory\n");
+		goto clean;
+	}
+
+	if (checkpointfname && context.checkpointfile)
+	{
+		printf("error can't read and write checkpoints at once\n");
 		goto clean;
 	}
 
+	if (context.checkpointfile)
+		checkpoint_writeheader(&context);
+
+	if (context.pipeline)
+	{
+		out_startwriter(&context.out);
+		if (context.events.f)
+			out_startwriter(&context.events);
+	}
 
-	if (fmem)
+	if (options.dobenchmark)
 	{
-		if (fwrite(context.memory, 128 * 1024 * 1024, 1, fmem) != 1)
+		if (Z_OK != benchmark(&context, ftrace))
 		{
-			printf("error writing memory file\n");
-			goto clean;
+			out_flush(&context.out);
+			printf("error processing file\n");
 		}
+		goto clean;
+	}
+
+	if (checkpointfname)
+		result = traceparallel(&context, tracefname, checkpointfname, jobs);
+	else
+		result = traceram(&context, ftrace);
+
+	if (Z_OK != result)
+	{
+		out_flush(&context.out);
+		printf("error processing file\n");
+		goto clean;
 	}
 
+
+	if (0 != decoder_writememory(&context, &options))
+		goto clean;
+
 clean:
 	if (ftrace)
 		fclose(ftrace);
-	if (fmem)
-		fclose(fmem);
-	free(context.memory);
+	decoder_closeoptions(&options);
+	if (context.checkpointfile)
+		fclose(context.checkpointfile);
+	mem_destroy(&context.memory);
+	free(context.dirty);
 	rwacc_destroy(&context.acc);
+	watch_destroy(&context.watch);
+	out_destroy(&context.out);
+	if (context.events.f)
+	{
+		out_destroy(&context.events);
+		fclose(context.events.f);
+	}
 	return 0;
 }
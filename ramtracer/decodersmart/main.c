@@ -3,260 +3,353 @@
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <stdarg.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include "decoder.h"
 
 #define SAMPLESIZE 13
 
-#define VERBOSE_SDRAM (1<<0)
-#define VERBOSE_LEQ (1<<1)
-#define VERBOSE_GEQ (1<<2)
-#define VERBOSE_READS (1<<3)
-#define VERBOSE_WRITES (1<<4)
-#define VERBOSE_VERIFY (1<<5)
-#define VERBOSE_ADDRESS (1<<6)
-#define VERBOSE_COMPACT (1<<7)
+// Marker sample that memhost records where capture data was lost
+#define SAMPLE_GAPHEADER 0xFE
 
-typedef struct
-{
-	unsigned int type;
-	unsigned int curaddress;
-	unsigned int orgaddress;
-	unsigned int size;
-	unsigned int capacity;
-	unsigned char* buffer;
-} rwaccumulator;
+// Marker samples that describe the capture filter memhost saved the trace with
+#define SAMPLE_FILTERHEADER 0xFD
+#define FILTER_RECORD_TYPES 0
+#define FILTER_RECORD_RANGE 1
+#define FILTER_RECORD_FIRST 2
+#define FILTER_RECORD_LAST 3
 
-typedef struct
-{
-	unsigned int active;
-	unsigned int row;
-	unsigned int column;
-	unsigned int bank;
-	unsigned int cs;
-	unsigned int address;
-} entryrwqueue;
+// Bytes per line of --diff output
+#define DIFFWIDTH 16
 
-typedef struct
-{
-	unsigned char* memory;
-	unsigned int state;
-	rwaccumulator acc;
-	entryrwqueue readqueue[7];
-	entryrwqueue writequeue[1];
-	unsigned int lastcs;
-	unsigned int lastrow;
-	unsigned int lastcolumn;
-	unsigned int lastbank;
-	unsigned int bankrowtable[8];
-	unsigned int sampleindex;
-	unsigned int samplerestsize;
-	unsigned char samplerestdata[SAMPLESIZE];
-	unsigned int verbose;
-	unsigned int verboseleq;
-	unsigned int verbosegeq;
-	unsigned int verboseaddress;
-	unsigned long long stopindex;
-} ramcontext;
+// Default samples per time bucket of the --heatmap report
+#define HEATMAPINTERVAL (1024 * 1024)
 
-typedef enum commands
+/*
+ * Differences between the memory at the --diff-at samples. From the first of
+ * them on, the first write to a page saves a copy of it as it was, so reaching
+ * the next one only compares the pages written in between.
+ */
+typedef struct
 {
-	UNKNOWN = 0,
-	NOP,
-	MSR,
-	ACTIVATE,
-	PRECHARGE,
-	WRITE,
-	BST,
-	READ
-};
+	FILE* f;
+	unsigned long long* points;
+	unsigned int pointcount;
+	unsigned int nextpoint;
+	unsigned long long startindex;
+	unsigned int active;
+	memorypage** saved;
+	unsigned int* savedlist;
+	unsigned int savedcount;
+} memorydiff;
 
-typedef enum states
+int diff_addpoints(memorydiff* diff, const char* list)
 {
-	IDLING,
-	READING,
-	WRITING,
-};
+	char* end;
 
-unsigned char shuffle(unsigned int order, unsigned char c)
-{
-	unsigned char out = 0;
-	int i;
-	for (i = 0; i < 8; i++) {
-		out |= ((c >> ((order >> (i*4)) & 0xF)) & 1) << i;
+	while(*list)
+	{
+		unsigned long long* points = realloc(diff->points, (diff->pointcount + 1) * sizeof(unsigned long long));
+
+		if (points == 0)
+			return -1;
+		diff->points = points;
+		diff->points[diff->pointcount++] = strtoull(list, &end, 0);
+		if (end == list || (*end != ',' && *end != 0))
+			return -1;
+		list = (*end == ',')? end + 1 : end;
 	}
-	return out;
-}
 
-void fix_data_order(unsigned int *mask, unsigned char *data)
-{
-	unsigned char input_data[8];
-
-	*mask = ((*mask << 2) | (*mask >> 6)) & 0xFF;
-
-	memcpy(input_data, data, 8);
-	data[0] = input_data[6];
-	data[1] = input_data[7];
-	data[2] = input_data[0];
-	data[3] = input_data[1];
-	data[4] = input_data[2];
-	data[5] = input_data[3];
-	data[6] = input_data[4];
-	data[7] = input_data[5];
+	return 0;
 }
 
-unsigned int getle32(unsigned char* p)
+int diff_comparepoints(const void* a, const void* b)
 {
-	return p[0] | (p[1]<<8) | (p[2]<<16) | (p[3]<<24);
-}
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
 
+	return (x < y)? -1 : (x > y);
+}
 
-void rwacc_init(rwaccumulator* acc)
+int diff_comparepages(const void* a, const void* b)
 {
-	acc->type = ~0;
-	acc->curaddress = 0;
-	acc->orgaddress = 0;
-	acc->size = 0;
-	acc->capacity = 0;
-	acc->buffer = 0;
+	unsigned int x = *(const unsigned int*)a;
+	unsigned int y = *(const unsigned int*)b;
+
+	return (x < y)? -1 : (x > y);
 }
 
-void rwacc_destroy(rwaccumulator* acc)
+int diff_init(memorydiff* diff, rammemory* mem)
 {
-	free(acc->buffer);
+	qsort(diff->points, diff->pointcount, sizeof(unsigned long long), diff_comparepoints);
+	diff->saved = calloc(mem->pagecount, sizeof(memorypage*));
+	diff->savedlist = malloc(mem->pagecount * sizeof(unsigned int));
+	return (diff->saved == 0 || diff->savedlist == 0)? -1 : 0;
 }
 
-int rwacc_sametransaction(rwaccumulator* acc, unsigned int type, unsigned int address)
+void diff_destroy(memorydiff* diff)
 {
-	return (acc->type == type && address == acc->curaddress);
+	unsigned int i;
+
+	for(i=0; i<diff->savedcount; i++)
+		free(diff->saved[diff->savedlist[i]]);
+	free(diff->saved);
+	free(diff->savedlist);
+	free(diff->points);
+	diff->saved = 0;
+	diff->savedlist = 0;
+	diff->points = 0;
+	diff->savedcount = 0;
 }
 
-#define DUMPWIDTH 32
-void rwacc_printascii(unsigned char c)
+/*
+ * Saves the page holding 'address' before its first write since the last point.
+ */
+void diff_touch(memorydiff* diff, rammemory* mem, unsigned int address)
 {
-	if (c >= 0x20 && c <= 0x7e)
-		printf("%c", c);
+	unsigned int pageindex = (address & mem->addressmask) >> MEMORYPAGESHIFT;
+	memorypage* copy;
+
+	if (diff->saved[pageindex])
+		return;
+
+	copy = malloc(sizeof(memorypage));
+	if (copy == 0)
+	{
+		printf("error allocating RAM memory\n");
+		exit(1);
+	}
+
+	if (mem->pages[pageindex])
+		memcpy(copy, mem->pages[pageindex], sizeof(memorypage));
 	else
-		printf(".");
+		memset(copy, 0, sizeof(memorypage));
+
+	diff->saved[pageindex] = copy;
+	diff->savedlist[diff->savedcount++] = pageindex;
 }
-void rwacc_dump(rwaccumulator* acc, unsigned int sampleindex)
+
+void diff_fmtbytes(FILE* f, memorypage* page, unsigned int offset, unsigned int count)
 {
-	unsigned int i,j;
-	unsigned char data[DUMPWIDTH];
-	unsigned int x = 0;
-	unsigned int y = 0;
-	unsigned int address = acc->orgaddress;
+	unsigned int i;
 
-	if (acc->size == 0)
-		return;
+	for(i=offset; i<offset+count; i++)
+	{
+		if (page->written[i >> 3] & (1<<(i & 7)))
+			fprintf(f, " %02X", page->data[i]);
+		else
+			fprintf(f, " --");
+	}
+}
 
+/*
+ * Lists the bytes changed since the last point, as runs of the old and the new
+ * contents, and starts over from 'sampleindex'.
+ */
+void diff_report(memorydiff* diff, rammemory* mem, unsigned long long sampleindex)
+{
+	memorypage* old;
+	memorypage* cur;
+	unsigned int pageindex;
+	unsigned int i, j, start;
 
+	qsort(diff->savedlist, diff->savedcount, sizeof(unsigned int), diff_comparepages);
+	fprintf(diff->f, "DIFF %llu-%llu\n", diff->startindex, sampleindex);
 
-	for(i=0; i<acc->size; i++)
+	for(i=0; i<diff->savedcount; i++)
 	{
-		if (x == 0)
+		pageindex = diff->savedlist[i];
+		old = diff->saved[pageindex];
+		cur = mem->pages[pageindex];
+
+		if (memcmp(old, cur, sizeof(memorypage)) != 0)
 		{
-			//if (y == 0)
+			for(j=0; j<MEMORYPAGESIZE; )
 			{
-				if (acc->type == READ)
-					printf("RD ");
-				else if (acc->type == WRITE)
-					printf("WR ");
-				printf("%08X", address);
+				if (old->data[j] == cur->data[j] && ((old->written[j >> 3] ^ cur->written[j >> 3]) & (1<<(j & 7))) == 0)
+				{
+					j++;
+					continue;
+				}
+
+				start = j;
+				while(j < MEMORYPAGESIZE && j - start < DIFFWIDTH &&
+					  (old->data[j] != cur->data[j] || ((old->written[j >> 3] ^ cur->written[j >> 3]) & (1<<(j & 7)))))
+					j++;
+
+				fprintf(diff->f, "%08X:", (pageindex << MEMORYPAGESHIFT) + start);
+				diff_fmtbytes(diff->f, old, start, j - start);
+				fprintf(diff->f, " ->");
+				diff_fmtbytes(diff->f, cur, start, j - start);
+				fprintf(diff->f, "\n");
 			}
-			//else
-			//{
-			//	printf("   ");
-			//	printf("%08X", address);
-			//}
-		}
-		
-		data[x] = acc->buffer[i];
-		address++;
-		printf(" %02X", data[x]);
-		x++;
-		if (x >= DUMPWIDTH)
-		{
-			printf("  ");
-			for(j=0; j<DUMPWIDTH; j++)
-				rwacc_printascii(data[j]);
-
-			printf("  %08x", sampleindex);
-			x = 0;
-			y++;
-			printf("\n");
 		}
-	}
 
-	if (x)
-	{
-		for(j=x; j<DUMPWIDTH; j++)
-			printf("   ");
-		printf("  ");
-		for(j=0; j<x; j++)
-			rwacc_printascii(data[j]);
-
-		printf("  %08x", sampleindex);
-		printf("\n");
+		free(old);
+		diff->saved[pageindex] = 0;
 	}
+
+	diff->savedcount = 0;
+	diff->startindex = sampleindex;
 }
 
-void rwacc_settransaction(rwaccumulator* acc, unsigned int type, unsigned int address)
+/*
+ * Read and write counts per memory page and per time bucket of 'interval'
+ * samples. The counts are kept together for each page, and only the pages
+ * accessed in a bucket are reported and cleared at its end.
+ */
+typedef struct
 {
-	acc->type = type;
-	acc->orgaddress = address;
-	acc->curaddress = address;
-	acc->size = 0;
-}
+	unsigned int reads;
+	unsigned int writes;
+} pageheat;
 
-void rwacc_addbuffer(rwaccumulator* acc, unsigned char* buffer, unsigned int size)
+typedef struct
 {
-	unsigned int available = acc->capacity - acc->size;
-	
+	FILE* f;
+	unsigned long long interval;
+	unsigned long long startindex;
+	pageheat* pages;
+	unsigned int* touched;
+	unsigned int touchedcount;
+} heatmap;
+
+int heat_init(heatmap* heat, rammemory* mem)
+{
+	heat->pages = calloc(mem->pagecount, sizeof(pageheat));
+	heat->touched = malloc(mem->pagecount * sizeof(unsigned int));
+	if (heat->pages == 0 || heat->touched == 0)
+		return -1;
 
-	if (available < size)
-	{
-		unsigned char* newbuffer = 0;
-		unsigned int newcapacity = acc->capacity * 2;
+	fprintf(heat->f, "start,end,address,reads,writes\n");
+	return 0;
+}
 
-		if (newcapacity <= 0)
-			newcapacity = 2;
+void heat_destroy(heatmap* heat)
+{
+	free(heat->pages);
+	free(heat->touched);
+	heat->pages = 0;
+	heat->touched = 0;
+}
 
-		while( (newcapacity - acc->size) < size )
-			newcapacity *= 2;
+pageheat* heat_page(heatmap* heat, rammemory* mem, unsigned int address)
+{
+	unsigned int pageindex = (address & mem->addressmask) >> MEMORYPAGESHIFT;
+	pageheat* page = heat->pages + pageindex;
 
-		
-		newbuffer = malloc(newcapacity);
+	if (page->reads == 0 && page->writes == 0)
+		heat->touched[heat->touchedcount++] = pageindex;
+	return page;
+}
 
-		if (acc->buffer)
-		{
-			memcpy(newbuffer, acc->buffer, acc->capacity);
+void heat_report(heatmap* heat, unsigned long long sampleindex)
+{
+	pageheat* page;
+	unsigned int i;
 
-			free(acc->buffer);
-		}
+	qsort(heat->touched, heat->touchedcount, sizeof(unsigned int), diff_comparepages);
 
-		acc->capacity = newcapacity;
-		acc->buffer = newbuffer;
+	for(i=0; i<heat->touchedcount; i++)
+	{
+		page = heat->pages + heat->touched[i];
+		fprintf(heat->f, "%llu,%llu,%08X,%u,%u\n", heat->startindex, sampleindex,
+				heat->touched[i] << MEMORYPAGESHIFT, page->reads, page->writes);
+		page->reads = 0;
+		page->writes = 0;
 	}
 
-	memcpy(acc->buffer + acc->size, buffer, size);
+	heat->touchedcount = 0;
+	heat->startindex = sampleindex;
+}
 
-	acc->size += size;
-	acc->curaddress += size;
+typedef struct
+{
+	rammemory memory;
+	unsigned int state;
+	rwaccumulator acc;
+	entryrwqueue readqueue[7];
+	entryrwqueue writequeue[1];
+	unsigned int lastcs;
+	unsigned int lastrow;
+	unsigned int lastcolumn;
+	unsigned int lastbank;
+	unsigned int bankrowtable[8];
+	unsigned long long sampleindex;
+	unsigned int samplerestsize;
+	unsigned char samplerestdata[SAMPLESIZE];
+	unsigned int verbose;
+	unsigned long long verboseleq;
+	unsigned long long verbosegeq;
+	unsigned int verboseaddress;
+	unsigned long long stopindex;
+	outbuffer out;
+	outbuffer events;
+	watchlist watch;
+	unsigned int pipeline;
+	memorydiff diff;
+	heatmap heat;
+	unsigned long long reportindex;
+} ramcontext;
+
+unsigned int getle32(unsigned char* p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | (p[3]<<24);
+}
+
+
+/*
+ * Sample index at which the next diff or heatmap report is due.
+ */
+void report_schedule(ramcontext* context)
+{
+	context->reportindex = ~0ULL;
+
+	if (context->diff.f && context->diff.nextpoint < context->diff.pointcount)
+		context->reportindex = context->diff.points[context->diff.nextpoint];
+	if (context->heat.f && context->heat.startindex + context->heat.interval < context->reportindex)
+		context->reportindex = context->heat.startindex + context->heat.interval;
 }
 
-void rwacc_addsample(rwaccumulator* acc, unsigned int sampleindex, unsigned int type, unsigned int address, unsigned char* data, unsigned int size)
+void report_sample(ramcontext* context)
 {
-	if (!rwacc_sametransaction(acc, type, address))
+	unsigned long long sampleindex = context->sampleindex;
+
+	if (context->diff.f && context->diff.nextpoint < context->diff.pointcount && sampleindex >= context->diff.points[context->diff.nextpoint])
 	{
-		rwacc_dump(acc, sampleindex);
-		rwacc_settransaction(acc, type, address);
+		if (context->diff.active)
+			diff_report(&context->diff, &context->memory, sampleindex);
+		context->diff.active = 1;
+		context->diff.startindex = sampleindex;
+		while(context->diff.nextpoint < context->diff.pointcount && context->diff.points[context->diff.nextpoint] <= sampleindex)
+			context->diff.nextpoint++;
 	}
 
-	rwacc_addbuffer(acc, data, size);
+	if (context->heat.f && sampleindex >= context->heat.startindex + context->heat.interval)
+		heat_report(&context->heat, sampleindex);
+
+	report_schedule(context);
+}
+
+/*
+ * Reports what's left once the trace ends.
+ */
+void report_finish(ramcontext* context)
+{
+	if (context->diff.f && context->diff.active)
+		diff_report(&context->diff, &context->memory, context->sampleindex);
+	if (context->heat.f && context->heat.touchedcount)
+		heat_report(&context->heat, context->sampleindex);
 }
 
 int processsample(ramcontext* context, unsigned char* sampledata)
 {
-	unsigned int sampleindex = context->sampleindex;
+	unsigned long long sampleindex = context->sampleindex;
 
 	unsigned int i;
 	unsigned int header;
@@ -266,12 +359,16 @@ int processsample(ramcontext* context, unsigned char* sampledata)
 	unsigned int verbose = 0;
 	unsigned int isread = 0;
 	unsigned int iswrite = 0;
+	char* p;
 	
 
 
 	if (context->sampleindex >= context->stopindex)
 		return 0;
 
+	if (context->sampleindex >= context->reportindex)
+		report_sample(context);
+
 	verbose = context->verbose;
 
 	if ( (context->verbose & VERBOSE_LEQ) && (context->sampleindex > context->verboseleq))
@@ -287,8 +384,36 @@ int processsample(ramcontext* context, unsigned char* sampledata)
 	iswrite = (header == 0);
 	isread = (header == 1);
 
+	if (header == SAMPLE_GAPHEADER)
+	{
+		// Don't merge accesses from before and after the gap
+		rwacc_dump(&context->acc, &context->out, sampleindex);
+		rwacc_settransaction(&context->acc, ~0, 0);
+		out_printf(&context->out, "GAP %d @ %llu, capture data lost\n", getle32(sampledata + 4), sampleindex);
+		if (verbose & VERBOSE_EVENTS)
+			out_event(&context->events, sampleindex, EVENT_GAP, getle32(sampledata + 4), 0, 0);
+		return 1;
+	}
+
+	if (header == SAMPLE_FILTERHEADER)
+	{
+		// Accesses before and after a filter change aren't contiguous either
+		rwacc_dump(&context->acc, &context->out, sampleindex);
+		rwacc_settransaction(&context->acc, ~0, 0);
+
+		if (sampledata[1] == FILTER_RECORD_TYPES)
+			out_printf(&context->out, "FILTER @ %llu, saved%s%s\n", sampleindex, (sampledata[4] & 2)? " reads" : "", (sampledata[4] & 1)? " writes" : "");
+		else if (sampledata[1] == FILTER_RECORD_RANGE)
+			out_printf(&context->out, "FILTER @ %llu, address %08X-%08X\n", sampleindex, getle32(sampledata + 4), getle32(sampledata + 8));
+		else if (sampledata[1] == FILTER_RECORD_FIRST)
+			out_printf(&context->out, "FILTER @ %llu, from sample %llu\n", sampleindex, getle32(sampledata + 4) | ((unsigned long long)getle32(sampledata + 8) << 32));
+		else if (sampledata[1] == FILTER_RECORD_LAST)
+			out_printf(&context->out, "FILTER @ %llu, up to sample %llu\n", sampleindex, getle32(sampledata + 4) | ((unsigned long long)getle32(sampledata + 8) << 32));
+		return 1;
+	}
+
 	if (header >= 2)
-		printf("ERROR @ %d\n", sampleindex);
+		out_printf(&context->out, "ERROR @ %llu\n", sampleindex);
 
 
 
@@ -296,36 +421,43 @@ int processsample(ramcontext* context, unsigned char* sampledata)
 
 	if (isread)
 	{
+		if (context->heat.pages)
+			heat_page(&context->heat, &context->memory, address*8)->reads++;
+
 		if (verbose & VERBOSE_COMPACT)
-			rwacc_addsample(&context->acc, sampleindex, READ, address*8, data, 8);
+			rwacc_addsample(&context->acc, &context->out, sampleindex, READ, address*8, data, 8);
 
 		if (verbose & VERBOSE_READS)
 		{
-			printf("% 9d: ", sampleindex);
-			printf("READ ");
-			for(i=0; i<8; i++)
-			{
-				if (i != 0)
-					printf(".");
-				printf("%02X", data[i]);
-			}
-			printf(" mask=");
-			for(i=0; i<8; i++)
-				printf("%d", (mask>>(7-i))&1);
-			printf(" address=%08x\n", address);
+			p = out_reserve(&context->out, OUTLINEMAX);
+			p = fmt_index(p, sampleindex);
+			p = fmt_str(p, ": READ ");
+			p = fmt_data(p, data);
+			p = fmt_str(p, " mask=");
+			p = fmt_bits(p, mask, 7, 8);
+			p = fmt_str(p, " address=");
+			p = fmt_hex(p, address, 8, hexlower);
+			*p++ = '\n';
+			out_commit(&context->out, p);
 		}
 
+		if (verbose & VERBOSE_EVENTS)
+			out_event(&context->events, sampleindex, EVENT_READ, address*8, mask, data);
+
+		if (context->watch.count)
+			watch_access(&context->watch, &context->memory, &context->out, sampleindex, READ, address*8, data, mask);
+
 		if (verbose & VERBOSE_VERIFY)
 		{
-			if (0 != memcmp(context->memory + address*8, data, 8))
+			unsigned char expected[8];
+
+			if (mem_verify(&context->memory, address*8, data, expected))
 			{
-				printf("Verify mismatch sample %d, address %08x:\n", sampleindex, address);
-				for(i=0; i<8; i++)
-					printf("%02X ", context->memory[address*8 + i]);
-				printf("vs ");
-				for(i=0; i<8; i++)
-					printf("%02X ", data[i]);
-				printf("\n");
+
+				out_printf(&context->out, "Verify mismatch sample %llu, address %08x:\n"
+						   "%02X %02X %02X %02X %02X %02X %02X %02X vs %02X %02X %02X %02X %02X %02X %02X %02X \n", sampleindex, address,
+						   expected[0], expected[1], expected[2], expected[3], expected[4], expected[5], expected[6], expected[7],
+						   data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7]);
 			}
 		}
 	}
@@ -333,89 +465,53 @@ int processsample(ramcontext* context, unsigned char* sampledata)
 
 	if (iswrite)
 	{
+		if (context->heat.pages)
+			heat_page(&context->heat, &context->memory, address*8)->writes++;
 
 		if (verbose & VERBOSE_COMPACT)
 		{
 			for(i=0; i<8; i++)
 			{
 				if ((mask & (1<<i)) == 0)
-					rwacc_addsample(&context->acc, sampleindex, WRITE, address*8+i, data+i, 1);
+					rwacc_addsample(&context->acc, &context->out, sampleindex, WRITE, address*8+i, data+i, 1);
 			}
 		}
 
 		if (verbose & VERBOSE_WRITES)
 		{
-			printf("% 9d: ", sampleindex);
-			printf("WRITE ");
-			for(i=0; i<8; i++)
-			{
-				if (i != 0)
-					printf(".");
-				printf("%02X", data[i]);
-			}
-			printf(" mask=");
-			for(i=0; i<8; i++)
-				printf("%d", (mask>>(7-i))&1);
-			printf(" address=%08x\n", address);
+			p = out_reserve(&context->out, OUTLINEMAX);
+			p = fmt_index(p, sampleindex);
+			p = fmt_str(p, ": WRITE ");
+			p = fmt_data(p, data);
+			p = fmt_str(p, " mask=");
+			p = fmt_bits(p, mask, 7, 8);
+			p = fmt_str(p, " address=");
+			p = fmt_hex(p, address, 8, hexlower);
+			*p++ = '\n';
+			out_commit(&context->out, p);
 		}
 
-		for(i=0; i<8; i++)
-		{
-			if ((mask & (1<<i)) == 0)
-				memcpy(context->memory + address*8 + i, data+i, 1);
-		}
-	}
-
-	return 1;
-}
-
-int processbuffer(ramcontext* context, unsigned char* buffer, unsigned int size)
-{
-	unsigned int samplecount;
-	unsigned int samplecopysize;
-	unsigned int i;
+		if (verbose & VERBOSE_EVENTS)
+			out_event(&context->events, sampleindex, EVENT_WRITE, address*8, mask, data);
 
+		if (context->watch.count)
+			watch_access(&context->watch, &context->memory, &context->out, sampleindex, WRITE, address*8, data, mask);
 
-	if (context->samplerestsize)
-	{
-		samplecopysize = SAMPLESIZE - context->samplerestsize;
-		if (samplecopysize > size)
-			samplecopysize = size;
-
-		memcpy(context->samplerestdata + context->samplerestsize, buffer, samplecopysize);
-
-		context->samplerestsize += samplecopysize;
-		buffer += samplecopysize;
-		size -= samplecopysize;
-
-		if (context->samplerestsize == SAMPLESIZE)
-		{
-			if (0 == processsample(context, context->samplerestdata))
-				return 0;
-			context->sampleindex++;
-			context->samplerestsize = 0;
-		}
-	}
-
-	if (size)
-	{
-		samplecount = size / SAMPLESIZE;
-
-		for(i=0; i<samplecount; i++)
-		{
-			if (0 == processsample(context, buffer + i*SAMPLESIZE))
-				return 0;
-			context->sampleindex++;
-		}
-
-		context->samplerestsize = size - (samplecount * SAMPLESIZE);
-		memcpy(context->samplerestdata, buffer + samplecount*SAMPLESIZE, context->samplerestsize);
+		if (context->diff.active)
+			diff_touch(&context->diff, &context->memory, address*8);
+		mem_write(&context->memory, address*8, data, mask);
 	}
 
 	return 1;
 }
 
-int traceram(ramcontext* context, FILE* f)
+// Sample stream handling shared by the decoders, built around processsample
+#include "decoderstream.h"
+
+/*
+ * Inflates and decodes the trace on the calling thread.
+ */
+int tracesequential(ramcontext* context, FILE* f)
 {
 	unsigned int inbuffersize = 64 * 1024;
 	unsigned int outbuffersize = 64 * 1024;
@@ -480,6 +576,43 @@ clean:
 	return result;
 }
 
+int traceram(ramcontext* context, FILE* f)
+{
+	if (context->pipeline)
+		return tracepipelined(context, f);
+	else
+		return tracesequential(context, f);
+}
+
+void resetcontext(ramcontext* context)
+{
+	unsigned int i;
+
+	context->sampleindex = 0;
+	context->samplerestsize = 0;
+	context->state = IDLING;
+	for(i=0; i<8; i++)
+		context->bankrowtable[i] = 0;
+	for(i=0; i<7; i++)
+	{
+		context->readqueue[i].active = 0;
+		context->readqueue[i].address = 0;
+		context->readqueue[i].row = 0;
+		context->readqueue[i].column = 0;
+		context->readqueue[i].bank = 0;
+	}
+	for(i=0; i<1; i++)
+	{
+		context->writequeue[i].active = 0;
+		context->writequeue[i].address = 0;
+		context->writequeue[i].row = 0;
+		context->writequeue[i].column = 0;
+		context->writequeue[i].bank = 0;
+	}
+	rwacc_destroy(&context->acc);
+	rwacc_init(&context->acc);
+}
+
 static void usage(const char *argv0)
 {
 	fprintf(stderr,
@@ -487,77 +620,45 @@ static void usage(const char *argv0)
 		   "Usage: %s [options...] <trace file>\n"
            "\n"
            "Options:\n"
-           "  -h, --help              Print this help info.\n"
-		   "  -v, --verbose           Be verbose.\n"
-		   "      --verbose-leq=x     Sample index must be <= x to be verbose.\n"
-		   "      --verbose-geq=x     Sample index must be >= x to be verbose.\n"
-		   "      --verbose-address=x Sample must have an address related to reads/writes to be verbose.\n"
-		   "      --verbose-verify    Be verbose about verification.\n"
-		   "      --verbose-reads     Be verbose about reads.\n"
-		   "      --verbose-writes    Be verbose about writes.\n"
-		   "      --verbose-sdram     Be verbose about SDRAM commands.\n"
-		   "      --verbose-compact   Be verbose about the compact form.\n"
-		   "      --stop=x            Stop at sample index x.\n"
-		   "  -o, --out=file          Output final memory contents to file\n"
+		   DECODER_USAGE
+		   "      --diff=file         Write the memory changes between the --diff-at samples to file.\n"
+		   "      --diff-at=x[,y...]  Sample indices to compare memory at, the last one against the end.\n"
+		   "      --heatmap=file      Write reads and writes per memory page and time bucket to file, as CSV.\n"
+		   "      --heatmap-interval=x Samples per time bucket of the heatmap (default %d).\n"
            "\n",
-		   argv0);
+		   argv0, MEMORYBITS, HEATMAPINTERVAL);
    exit(1);
 }
 
 typedef enum opts
 {
-	OPT_VERBOSE = 'v',
-	OPT_HELP = 'h',
-	OPT_OUTPUT_MEMORY = 'o',
-	OPT_VERBOSE_LEQ = 256,
-	OPT_VERBOSE_GEQ = 257,
-	OPT_STOP = 258,
-	OPT_VERBOSE_ADDRESS = 259,
-	OPT_VERBOSE_SDRAM = 260,
-	OPT_VERBOSE_VERIFY = 261,
-	OPT_VERBOSE_READS = 262,
-	OPT_VERBOSE_WRITES = 263,
-	OPT_VERBOSE_COMPACT = 264,
+	OPT_DIFF = 271,
+	OPT_DIFF_AT = 272,
+	OPT_HEATMAP = 273,
+	OPT_HEATMAP_INTERVAL = 274,
 };
 
 int main(int argc, char* argv[])
 {
 	char* tracefname = 0;
 	FILE* ftrace = 0;
-	unsigned int i;
 	ramcontext context;
-	FILE* fmem = 0;
+	decoderoptions options;
+	int result;
 	
+	decoder_initoptions(&options);
 	rwacc_init(&context.acc);
-	context.memory = malloc(128 * 1024 * 1024);
-	if (context.memory == 0)
-	{
-		printf("error allocating RAM memory\n");
-		goto clean;
-	}
+	out_init(&context.out, stdout, OUTBUFFERSIZE);
+	memset(&context.events, 0, sizeof(outbuffer));
+	memset(&context.watch, 0, sizeof(watchlist));
+	context.memory.pages = 0;
 	context.verbose = 0;
-	context.sampleindex = 0;
-	context.samplerestsize = 0;
 	context.stopindex = ~0;
-	context.state = IDLING;
-	for(i=0; i<8; i++)
-		context.bankrowtable[i] = 0;
-	for(i=0; i<7; i++)
-	{
-		context.readqueue[i].active = 0;
-		context.readqueue[i].address = 0;
-		context.readqueue[i].row = 0;
-		context.readqueue[i].column = 0;
-		context.readqueue[i].bank = 0;
-	}
-	for(i=0; i<1; i++)
-	{
-		context.writequeue[i].active = 0;
-		context.writequeue[i].address = 0;
-		context.writequeue[i].row = 0;
-		context.writequeue[i].column = 0;
-		context.writequeue[i].bank = 0;
-	}
+	context.pipeline = 1;
+	memset(&context.diff, 0, sizeof(memorydiff));
+	memset(&context.heat, 0, sizeof(heatmap));
+	context.heat.interval = HEATMAPINTERVAL;
+	resetcontext(&context);
 
 	
 	while (1) 
@@ -566,83 +667,55 @@ int main(int argc, char* argv[])
 		int c;
 		static struct option long_options[] = 
 		{
-			{"verbose-leq", 1, NULL, OPT_VERBOSE_LEQ},
-			{"verbose-geq", 1, NULL, OPT_VERBOSE_GEQ},
-			{"verbose-address", 1, NULL, OPT_VERBOSE_ADDRESS},
-			{"verbose-sdram", 0, NULL, OPT_VERBOSE_SDRAM},
-			{"verbose-verify", 0, NULL, OPT_VERBOSE_VERIFY},
-			{"verbose-reads", 0, NULL, OPT_VERBOSE_READS},
-			{"verbose-writes", 0, NULL, OPT_VERBOSE_WRITES},
-			{"verbose-compact", 0, NULL, OPT_VERBOSE_COMPACT},
-			{"stop", 1, NULL, OPT_STOP},
-			{"verbose", 0, NULL, OPT_VERBOSE},
-			{"help", 0, NULL, OPT_HELP},
-			{"out", 1, NULL, OPT_OUTPUT_MEMORY},
+			DECODER_LONGOPTIONS,
+			{"diff", 1, NULL, OPT_DIFF},
+			{"diff-at", 1, NULL, OPT_DIFF_AT},
+			{"heatmap", 1, NULL, OPT_HEATMAP},
+			{"heatmap-interval", 1, NULL, OPT_HEATMAP_INTERVAL},
 			{NULL},
 		};
 
-		c = getopt_long(argc, argv, "vho:", long_options, &option_index);
+		c = getopt_long(argc, argv, DECODER_SHORTOPTIONS, long_options, &option_index);
 		if (c == -1)
 			break;
 
 		switch (c) 
 		{
-			case OPT_OUTPUT_MEMORY:
-				fmem = fopen(optarg, "wb");
-				if (fmem == 0)
-					printf("error opening output file\n");
+			case OPT_DIFF:
+				context.diff.f = fopen(optarg, "w");
+				if (context.diff.f == 0)
+					printf("error opening diff file\n");
 			break;
 
-			case OPT_VERBOSE:
-				context.verbose |= VERBOSE_SDRAM | VERBOSE_READS | VERBOSE_WRITES | VERBOSE_VERIFY;
-			break;
-
-			case OPT_VERBOSE_SDRAM:
-				context.verbose |= VERBOSE_SDRAM;
-			break;
-
-			case OPT_VERBOSE_COMPACT:
-				context.verbose |= VERBOSE_COMPACT;
-			break;
-
-			case OPT_VERBOSE_READS:
-				context.verbose |= VERBOSE_READS;
-			break;
-
-			case OPT_VERBOSE_WRITES:
-				context.verbose |= VERBOSE_WRITES;
-			break;
-
-			case OPT_VERBOSE_ADDRESS:
-				context.verboseaddress = strtoul(optarg, 0, 0);
-				context.verbose |= VERBOSE_ADDRESS;
-			break;
-
-			case OPT_VERBOSE_VERIFY:
-				context.verbose |= VERBOSE_VERIFY;
-			break;
-
-			case OPT_VERBOSE_LEQ:
-				context.verboseleq = strtoul(optarg, 0, 0);
-				context.verbose |= VERBOSE_LEQ;
-			break;
-
-			case OPT_VERBOSE_GEQ:
-				context.verbosegeq = strtoul(optarg, 0, 0);
-				context.verbose |= VERBOSE_GEQ;
+			case OPT_DIFF_AT:
+				if (0 != diff_addpoints(&context.diff, optarg))
+				{
+					printf("error invalid sample index list\n");
+					goto clean;
+				}
 			break;
 
-			case OPT_STOP:
-				context.stopindex = strtoul(optarg, 0, 0);
+			case OPT_HEATMAP:
+				context.heat.f = fopen(optarg, "w");
+				if (context.heat.f == 0)
+					printf("error opening heatmap file\n");
 			break;
 
-
-			case OPT_HELP:
-				usage(argv[0]);
+			case OPT_HEATMAP_INTERVAL:
+				context.heat.interval = strtoull(optarg, 0, 0);
+				if (context.heat.interval == 0)
+				{
+					printf("error heatmap interval must not be 0\n");
+					goto clean;
+				}
 			break;
 
 			default:
-				usage(argv[0]);
+				result = decoder_option(&context, &options, c, optarg);
+				if (result < 0)
+					goto clean;
+				if (result == 0)
+					usage(argv[0]);
 		}
 	}
 	if ( optind == argc - 1)
@@ -669,28 +742,73 @@ int main(int argc, char* argv[])
 		goto clean;
 	}
 
-	if (Z_OK != traceram(&context, ftrace))
+	if (0 != mem_init(&context.memory, options.addressbits))
 	{
-		printf("error processing file\n");
+		printf("error allocating RAM memory\n");
+		goto clean;
+	}
+
+	if (context.diff.f && context.diff.pointcount == 0)
+	{
+		printf("error --diff needs the samples to compare at, see --diff-at\n");
+		goto clean;
+	}
+
+	if ((context.diff.f && 0 != diff_init(&context.diff, &context.memory)) ||
+		(context.heat.f && 0 != heat_init(&context.heat, &context.memory)))
+	{
+		printf("error allocating report memory\n");
 		goto clean;
 	}
+	report_schedule(&context);
 
+	if (context.pipeline)
+	{
+		out_startwriter(&context.out);
+		if (context.events.f)
+			out_startwriter(&context.events);
+	}
 
-	if (fmem)
+	if (options.dobenchmark)
 	{
-		if (fwrite(context.memory, 128 * 1024 * 1024, 1, fmem) != 1)
+		if (Z_OK != benchmark(&context, ftrace))
 		{
-			printf("error writing memory file\n");
-			goto clean;
+			out_flush(&context.out);
+			printf("error processing file\n");
 		}
+		goto clean;
+	}
+
+	if (Z_OK != traceram(&context, ftrace))
+	{
+		out_flush(&context.out);
+		printf("error processing file\n");
+		goto clean;
 	}
 
+	report_finish(&context);
+
+	if (0 != decoder_writememory(&context, &options))
+		goto clean;
+
 clean:
 	if (ftrace)
 		fclose(ftrace);
-	if (fmem)
-		fclose(fmem);
-	free(context.memory);
+	decoder_closeoptions(&options);
+	if (context.diff.f)
+		fclose(context.diff.f);
+	if (context.heat.f)
+		fclose(context.heat.f);
+	diff_destroy(&context.diff);
+	heat_destroy(&context.heat);
+	mem_destroy(&context.memory);
 	rwacc_destroy(&context.acc);
+	watch_destroy(&context.watch);
+	out_destroy(&context.out);
+	if (context.events.f)
+	{
+		out_destroy(&context.events);
+		fclose(context.events.f);
+	}
 	return 0;
 }
@@ -6,6 +6,7 @@
 #include "hw_commandbuffer.h"
 #include "hw_commandtype.h"
 #include "hw_main.h"
+#include "hw_filter.h"
 
 
 extern int yylex(void* ctx);
@@ -25,12 +26,13 @@ static HWCommand* getcmd(void* ctx)
 	return (HWCommand*)ctx;
 }
  
-void yyerror(const char *s);
-#define YYPARSE_PARAM ctx
-#define YYLEX_PARAM ctx
+void yyerror(void* ctx, const char *s);
 
 %}
 
+%parse-param {void* ctx}
+%lex-param {void* ctx}
+
 
 %union {
 	HWCommandNumber num;
@@ -65,6 +67,12 @@ void yyerror(const char *s);
 %token LBRACKET
 %token RBRACKET
 %token UNKNOWN
+%token CMDFILTER
+%token RANGE
+%token READS
+%token WRITES
+%token WINDOW
+%token CLEAR
 
 %type <num> number
 %type <buf> bytedata
@@ -94,6 +102,12 @@ stmt: 		CMDREADBYTE number ENDLINE    						{ HW_CommandReadByte(getcmd(ctx), $2
 			| CMDPXI number number datatypes ENDLINE   			{ HW_CommandPxi(getcmd(ctx), $2.value, $3.value, $4); YYACCEPT; }
 			| CMDBREAKPOINT number ENDLINE   					{ HW_CommandSetBreakpoint(getcmd(ctx), $2.value); YYACCEPT; }
 			| CMDCONTINUE ENDLINE   							{ HW_CommandContinue(getcmd(ctx)); YYACCEPT; }
+			| CMDFILTER ENDLINE   								{ HW_ShowFilter(); YYACCEPT; }
+			| CMDFILTER RANGE number number ENDLINE   			{ HW_AddFilterRange($3.value, $4.value); YYACCEPT; }
+			| CMDFILTER READS ENDLINE   						{ HW_SetFilterTypes(HWFILTER_READS); YYACCEPT; }
+			| CMDFILTER WRITES ENDLINE   						{ HW_SetFilterTypes(HWFILTER_WRITES); YYACCEPT; }
+			| CMDFILTER WINDOW number number ENDLINE   			{ HW_SetFilterWindow($3.value, $4.value); YYACCEPT; }
+			| CMDFILTER CLEAR ENDLINE   						{ HW_ClearFilter(); YYACCEPT; }
 			| ENDLINE 											{ YYACCEPT; }
 			| error ENDLINE										{ YYABORT; }
 			;
@@ -137,6 +151,6 @@ void HW_CommandParse(HWCommand* command) {
 	HW_MemoryPoolClear(&command->mempool); 
 }
 
-void yyerror(const char *s) {
+void yyerror(void* ctx, const char *s) {
 	printf("%s\n", s);
 }
\ No newline at end of file
@@ -422,11 +422,11 @@ void DebuggerWrite(Debugger* debugger, unsigned int command, unsigned char* buff
 */
 
 /**
-	Reads a command, and appends it to the HWBuffer.
+	Reads a command, and appends it to the HWRingBuffer.
 	
 	Returns 1 if a command was read, 0 otherwise.
  */
-unsigned int DebuggerRead(Debugger* debugger, HWBuffer* buffer)
+unsigned int DebuggerRead(Debugger* debugger, HWRingBuffer* buffer)
 {
 	unsigned int result = 0;
 	unsigned char dummybuffer[4] = {0, 0, 0, 0};
@@ -448,12 +448,12 @@ unsigned int DebuggerRead(Debugger* debugger, HWBuffer* buffer)
 			{
 				if (cmdid >= DEBUGGER_MIN_CMD_ID)
 				{					
-					HW_BufferAppend(buffer, cmdbuf, totalsize);
+					HW_RingBufferAppend(buffer, cmdbuf, totalsize);
 					
 					alignedsize = (cmdsize+3) & (~3);
 					restsize = alignedsize - cmdsize;
 					if (restsize)
-						HW_BufferAppend(buffer, dummybuffer, restsize);
+						HW_RingBufferAppend(buffer, dummybuffer, restsize);
 						
 					result = 1;
 				}
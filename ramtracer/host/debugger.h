@@ -72,7 +72,7 @@ int  DebuggerIsEnabled();
 void DebuggerSetEnabled(int enabled);
 void DebuggerBegin(Debugger* debugger);
 void DebuggerFinish(Debugger* debugger);
-unsigned int DebuggerRead(Debugger* debugger, HWBuffer* buffer);
+unsigned int DebuggerRead(Debugger* debugger, HWRingBuffer* buffer);
 void DebuggerWrite(Debugger* debugger, unsigned int cmdid, unsigned char* buffer, unsigned int buffersize) ;
 void DebuggerSend(Debugger* debugger, unsigned char* buffer, unsigned int buffersize);
 void DebuggerSendByte(Debugger* debugger, char byte);
@@ -35,14 +35,51 @@
 #define POOLTRANSFERCOUNT 32
 
 
+typedef enum {
+   STREAM_RUNNING,
+   STREAM_CLEANUP,                  // Waiting for the callback to finish up
+   STREAM_CANCEL,                   // Waiting for cancelled transfers to complete
+   STREAM_DONE,
+} FTDIStreamStage;
+
 typedef struct {
    FTDIDevice* dev;
    FTDIStreamCallback *callback;
    void *userdata;
    int result;
+   FTDIBufferCallback *bufferCallback;
    FTDIProgressInfo progress;
+   FTDIStreamStage stage;
+   int err;
+
+   struct libusb_transfer **transfers;
+   struct FTDIStreamSlot *slots;
+   uint8_t *region;
+   size_t regionSize;
+   bool devMem;
+   bool autoTune;
+   double tuneTime;
+   struct timeval cancelled;
+
+   int numTransfers;
+   int target;                      // Transfers to keep in flight
+   int inflight;
+   int batch;                       // Completions in this pass of the event loop
+   struct libusb_transfer **idle;   // Completed transfers waiting to be resubmitted
+   int idleCount;
+
+   int tuneBatchMax;
+   int tuneQuietPeriods;
+   uint64_t tuneTransfers;
+   uint64_t tuneOverruns;
+   double tuneLatency;
 } FTDIStreamState;
 
+typedef struct FTDIStreamSlot {
+   FTDIStreamState* state;
+   struct timeval submitted;
+} FTDIStreamSlot;
+
 
 static FTDITransfer* PoolPopFree(FTDITransferPool* pool)
 {
@@ -135,62 +172,138 @@ static int DeviceInit(FTDIDevice *dev)
 }
 
 
+/*
+ * Supported rigs, in the order they are looked for. The pin assignment
+ * of the FPGA configuration interface differs between board revisions.
+ */
+
+typedef struct {
+   uint16_t vendor;
+   uint16_t product;
+   unsigned int datamask;
+   unsigned int CSI_BIT;
+   unsigned int RDWR_BIT;
+   unsigned int DONE_BIT;
+   unsigned int PROG_BIT;
+   const char* devicemask;
+   unsigned int patchcapability;
+} FTDIDeviceType;
+
+static const FTDIDeviceType deviceTypes[] = {
+   { TWLFPGA_VENDOR,  TWLFPGA_PRODUCT,      0x01234567, (1<<0), (1<<1), (1<<2), (1<<3), "3s500epq208", 0 },
+   { FTDI_VENDOR,     FTDI_PRODUCT_FT2232H, 0x01234567, (1<<0), (1<<1), (1<<2), (1<<3), "3s500epq208", 0 },
+   { TEST_VENDOR,     TEST_PRODUCT,         0x01234567, (1<<0), (1<<1), (1<<2), (1<<3), "3s500epq208", 0 },
+   { CTRFPGA_VENDOR,  CTRFPGA_PRODUCT,      0x01234567, (1<<0), (1<<1), (1<<2), (1<<3), "3s500epq208", 1 },
+   { CTRFPGA2_VENDOR, CTRFPGA2_PRODUCT,     0x45601237, (1<<0), (1<<3), (1<<2), (1<<1), "3s400afg400", 1 },
+};
+
+#define NUM_DEVICETYPES (sizeof deviceTypes / sizeof deviceTypes[0])
+
+
 int FTDIDevice_Open(FTDIDevice *dev)
 {
+  return FTDIDevice_OpenIndex(dev, NULL, 0);
+}
+
+
+/*
+ * Open the 'index'th rig connected, counting the supported device types in
+ * the order above. Index 0 is the device FTDIDevice_Open picks. With a
+ * 'libusb' context, the device joins it, so that the streams of several
+ * devices can be run by one event loop (see FTDIDevice_ReadStreams). The
+ * context then stays owned by the caller. Without one, the device gets a
+ * context of its own.
+ */
+
+int FTDIDevice_OpenIndex(FTDIDevice *dev, libusb_context *libusb, int index)
+{
+  libusb_device **list;
+  ssize_t count;
+  unsigned int type;
   int err;
 
   memset(dev, 0, sizeof *dev);
 
-  if ((err = libusb_init(&dev->libusb))) {
-    return err;
+  if (libusb) {
+    dev->libusb = libusb;
+  } else {
+    if ((err = libusb_init(&dev->libusb))) {
+      return err;
+    }
+    dev->ownlibusb = true;
   }
 
   //libusb_set_debug(dev->libusb, 2);
-  dev->datamask = 0x01234567;
-  dev->CSI_BIT = (1<<0);
-  dev->RDWR_BIT = (1<<1);
-  dev->DONE_BIT = (1<<2);
-  dev->PROG_BIT = (1<<3);	
-  dev->devicemask = "3s500epq208";
-  dev->patchcapability = 0;
-  dev->handle = libusb_open_device_with_vid_pid(dev->libusb, TWLFPGA_VENDOR, TWLFPGA_PRODUCT);
-
-  if (!dev->handle)
-	dev->handle = libusb_open_device_with_vid_pid(dev->libusb, FTDI_VENDOR, FTDI_PRODUCT_FT2232H);
- 
-  if (!dev->handle) 
-    dev->handle = libusb_open_device_with_vid_pid(dev->libusb, TEST_VENDOR, TEST_PRODUCT);
-  
-  if (!dev->handle) {
-    dev->handle = libusb_open_device_with_vid_pid(dev->libusb, CTRFPGA_VENDOR, CTRFPGA_PRODUCT);
-	dev->patchcapability = 1;
+  count = libusb_get_device_list(dev->libusb, &list);
+  if (count < 0) {
+    err = (int)count;
+    goto fail;
   }
 
+  for (type = 0; type < NUM_DEVICETYPES && !dev->handle; type++) {
+    const FTDIDeviceType *devtype = &deviceTypes[type];
+    ssize_t i;
+
+    for (i = 0; i < count; i++) {
+      struct libusb_device_descriptor desc;
+
+      if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+          desc.idVendor != devtype->vendor || desc.idProduct != devtype->product)
+        continue;
+
+      if (index--)
+        continue;
+
+      if ((err = libusb_open(list[i], &dev->handle))) {
+        libusb_free_device_list(list, 1);
+        goto fail;
+      }
+
+      dev->datamask = devtype->datamask;
+      dev->CSI_BIT = devtype->CSI_BIT;
+      dev->RDWR_BIT = devtype->RDWR_BIT;
+      dev->DONE_BIT = devtype->DONE_BIT;
+      dev->PROG_BIT = devtype->PROG_BIT;
+      dev->devicemask = devtype->devicemask;
+      dev->patchcapability = devtype->patchcapability;
+      break;
+    }
+  }
+
+  libusb_free_device_list(list, 1);
+
   if (!dev->handle) {
-    dev->handle = libusb_open_device_with_vid_pid(dev->libusb, CTRFPGA2_VENDOR, CTRFPGA2_PRODUCT);
-	dev->datamask = 0x45601237;
-	dev->CSI_BIT = (1<<0);
-	dev->RDWR_BIT = (1<<3);
-	dev->DONE_BIT = (1<<2);
-	dev->PROG_BIT = (1<<1);
-	dev->devicemask = "3s400afg400";
-	dev->patchcapability = 1;
+    err = LIBUSB_ERROR_NO_DEVICE;
+    goto fail;
   }
-	
 
-  if (!dev->handle)
-    return LIBUSB_ERROR_NO_DEVICE;
- 
+  if ((err = DeviceInit(dev))) {
+    libusb_close(dev->handle);
+    goto fail;
+  }
 
-  return DeviceInit(dev);
+  return 0;
+
+fail:
+  if (dev->ownlibusb)
+    libusb_exit(dev->libusb);
+  dev->libusb = NULL;
+  dev->handle = NULL;
+  return err;
 }
 
 
 void FTDIDevice_Close(FTDIDevice *dev)
 {
+   if (dev->replay) {
+      FTDIReplay_Close(dev);
+      return;
+   }
+
 	pthread_mutex_destroy(&dev->mutex);   
    libusb_close(dev->handle);
-   libusb_exit(dev->libusb);
+   if (dev->ownlibusb)
+      libusb_exit(dev->libusb);
 }
 
 
@@ -198,6 +311,9 @@ int FTDIDevice_Reset(FTDIDevice *dev)
 {
   int err;
 
+  if (dev->replay)
+    return 0;
+
   err = libusb_reset_device(dev->handle);
   if (err)
     return err;
@@ -212,6 +328,9 @@ int FTDIDevice_SetMode(FTDIDevice *dev, FTDIInterface interface,
 {
   int err;
 
+  if (dev->replay)
+    return 0;
+
   err = libusb_control_transfer(dev->handle,
                                 LIBUSB_REQUEST_TYPE_VENDOR
                                 | LIBUSB_RECIPIENT_DEVICE
@@ -283,6 +402,9 @@ int FTDIDevice_Write(FTDIDevice *dev, FTDIInterface interface, uint8_t *data, un
 {
    int err;
 
+   if (dev->replay)
+      return FTDIReplay_Write(dev, interface, data, length, async);
+
    if (async) {
       FTDITransfer* ftditransfer = DeviceTransferPop(dev);
       
@@ -339,6 +461,10 @@ int FTDIDevice_ReadByteSync(FTDIDevice *dev, FTDIInterface interface, uint8_t *b
   uint8_t packet[FTDI_PACKET_SIZE * 16];
   int transferred, err;
 
+  // There's no stale data to drain from a replay device
+  if (dev->replay)
+    return -1;
+
   err = libusb_bulk_transfer(dev->handle, FTDI_EP_IN(interface),
                              packet, sizeof packet, &transferred,
                              FTDI_COMMAND_TIMEOUT);
@@ -357,15 +483,70 @@ int FTDIDevice_ReadByteSync(FTDIDevice *dev, FTDIInterface interface, uint8_t *b
 }
 
 
+static double TimevalDiff(const struct timeval *a, const struct timeval *b)
+{
+   return (a->tv_sec - b->tv_sec) + 1e-6 * (a->tv_usec - b->tv_usec);
+}
+
+
+/*
+ * Returns true if any packet in a transfer has the overrun bit set.
+ */
+
+static bool StreamHasOverrun(uint8_t *buffer, int length)
+{
+   int pos;
+
+   for (pos = 0; pos + 1 < length; pos += FTDI_PACKET_SIZE) {
+      if (buffer[pos + 1] & FTDI_LINESTATUS_OE)
+         return true;
+   }
+
+   return false;
+}
+
+
+/*
+ * Strip the header from every packet in a transfer, moving the payloads
+ * together at the start of the buffer. Returns the payload length.
+ */
+
+static int StreamCompactPackets(uint8_t *buffer, int length)
+{
+   uint8_t *src = buffer;
+   uint8_t *dst = buffer;
+
+   while (length > FTDI_HEADER_SIZE) {
+      int payloadLen = length;
+
+      if (payloadLen > FTDI_PACKET_SIZE)
+         payloadLen = FTDI_PACKET_SIZE;
+      payloadLen -= FTDI_HEADER_SIZE;
+
+      memmove(dst, src + FTDI_HEADER_SIZE, payloadLen);
+      dst += payloadLen;
+      src += FTDI_PACKET_SIZE;
+      length -= FTDI_PACKET_SIZE;
+   }
+
+   return dst - buffer;
+}
+
+
 /*
  * Internal callback for one transfer's worth of stream data.
- * Split it into packets and invoke the callbacks.
+ * Split it into packets and invoke the callbacks, or hand the whole
+ * transfer over to the buffer callback in zero-copy mode.
  */
 
 static void LIBUSB_CALL ReadStreamCallback(struct libusb_transfer *transfer)
 {
-   FTDIStreamState *state = transfer->user_data;
+   FTDIStreamSlot *slot = transfer->user_data;
+   FTDIStreamState *state = slot->state;
+
 
+   state->inflight--;
+   state->batch++;
 
    if (state->result == 0) {
       if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
@@ -374,25 +555,54 @@ static void LIBUSB_CALL ReadStreamCallback(struct libusb_transfer *transfer)
          uint8_t *ptr = transfer->buffer;
          int length = transfer->actual_length;
          int numPackets = (length + FTDI_PACKET_SIZE - 1) >> FTDI_LOG_PACKET_SIZE;
-
-         for (i = 0; i < numPackets; i++) {
-            int payloadLen;
-            int packetLen = length;
-
-            if (packetLen > FTDI_PACKET_SIZE)
-               packetLen = FTDI_PACKET_SIZE;
-
-            payloadLen = packetLen - FTDI_HEADER_SIZE;
-            state->progress.current.totalBytes += payloadLen;
-
-            state->result = state->callback(state->dev, FTDI_CALLBACK_DATA, ptr + FTDI_HEADER_SIZE, payloadLen,
-                                            NULL, state->userdata);
+         struct timeval now;
+         double latency;
+
+         gettimeofday(&now, NULL);
+         latency = TimevalDiff(&now, &slot->submitted);
+         state->progress.transfers++;
+         state->progress.transferLatency += latency;
+         if (latency > state->progress.transferLatencyMax)
+            state->progress.transferLatencyMax = latency;
+
+         if (state->bufferCallback && !StreamHasOverrun(ptr, length)) {
+            uint8_t *buffer;
+
+            length = StreamCompactPackets(ptr, length);
+            state->progress.current.totalBytes += length;
+
+            buffer = state->bufferCallback(state->dev, ptr, length, state->userdata);
+            transfer->buffer = buffer;
+            if (!buffer)
+               state->result = LIBUSB_ERROR_NO_MEM;
+         } else {
+            for (i = 0; i < numPackets; i++) {
+               int payloadLen;
+               int packetLen = length;
+
+               if (packetLen > FTDI_PACKET_SIZE)
+                  packetLen = FTDI_PACKET_SIZE;
+
+               if (ptr[1] & FTDI_LINESTATUS_OE) {
+                  state->progress.overruns++;
+                  state->result = state->callback(state->dev, FTDI_CALLBACK_OVERRUN, NULL, 0,
+                                                  NULL, state->userdata);
+                  if (state->result)
+                     break;
+               }
+
+               payloadLen = packetLen - FTDI_HEADER_SIZE;
+               state->progress.current.totalBytes += payloadLen;
+
+               state->result = state->callback(state->dev, FTDI_CALLBACK_DATA, ptr + FTDI_HEADER_SIZE, payloadLen,
+                                               NULL, state->userdata);
             
-            if (state->result)
-               break;
+               if (state->result)
+                  break;
 
-            ptr += packetLen;
-            length -= packetLen;
+               ptr += packetLen;
+               length -= packetLen;
+            }
          }
 
       } else {
@@ -401,141 +611,462 @@ static void LIBUSB_CALL ReadStreamCallback(struct libusb_transfer *transfer)
    }
 
    if (state->result == 0) {
-      transfer->status = -1;
-      state->result = libusb_submit_transfer(transfer);
+      if (state->inflight < state->target) {
+         transfer->status = -1;
+         gettimeofday(&slot->submitted, NULL);
+         state->result = libusb_submit_transfer(transfer);
+         if (state->result == 0)
+            state->inflight++;
+      } else {
+         state->idle[state->idleCount++] = transfer;
+      }
    }
 }
 
 
-static double TimevalDiff(const struct timeval *a, const struct timeval *b)
+/*
+ * Auto-tuning of the number of transfers kept in flight. After every
+ * AUTOTUNE_INTERVAL, the largest number of transfers that completed in
+ * a single pass of the event loop is compared with the number in flight.
+ * If most of them completed at once, the host fell behind and the queue
+ * nearly ran dry, so it is doubled. If only a few ever complete at once
+ * and completion latency stays low, it is shrunk again to save memory
+ * bandwidth and latency.
+ */
+
+#define AUTOTUNE_INTERVAL        1.0
+#define AUTOTUNE_MINTRANSFERS    4
+#define AUTOTUNE_SHRINKPERIODS   10
+#define AUTOTUNE_MAXLATENCY      0.01
+
+static void StreamAutoTune(FTDIStreamState *state)
 {
-   return (a->tv_sec - b->tv_sec) + 1e-6 * (a->tv_usec - b->tv_usec);
+   FTDIProgressInfo *progress = &state->progress;
+   uint64_t transfers = progress->transfers - state->tuneTransfers;
+   double latency = 0.0;
+   int target = state->target;
+
+   if (transfers)
+      latency = (progress->transferLatency - state->tuneLatency) / transfers;
+
+   if (state->tuneBatchMax * 2 >= state->target ||
+       progress->overruns != state->tuneOverruns) {
+      target = state->target * 2;
+      state->tuneQuietPeriods = 0;
+   } else if (state->tuneBatchMax * 8 <= state->target && latency < AUTOTUNE_MAXLATENCY) {
+      if (++state->tuneQuietPeriods >= AUTOTUNE_SHRINKPERIODS) {
+         target = state->target - state->target / 4;
+         state->tuneQuietPeriods = 0;
+      }
+   } else {
+      state->tuneQuietPeriods = 0;
+   }
+
+   if (target > state->numTransfers)
+      target = state->numTransfers;
+   if (target < AUTOTUNE_MINTRANSFERS)
+      target = AUTOTUNE_MINTRANSFERS;
+
+   state->target = target;
+   state->tuneBatchMax = 0;
+   state->tuneTransfers = progress->transfers;
+   state->tuneLatency = progress->transferLatency;
+   state->tuneOverruns = progress->overruns;
 }
 
 
 /*
- * Use asynchronous transfers in libusb-1.0 for high-performance
- * streaming of data from a device interface back to the PC. This
- * function continuously transfers data until either an error occurs
- * or the callback returns a nonzero value. This function returns
- * a libusb error code or the callback's return value.
- *
- * For every contiguous block of received data, the callback will
- * be invoked.
+ * Submit idle transfers until the in-flight target is reached.
  */
 
+static int StreamSubmitIdle(FTDIStreamState *state)
+{
+   int err;
+
+   while (state->inflight < state->target && state->idleCount) {
+      struct libusb_transfer *transfer = state->idle[--state->idleCount];
+      FTDIStreamSlot *slot = transfer->user_data;
+
+      transfer->status = -1;
+      gettimeofday(&slot->submitted, NULL);
+      err = libusb_submit_transfer(transfer);
+      if (err)
+         return err;
+      state->inflight++;
+   }
+
+   state->progress.inflight = state->inflight;
+
+   return 0;
+}
+
+
+/*
+ * Set up all transfers of a stream and submit the first ones.
+ *
+ * The buffers for all transfers are carved out of a single region,
+ * allocated as DMA-able device memory where libusb and the OS support
+ * it. With a 'bufferCallback', transfers are handed over whole instead,
+ * and their buffers are provided by the caller.
+ */
 
-int FTDIDevice_ReadStream(FTDIDevice *dev, FTDIInterface interface, FTDIStreamCallback *callback, void *userdata, int packetsPerTransfer, int numTransfers)
+static int StreamBegin(FTDIStreamState *state, FTDIInterface interface, int packetsPerTransfer, int numTransfers)
 {
-   struct libusb_transfer **transfers;
-   FTDIStreamState state = { dev, callback, userdata };
+   FTDIDevice *dev = state->dev;
    int bufferSize = packetsPerTransfer * FTDI_PACKET_SIZE;
    int xferIndex;
-   int err = 0;
-	
-   
-   /*
-    * Set up all transfers
-    */
-   
-   transfers = calloc(numTransfers, sizeof *transfers);
-   if (!transfers) {
-      err = LIBUSB_ERROR_NO_MEM;
-      goto cleanup;
+
+   state->transfers = calloc(numTransfers, sizeof *state->transfers);
+   state->slots = calloc(numTransfers, sizeof *state->slots);
+   state->idle = calloc(numTransfers, sizeof *state->idle);
+   if (!state->transfers || !state->slots || !state->idle)
+      return LIBUSB_ERROR_NO_MEM;
+
+   state->regionSize = (size_t)bufferSize * numTransfers;
+   if (!state->bufferCallback) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+      state->region = libusb_dev_mem_alloc(dev->handle, state->regionSize);
+      if (state->region)
+         state->devMem = true;
+#endif
+      if (!state->region)
+         state->region = malloc(state->regionSize);
+      if (!state->region)
+         return LIBUSB_ERROR_NO_MEM;
+   }
+
+   state->numTransfers = numTransfers;
+   state->target = numTransfers;
+   if (state->autoTune) {
+      state->target = numTransfers / 4;
+      if (state->target < AUTOTUNE_MINTRANSFERS)
+         state->target = AUTOTUNE_MINTRANSFERS;
+      if (state->target > numTransfers)
+         state->target = numTransfers;
    }
    
    for (xferIndex = 0; xferIndex < numTransfers; xferIndex++) {
       struct libusb_transfer *transfer;
       
       transfer = libusb_alloc_transfer(0);
-      transfers[xferIndex] = transfer;
-      if (!transfer) {
-         err = LIBUSB_ERROR_NO_MEM;
-         goto cleanup;
-      }
+      state->transfers[xferIndex] = transfer;
+      if (!transfer)
+         return LIBUSB_ERROR_NO_MEM;
       
+      state->slots[xferIndex].state = state;
       libusb_fill_bulk_transfer(transfer, dev->handle, FTDI_EP_IN(interface),
-                                malloc(bufferSize), bufferSize, ReadStreamCallback,
-                                &state, 0);
-      
-      if (!transfer->buffer) {
-         err = LIBUSB_ERROR_NO_MEM;
-         goto cleanup;
-      }
+                                state->region ? state->region + (size_t)xferIndex * bufferSize : NULL,
+                                bufferSize, ReadStreamCallback, &state->slots[xferIndex], 0);
+
+      if (state->bufferCallback)
+         transfer->buffer = state->bufferCallback(dev, NULL, 0, state->userdata);
+      if (!transfer->buffer)
+         return LIBUSB_ERROR_NO_MEM;
       
-      transfer->status = -1;
-      err = libusb_submit_transfer(transfer);
-      if (err)
-         goto cleanup;
+      state->idle[state->idleCount++] = transfer;
    }
-   
-   /*
-    * Run the transfers, and periodically assess progress.
-    */
-   
-   gettimeofday(&state.progress.first.time, NULL);
-   
-   do {
-      FTDIProgressInfo  *progress = &state.progress;
-      const double progressInterval = 0.1;
-      struct timeval timeout = { 0, 10000 };
-      struct timeval now;
+
+   gettimeofday(&state->progress.first.time, NULL);
+
+   return StreamSubmitIdle(state);
+}
+
+
+/*
+ * Periodic work after a pass of the event loop: assess progress, tune
+ * the transfers in flight and resubmit idle transfers.
+ */
+
+static void StreamPoll(FTDIStreamState *state)
+{
+   FTDIProgressInfo  *progress = &state->progress;
+   const double progressInterval = 0.1;
+   struct timeval now;
+
+   if (state->batch > state->tuneBatchMax)
+      state->tuneBatchMax = state->batch;
+   state->batch = 0;
+      
+   // If enough time has elapsed, update the progress
+   gettimeofday(&now, NULL);
+   if (TimevalDiff(&now, &progress->current.time) >= progressInterval) {
+      double currentTime;
+      
+      
+      progress->current.time = now;
       
-      int err = libusb_handle_events_timeout(dev->libusb, &timeout);
-      if (!state.result) {
-         state.result = err;
+      progress->totalTime = TimevalDiff(&progress->current.time, &progress->first.time);
+      currentTime = TimevalDiff(&progress->current.time, &progress->prev.time);
+      
+      progress->totalRate = progress->current.totalBytes / progress->totalTime;
+      progress->currentRate = (progress->current.totalBytes - progress->prev.totalBytes) / currentTime;
+
+      if (state->autoTune && progress->totalTime - state->tuneTime >= AUTOTUNE_INTERVAL) {
+         StreamAutoTune(state);
+         state->tuneTime = progress->totalTime;
       }
       
-      // If enough time has elapsed, update the progress
-      gettimeofday(&now, NULL);
-      if (TimevalDiff(&now, &progress->current.time) >= progressInterval) {
-         double currentTime;
-         
-         
-         progress->current.time = now;
-         
-         progress->totalTime = TimevalDiff(&progress->current.time, &progress->first.time);
-         currentTime = TimevalDiff(&progress->current.time, &progress->prev.time);
-         
-         progress->totalRate = progress->current.totalBytes / progress->totalTime;
-         progress->currentRate = (progress->current.totalBytes - progress->prev.totalBytes) / currentTime;
-         
-         state.result = state.callback(state.dev, FTDI_CALLBACK_PERIODICAL, NULL, 0, progress, state.userdata);
-         
-         
-         progress->prev = progress->current;
-      }	   
-   } while (!state.result);
-   
-   while(1)
-   {
-      if (0 != state.callback(state.dev, FTDI_CALLBACK_CLEANUP, NULL, 0, &state.progress, state.userdata))
-         break;
+      state->result = state->callback(state->dev, FTDI_CALLBACK_PERIODICAL, NULL, 0, progress, state->userdata);
+      
       
-      mssleep(1);
+      progress->prev = progress->current;
    }
-   
-   /*
-    * Cancel any outstanding transfers, and free memory.
-    */
-   
-cleanup:
-   if (transfers) {
-      for (xferIndex = 0; xferIndex < numTransfers; xferIndex++) {
-         struct libusb_transfer *transfer = transfers[xferIndex];
+
+   if (!state->result)
+      state->result = StreamSubmitIdle(state);
+}
+
+
+/*
+ * Cancel any outstanding transfers, and free memory.
+ */
+
+static void StreamCancel(FTDIStreamState *state)
+{
+   int xferIndex;
+
+   if (!state->transfers)
+      return;
+
+   for (xferIndex = 0; xferIndex < state->numTransfers; xferIndex++) {
+      struct libusb_transfer *transfer = state->transfers[xferIndex];
+
+      if (transfer && transfer->status == -1)
+         libusb_cancel_transfer(transfer);
+   }
+
+   gettimeofday(&state->cancelled, NULL);
+}
+
+static void StreamEnd(FTDIStreamState *state)
+{
+   int xferIndex;
+
+   if (state->transfers) {
+      for (xferIndex = 0; xferIndex < state->numTransfers; xferIndex++) {
+         struct libusb_transfer *transfer = state->transfers[xferIndex];
          
          if (transfer) {
-            if (transfer->status == -1)
-               libusb_cancel_transfer(transfer);
-            free(transfer->buffer);
+            if (state->bufferCallback && transfer->buffer)
+               state->bufferCallback(state->dev, transfer->buffer, -1, state->userdata);
             libusb_free_transfer(transfer);
          }
       }
-      free(transfers);
+      free(state->transfers);
    }
-      
-   if (err)
-      return err;
+   free(state->slots);
+   free(state->idle);
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+   if (state->devMem)
+      libusb_dev_mem_free(state->dev->handle, state->region, state->regionSize);
    else
-      return state.result;
+#endif
+      free(state->region);
+}
+
+
+/*
+ * Advance a stream that has stopped through its cleanup. The callback is
+ * called until it agrees to finish, then the transfers still in flight
+ * are cancelled. Devices that don't give them back within a second are
+ * given up on.
+ */
+
+#define STREAM_CANCELTIMEOUT     1.0
+
+static void StreamFinish(FTDIStreamState *state)
+{
+   struct timeval now;
+
+   switch (state->stage) {
+   case STREAM_RUNNING:
+      break;
+
+   case STREAM_CLEANUP:
+      if (0 != state->callback(state->dev, FTDI_CALLBACK_CLEANUP, NULL, 0, &state->progress, state->userdata)) {
+         StreamCancel(state);
+         state->stage = STREAM_CANCEL;
+      }
+      break;
+
+   case STREAM_CANCEL:
+      gettimeofday(&now, NULL);
+      if (state->inflight <= 0 || TimevalDiff(&now, &state->cancelled) >= STREAM_CANCELTIMEOUT) {
+         StreamEnd(state);
+         state->stage = STREAM_DONE;
+      }
+      break;
+
+   case STREAM_DONE:
+      break;
+   }
+}
+
+
+/*
+ * Replay devices have no transfers to wait for, they each stream from a
+ * thread of their own when running alongside other devices.
+ */
+
+typedef struct {
+   FTDIStreamState* state;
+   FTDIInterface interface;
+   pthread_t thread;
+} FTDIReplayThread;
+
+static void* ReplayStreamThread(void* arg)
+{
+   FTDIReplayThread* replay = arg;
+   FTDIStreamState* state = replay->state;
+
+   state->result = FTDIReplay_ReadStream(state->dev, replay->interface, state->callback, state->userdata);
+   return 0;
+}
+
+
+/*
+ * Use asynchronous transfers in libusb-1.0 for high-performance
+ * streaming of data from a device interface back to the PC. This
+ * function continuously transfers data until either an error occurs
+ * or the callback returns a nonzero value. This function returns
+ * a libusb error code or the callback's return value.
+ *
+ * For every contiguous block of received data, the callback will
+ * be invoked. With a 'bufferCallback', transfers are handed over whole
+ * instead. With 'autoTune' set, only part of the 'numTransfers' transfers
+ * are kept in flight, adjusted at runtime (see StreamAutoTune).
+ */
+
+int FTDIDevice_ReadStream(FTDIDevice *dev, FTDIInterface interface, FTDIStreamCallback *callback, void *userdata, int packetsPerTransfer, int numTransfers, bool autoTune, FTDIBufferCallback *bufferCallback)
+{
+   int result;
+
+   if (dev->replay)
+      return FTDIReplay_ReadStream(dev, interface, callback, userdata);
+
+   FTDIDevice_ReadStreams(&dev, 1, interface, callback, &userdata, &result, packetsPerTransfer, numTransfers, autoTune, bufferCallback);
+
+   return result;
+}
+
+
+/*
+ * Stream from 'count' devices at once, like FTDIDevice_ReadStream. All
+ * USB devices are serviced by a single event loop in the calling thread,
+ * so they have to share a libusb context (see FTDIDevice_OpenIndex). The
+ * callbacks are invoked with the 'userdata' of their device, and a device
+ * that stops doesn't stop the others. The function returns when all of
+ * them have stopped. The result of each stream is stored in 'results',
+ * and the first error of any of them is returned.
+ */
+
+int FTDIDevice_ReadStreams(FTDIDevice **devs, int count, FTDIInterface interface, FTDIStreamCallback *callback, void **userdata, int *results, int packetsPerTransfer, int numTransfers, bool autoTune, FTDIBufferCallback *bufferCallback)
+{
+   FTDIStreamState *states;
+   FTDIReplayThread *replays;
+   libusb_context *libusb = NULL;
+   int running = 0;
+   int err = 0;
+   int i;
+
+   states = calloc(count, sizeof *states);
+   replays = calloc(count, sizeof *replays);
+   if (!states || !replays) {
+      free(states);
+      free(replays);
+      return LIBUSB_ERROR_NO_MEM;
+   }
+
+   for (i = 0; i < count; i++) {
+      FTDIStreamState *state = &states[i];
+
+      state->dev = devs[i];
+      state->callback = callback;
+      state->userdata = userdata[i];
+      state->bufferCallback = bufferCallback;
+      state->autoTune = autoTune;
+      state->stage = STREAM_DONE;
+
+      if (devs[i]->replay)
+         continue;
+
+      if (!libusb)
+         libusb = devs[i]->libusb;
+      if (devs[i]->libusb != libusb) {
+         state->result = LIBUSB_ERROR_INVALID_PARAM;
+         continue;
+      }
+
+      state->err = StreamBegin(state, interface, packetsPerTransfer, numTransfers);
+      if (state->err) {
+         StreamCancel(state);
+         StreamEnd(state);
+         continue;
+      }
+
+      state->stage = STREAM_RUNNING;
+      running++;
+   }
+
+   for (i = 0; i < count; i++) {
+      if (!devs[i]->replay)
+         continue;
+
+      replays[i].state = &states[i];
+      replays[i].interface = interface;
+      if (pthread_create(&replays[i].thread, NULL, ReplayStreamThread, &replays[i]) != 0) {
+         replays[i].state = NULL;
+         states[i].err = LIBUSB_ERROR_NO_MEM;
+      }
+   }
+   
+   /*
+    * Run the transfers of all devices until each of them has stopped.
+    */
+   
+   while (running) {
+      struct timeval timeout = { 0, 10000 };
+      int eventerr;
+
+      eventerr = libusb_handle_events_timeout(libusb, &timeout);
+      
+      running = 0;
+      for (i = 0; i < count; i++) {
+         FTDIStreamState *state = &states[i];
+
+         if (state->stage == STREAM_RUNNING) {
+            if (!state->result)
+               state->result = eventerr;
+            if (!state->result)
+               StreamPoll(state);
+            if (state->result)
+               state->stage = STREAM_CLEANUP;
+         }
+
+         StreamFinish(state);
+
+         if (state->stage != STREAM_DONE)
+            running++;
+      }
+   }
+
+   for (i = 0; i < count; i++) {
+      if (replays[i].state)
+         pthread_join(replays[i].thread, 0);
+   }
+
+   for (i = 0; i < count; i++) {
+      int result = states[i].err ? states[i].err : states[i].result;
+
+      if (results)
+         results[i] = result;
+      if (result < 0 && !err)
+         err = result;
+   }
+
+   free(states);
+   free(replays);
+
+   return err;
 }
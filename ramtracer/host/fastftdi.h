@@ -67,8 +67,11 @@ typedef struct {
    FTDITransfer* free;
 } FTDITransferPool;
 
+typedef struct FTDIReplay FTDIReplay;
+
 typedef struct {
    libusb_context *libusb;
+   bool ownlibusb;            // Context created for this device alone
    libusb_device_handle *handle;
    unsigned int datamask;
    unsigned int CSI_BIT;
@@ -79,6 +82,7 @@ typedef struct {
    unsigned int patchcapability;
    FTDITransferPool transferpool;
 	pthread_mutex_t mutex;   
+   FTDIReplay* replay;
 } FTDIDevice;
 
 typedef struct {
@@ -90,6 +94,12 @@ typedef struct {
    double totalTime;
    double totalRate;
    double currentRate;
+
+   uint64_t transfers;        // Completed bulk transfers
+   int inflight;              // Bulk transfers currently submitted
+   uint64_t overruns;         // Packets flagged with a receive overrun by the device
+   double transferLatency;    // Sum of submit-to-completion times, in seconds
+   double transferLatencyMax;
 } FTDIProgressInfo;
 
 
@@ -97,6 +107,7 @@ typedef enum {
    FTDI_CALLBACK_DATA,
    FTDI_CALLBACK_PERIODICAL,
    FTDI_CALLBACK_CLEANUP,
+   FTDI_CALLBACK_OVERRUN,     // Data was lost before the next data callback
 } FTDICallbackType;
 
 /*
@@ -129,21 +140,45 @@ typedef enum {
 #define FTDI_LOG_PACKET_SIZE      9     // 512 == 1 << 9
 #define FTDI_HEADER_SIZE          2
 
+#define FTDI_LINESTATUS_OE        0x02  // Overrun error, in the second header byte
+
 typedef int (FTDIStreamCallback)(FTDIDevice* dev, FTDICallbackType cbtype, uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata);
 
+/*
+ * Buffer callback for zero-copy streaming. Each completed transfer is handed
+ * over whole, with the packet headers stripped and the payload compacted to
+ * the start of the buffer. Transfers with an overrun flagged in any packet
+ * go through the regular data and overrun callbacks instead. The callee takes ownership of 'buffer' and returns
+ * an empty buffer of the same size to resubmit the transfer with, or NULL on
+ * error. It's called with 'buffer' NULL to get the initial buffers, and with
+ * 'length' -1 to give back buffers that are still owned by transfers at the end.
+ */
+typedef uint8_t* (FTDIBufferCallback)(FTDIDevice* dev, uint8_t *buffer, int length, void *userdata);
+
 
 /*
  * Public Functions
  */
 
 int FTDIDevice_Open(FTDIDevice *dev);
+int FTDIDevice_OpenIndex(FTDIDevice *dev, libusb_context *libusb, int index);
 void FTDIDevice_Close(FTDIDevice *dev);
 int FTDIDevice_Reset(FTDIDevice *dev);
 int FTDIDevice_SetMode(FTDIDevice *dev, FTDIInterface interface, FTDIBitmode mode, uint8_t pinDirections, int baudRate);
 int FTDIDevice_Write(FTDIDevice *dev, FTDIInterface interface, uint8_t *data, unsigned int length, bool async);
 int FTDIDevice_WriteByteSync(FTDIDevice *dev, FTDIInterface interface, uint8_t byte);
 int FTDIDevice_ReadByteSync(FTDIDevice *dev, FTDIInterface interface, uint8_t *byte);
-int FTDIDevice_ReadStream(FTDIDevice *dev, FTDIInterface interface, FTDIStreamCallback *callback, void *userdata, int packetsPerTransfer, int numTransfers);
+int FTDIDevice_ReadStream(FTDIDevice *dev, FTDIInterface interface, FTDIStreamCallback *callback, void *userdata, int packetsPerTransfer, int numTransfers, bool autoTune, FTDIBufferCallback *bufferCallback);
+int FTDIDevice_ReadStreams(FTDIDevice **devs, int count, FTDIInterface interface, FTDIStreamCallback *callback, void **userdata, int *results, int packetsPerTransfer, int numTransfers, bool autoTune, FTDIBufferCallback *bufferCallback);
+
+/*
+ * Replay device (fastftdi_replay.c)
+ */
+
+int FTDIDevice_OpenReplay(FTDIDevice *dev, const char *filename, unsigned int rate);
+void FTDIReplay_Close(FTDIDevice *dev);
+int FTDIReplay_Write(FTDIDevice *dev, FTDIInterface interface, uint8_t *data, unsigned int length, bool async);
+int FTDIReplay_ReadStream(FTDIDevice *dev, FTDIInterface interface, FTDIStreamCallback *callback, void *userdata);
 
 
 #endif /* __FASTFTDI_H */
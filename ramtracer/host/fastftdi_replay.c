@@ -0,0 +1,258 @@
+/*
+ * fastftdi_replay.c - Replay device for fastftdi. Streams a recorded, compressed
+ *                     RAM trace through the regular FTDIDevice_ReadStream callback,
+ *                     so the capture pipeline can be exercised without hardware.
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <zlib.h>
+#include "fastftdi.h"
+#include "utils.h"
+
+#define REPLAY_INBUFFERSIZE   (64 * 1024)
+#define REPLAY_PAYLOADSIZE    (FTDI_PACKET_SIZE - FTDI_HEADER_SIZE)
+// Number of packets delivered between rate/progress checks, like one USB transfer.
+#define REPLAY_PACKETSPERTRANSFER 64
+
+
+struct FTDIReplay {
+   FILE* file;
+   z_stream stream;
+   int streamend;
+   unsigned int rate;
+   unsigned char inbuffer[REPLAY_INBUFFERSIZE];
+   unsigned char outbuffer[REPLAY_PAYLOADSIZE * REPLAY_PACKETSPERTRANSFER];
+   uint64_t writtenbytes;
+   uint64_t writecount;
+};
+
+
+static double TimevalDiff(const struct timeval *a, const struct timeval *b)
+{
+   return (a->tv_sec - b->tv_sec) + 1e-6 * (a->tv_usec - b->tv_usec);
+}
+
+
+/*
+ * Open a replay device. 'rate' is the replay speed in bytes per second,
+ * or 0 to replay as fast as the capture pipeline can take it. Trace files
+ * don't contain timestamps, so the original capture speed has to be given.
+ */
+
+int FTDIDevice_OpenReplay(FTDIDevice *dev, const char *filename, unsigned int rate)
+{
+   FTDIReplay* replay;
+
+   memset(dev, 0, sizeof *dev);
+
+   replay = malloc(sizeof(FTDIReplay));
+   if (!replay)
+      return LIBUSB_ERROR_NO_MEM;
+
+   memset(replay, 0, sizeof(FTDIReplay));
+   replay->rate = rate;
+   replay->file = fopen(filename, "rb");
+   if (!replay->file) {
+      perror(filename);
+      free(replay);
+      return LIBUSB_ERROR_NO_DEVICE;
+   }
+
+   replay->stream.zalloc = Z_NULL;
+   replay->stream.zfree = Z_NULL;
+   replay->stream.opaque = Z_NULL;
+   replay->stream.avail_in = 0;
+   replay->stream.next_in = Z_NULL;
+   if (inflateInit(&replay->stream) != Z_OK) {
+      fclose(replay->file);
+      free(replay);
+      return LIBUSB_ERROR_NO_MEM;
+   }
+
+   dev->datamask = 0x01234567;
+   dev->devicemask = "replay";
+   dev->patchcapability = 0;
+   dev->replay = replay;
+   pthread_mutex_init(&dev->mutex, 0);
+
+   fprintf(stderr, "Replay: Streaming trace %s", filename);
+   if (rate)
+      fprintf(stderr, " at %.1f kB/s\n", rate / 1024.0);
+   else
+      fprintf(stderr, " at maximum speed\n");
+
+   return 0;
+}
+
+
+void FTDIReplay_Close(FTDIDevice *dev)
+{
+   FTDIReplay* replay = dev->replay;
+
+   fprintf(stderr, "Replay: %llu bytes written to device in %llu writes.\n",
+           (unsigned long long)replay->writtenbytes, (unsigned long long)replay->writecount);
+
+   inflateEnd(&replay->stream);
+   fclose(replay->file);
+   free(replay);
+   dev->replay = 0;
+   pthread_mutex_destroy(&dev->mutex);
+}
+
+
+/*
+ * The write side of the replay device is a sink. Writes (FIFO data and
+ * configuration for the target) are only counted.
+ */
+
+int FTDIReplay_Write(FTDIDevice *dev, FTDIInterface interface, uint8_t *data, unsigned int length, bool async)
+{
+   pthread_mutex_lock(&dev->mutex);
+   dev->replay->writtenbytes += length;
+   dev->replay->writecount++;
+   pthread_mutex_unlock(&dev->mutex);
+
+   return 0;
+}
+
+
+/*
+ * Inflate up to one transfer worth of trace data. Returns the number of
+ * bytes available in the output buffer, 0 at the end of the trace, or
+ * a negative libusb error code.
+ */
+
+static int ReplayInflate(FTDIReplay* replay)
+{
+   z_stream* stream = &replay->stream;
+   int result;
+
+   stream->avail_out = sizeof replay->outbuffer;
+   stream->next_out = replay->outbuffer;
+
+   while (stream->avail_out && !replay->streamend) {
+      if (stream->avail_in == 0) {
+         stream->avail_in = fread(replay->inbuffer, 1, sizeof replay->inbuffer, replay->file);
+         stream->next_in = replay->inbuffer;
+         if (stream->avail_in == 0)
+            break;
+      }
+
+      result = inflate(stream, Z_NO_FLUSH);
+      if (result == Z_STREAM_END) {
+         replay->streamend = 1;
+      } else if (result != Z_OK && result != Z_BUF_ERROR) {
+         fprintf(stderr, "Replay: Error decompressing trace (%d)\n", result);
+         return LIBUSB_ERROR_IO;
+      }
+   }
+
+   return sizeof replay->outbuffer - stream->avail_out;
+}
+
+
+/*
+ * Replay counterpart of FTDIDevice_ReadStream. The trace is delivered to the
+ * callback in packet-sized blocks, with the same periodical progress updates.
+ * Returns 0 when the end of the trace is reached.
+ */
+
+int FTDIReplay_ReadStream(FTDIDevice *dev, FTDIInterface interface, FTDIStreamCallback *callback, void *userdata)
+{
+   FTDIReplay* replay = dev->replay;
+   FTDIProgressInfo progress;
+   int result = 0;
+
+   memset(&progress, 0, sizeof progress);
+   gettimeofday(&progress.first.time, NULL);
+   progress.prev.time = progress.first.time;
+
+   do {
+      const double progressInterval = 0.1;
+      struct timeval submitted, now;
+      double latency;
+      int length;
+      int pos;
+
+      // One inflated block stands in for a completed bulk transfer
+      gettimeofday(&submitted, NULL);
+      length = ReplayInflate(replay);
+      if (length <= 0) {
+         result = length;
+         break;
+      }
+
+      gettimeofday(&now, NULL);
+      latency = TimevalDiff(&now, &submitted);
+      progress.transfers++;
+      progress.transferLatency += latency;
+      if (latency > progress.transferLatencyMax)
+         progress.transferLatencyMax = latency;
+
+      for (pos = 0; pos < length && !result; pos += REPLAY_PAYLOADSIZE) {
+         int payloadLen = length - pos;
+
+         if (payloadLen > REPLAY_PAYLOADSIZE)
+            payloadLen = REPLAY_PAYLOADSIZE;
+
+         progress.current.totalBytes += payloadLen;
+         result = callback(dev, FTDI_CALLBACK_DATA, replay->outbuffer + pos, payloadLen, NULL, userdata);
+      }
+
+      // Hold back until the wall clock catches up with the requested rate
+      gettimeofday(&now, NULL);
+      if (replay->rate) {
+         double ahead = (double)progress.current.totalBytes / replay->rate - TimevalDiff(&now, &progress.first.time);
+
+         if (ahead >= 0.001) {
+            mssleep((unsigned int)(ahead * 1000));
+            gettimeofday(&now, NULL);
+         }
+      }
+
+      if (!result && TimevalDiff(&now, &progress.current.time) >= progressInterval) {
+         double currentTime;
+
+         progress.current.time = now;
+
+         progress.totalTime = TimevalDiff(&progress.current.time, &progress.first.time);
+         currentTime = TimevalDiff(&progress.current.time, &progress.prev.time);
+
+         progress.totalRate = progress.current.totalBytes / progress.totalTime;
+         progress.currentRate = (progress.current.totalBytes - progress.prev.totalBytes) / currentTime;
+
+         result = callback(dev, FTDI_CALLBACK_PERIODICAL, NULL, 0, &progress, userdata);
+
+         progress.prev = progress.current;
+      }
+   } while (!result);
+
+   if (result > 0) {
+      while (0 == callback(dev, FTDI_CALLBACK_CLEANUP, NULL, 0, &progress, userdata))
+         mssleep(1);
+   }
+
+   return result;
+}
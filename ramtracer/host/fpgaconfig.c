@@ -66,6 +66,14 @@ static unsigned char shuffle(unsigned int order, unsigned char c)
 	return out;
 }
 
+// Every byte shuffled into 'order', so a whole buffer takes a lookup per byte
+static void shuffle_table(unsigned char* table, unsigned int order)
+{
+	unsigned int c;
+	for(c=0; c<256; c++)
+		table[c] = shuffle(order, c);
+}
+
 
 static int
 ConfigSendBuffer(FTDIDevice *dev, uint8_t *data, size_t length)
@@ -91,6 +99,10 @@ ConfigSendBuffer(FTDIDevice *dev, uint8_t *data, size_t length)
       R6(0), R6(2), R6(1), R6(3)
     };
 
+  unsigned char shuffled[256];
+
+  shuffle_table(shuffled, dev->datamask);
+
   while (length) {
     uint8_t buffer[BLOCK_SIZE];
     size_t chunk = length;
@@ -100,7 +112,7 @@ ConfigSendBuffer(FTDIDevice *dev, uint8_t *data, size_t length)
       chunk = BLOCK_SIZE;
 
     for (i = 0; i < chunk; i++)
-      buffer[i] = shuffle(dev->datamask, data[i]);
+      buffer[i] = shuffled[data[i]];
 
     data += chunk;
     length -= chunk;
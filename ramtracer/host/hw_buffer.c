@@ -213,3 +213,149 @@ HWBuffer* HW_BufferChainAppendNew(HWBufferChain* chain)
 	
 	return node;
 }
+
+
+static void HW_RingBufferResize(HWRingBuffer* ring, unsigned int capacity)
+{
+   unsigned char* buffer = malloc(capacity);
+   unsigned int first = ring->capacity - ring->head;
+   
+   if (first > ring->size)
+      first = ring->size;
+   
+   memcpy(buffer, ring->buffer + ring->head, first);
+   memcpy(buffer + first, ring->buffer, ring->size - first);
+   
+   free(ring->buffer);
+   ring->buffer = buffer;
+   ring->capacity = capacity;
+   ring->head = 0;
+}
+
+// Copy data into the ring at a position relative to the front, wrapping around the end
+static void HW_RingBufferCopyIn(HWRingBuffer* ring, unsigned int offset, const void* buffer, unsigned int size)
+{
+   unsigned int pos = ring->head + offset;
+   unsigned int first;
+   
+   if (pos >= ring->capacity)
+      pos -= ring->capacity;
+   
+   first = ring->capacity - pos;
+   if (first > size)
+      first = size;
+   
+   memcpy(ring->buffer + pos, buffer, first);
+   memcpy(ring->buffer, (const unsigned char*)buffer + first, size - first);
+}
+
+void HW_RingBufferInit(HWRingBuffer* ring, unsigned int size)
+{
+   if (size < 16)
+      size = 16;
+   
+   ring->buffer = malloc(size);
+   ring->capacity = size;
+   ring->head = 0;
+   ring->size = 0;
+}
+
+void HW_RingBufferDestroy(HWRingBuffer* ring)
+{
+   free(ring->buffer);
+   ring->buffer = 0;
+   ring->capacity = 0;
+   ring->head = 0;
+   ring->size = 0;
+}
+
+void HW_RingBufferClear(HWRingBuffer* ring)
+{
+   ring->head = 0;
+   ring->size = 0;
+}
+
+unsigned int HW_RingBufferAvailable(HWRingBuffer* ring)
+{
+   return ring->capacity - ring->size;
+}
+
+// Fill ring data -- only up to the capacity of the HWRingBuffer
+unsigned int HW_RingBufferFill(HWRingBuffer* ring, const void* buffer, unsigned int size)
+{
+   unsigned int available = ring->capacity - ring->size;
+   
+   if (available < size)
+      size = available;
+   
+   HW_RingBufferCopyIn(ring, ring->size, buffer, size);
+   ring->size += size;
+   
+   return size;
+}
+
+// Append ring data -- allow growing of buffer
+void HW_RingBufferAppend(HWRingBuffer* ring, const void* buffer, unsigned int size)
+{
+   unsigned int available = ring->capacity - ring->size;
+   
+   if (available < size)
+      HW_RingBufferGrow(ring, ring->size + size);
+   
+   HW_RingBufferCopyIn(ring, ring->size, buffer, size);
+   ring->size += size;
+}
+
+// Overwrite data that is already queued, at a position relative to the front
+void HW_RingBufferWriteAt(HWRingBuffer* ring, unsigned int offset, const void* buffer, unsigned int size)
+{
+   if (offset + size > ring->size)
+      return;
+   
+   HW_RingBufferCopyIn(ring, offset, buffer, size);
+}
+
+// Get a contiguous view of the first 'size' bytes. The data is only moved
+// when the requested range wraps around the end of the ring.
+unsigned char* HW_RingBufferPeek(HWRingBuffer* ring, unsigned int size)
+{
+   if (size > ring->size)
+      return 0;
+   
+   if (ring->head + size > ring->capacity)
+      HW_RingBufferResize(ring, ring->capacity);
+   
+   return ring->buffer + ring->head;
+}
+
+void HW_RingBufferRemoveFront(HWRingBuffer* ring, unsigned int size)
+{
+   if (size > ring->size)
+      size = ring->size;
+   
+   ring->size -= size;
+   
+   if (ring->size == 0)
+   {
+      ring->head = 0;
+   }
+   else
+   {
+      ring->head += size;
+      if (ring->head >= ring->capacity)
+         ring->head -= ring->capacity;
+   }
+}
+
+void HW_RingBufferGrow(HWRingBuffer* ring, unsigned int minimumsize)
+{
+   unsigned int capacity = ring->capacity;
+   
+   if (capacity < 16)
+      capacity = 16;
+   
+   while(capacity < minimumsize)
+      capacity *= 2;
+   
+   HW_RingBufferResize(ring, capacity);
+}
@@ -31,6 +31,7 @@
 
 #define HWBUF_FLAG_ALLOC_NODE (1<<0)
 #define HWBUF_FLAG_ALLOC_BUFFER (1<<1)
+#define HWBUF_FLAG_TRANSFER (1<<2)      // Holds a USB transfer buffer, recycled when released
 
 
 /*
@@ -52,6 +53,18 @@ typedef struct {
 	HWBuffer* tail;
 } HWBufferChain;
 
+/*
+ * HWRingBuffer -- Circular byte queue, for FIFO-like buffers where data is
+ *                 appended at the back and consumed from the front.
+ */
+
+typedef struct {
+	unsigned char* buffer;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int size;
+} HWRingBuffer;
+
 /*
  * Public functions
  */
@@ -76,4 +89,15 @@ void           HW_BufferChainDestroyFirst(HWBufferChain* chain);
 void           HW_BufferChainAppend(HWBufferChain* chain, HWBuffer* node);
 HWBuffer*      HW_BufferChainAppendNew(HWBufferChain* chain);
 
+void           HW_RingBufferInit(HWRingBuffer* ring, unsigned int size);
+void           HW_RingBufferDestroy(HWRingBuffer* ring);
+void           HW_RingBufferClear(HWRingBuffer* ring);
+unsigned int   HW_RingBufferAvailable(HWRingBuffer* ring);
+unsigned int   HW_RingBufferFill(HWRingBuffer* ring, const void* buffer, unsigned int size);
+void           HW_RingBufferAppend(HWRingBuffer* ring, const void* buffer, unsigned int size);
+void           HW_RingBufferWriteAt(HWRingBuffer* ring, unsigned int offset, const void* buffer, unsigned int size);
+unsigned char* HW_RingBufferPeek(HWRingBuffer* ring, unsigned int size);
+void           HW_RingBufferRemoveFront(HWRingBuffer* ring, unsigned int size);
+void           HW_RingBufferGrow(HWRingBuffer* ring, unsigned int minimumsize);
+
 #endif // __HW_BUFFER_H_
@@ -27,6 +27,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/time.h>
 #include <zlib.h>
 #include "hw_capture.h"
 #include "hw_config.h"
@@ -37,32 +38,98 @@
 //#define ZCOMPLEVEL 2
 #define ZCOMPLEVEL 1
 
+// Wake up the process thread once this much unprocessed data has been queued.
+// A short USB packet (less than a full payload) always wakes it up immediately,
+// since it means the device had no more data to send for now.
+#define WAKEUP_SIZE (16 * 1024)
+#define WAKEUP_PAYLOADSIZE (FTDI_PACKET_SIZE - FTDI_HEADER_SIZE)
+
+// A block with this many sample headers that aren't a read or write is
+// considered out of alignment, meaning data was dropped without an overrun flag.
+#define FRAMING_MAXERRORS 4
+
 
 // Private functions
-static void* HW_CaptureThread(void* arg);
+static void* HW_CaptureProcessThread(void* arg);
+static void* HW_CaptureCompressThread(void* arg);
+static HWBuffer* HW_CaptureGetProcessNode(HWCapture* capture);
+static int HW_CaptureCanCompress(HWCapture* capture, HWBuffer* node);
+static unsigned int HW_CaptureCompress(HWCapture* capture, z_stream* stream, unsigned char* zbuffer, unsigned char* buffer, unsigned int size, int flush);
+static void HW_CaptureReleaseFirst(HWCapture* capture, unsigned int size, unsigned int compressedsize, double compresstime);
+static double HW_CaptureTime();
+static void HW_CaptureAppend(HWCapture* capture, uint8_t* buffer, unsigned int length);
+static unsigned int HW_CaptureCheckFraming(HWCapture* capture, uint8_t* buffer, unsigned int length, unsigned int* firsterror);
+static void HW_CaptureResync(HWCapture* capture, uint8_t* buffer, unsigned int length);
+static unsigned int HW_CaptureWrite(HWCapture* capture, z_stream* stream, unsigned char* zbuffer, unsigned char* buffer, unsigned int size);
+static unsigned int HW_CaptureRotate(HWCapture* capture, z_stream* stream, unsigned char* zbuffer);
+static unsigned int HW_CaptureFilterWrite(HWCapture* capture, z_stream* stream, unsigned char* zbuffer, unsigned char* buffer, unsigned int size);
+static unsigned int HW_CaptureFilterBytes(HWCapture* capture, z_stream* stream, unsigned char* zbuffer, unsigned char* buffer, unsigned int size);
+static unsigned int HW_CaptureFilterSwitch(HWCapture* capture, z_stream* stream, unsigned char* zbuffer);
 
 
-void HW_CaptureBegin(HWCapture* capture, FILE* outputFile, FTDIDevice* dev, int processenabled)
+/*
+ * HW_CaptureBegin --
+ *
+ *    Starts the capture threads. 'transfersize' is the size of the USB transfer
+ *    buffers handed over with HW_CaptureSwapBuffer, or 0 if all data is copied
+ *    in with HW_CaptureDataBlock. With 'segments' given, 'outputFile' is the
+ *    first segment, and the output is rotated over the following ones.
+ */
+
+void HW_CaptureBegin(HWCapture* capture, HWWriter* outputFile, HWSegments* segments, FTDIDevice* dev, int processenabled, unsigned int transfersize)
 {
 	int err;
 
 
 	capture->outputFile = outputFile;
+	capture->segments = segments;
+	capture->writephase = 0;
+	capture->rotate = 0;
 	capture->compressedsize = 0;
    capture->done = 0;
    capture->dev = dev;
+   capture->processenabled = processenabled;
+   capture->processrunning = processenabled;
+   capture->transfersize = transfersize;
+   capture->samplephase = 0;
+   capture->resync = 0;
+   capture->resyncsize = 0;
+   HW_FilterInit(&capture->filter);
+   capture->newfilterset = 0;
+   capture->filterswitch = 0;
+   capture->filteractive = 0;
+   capture->filterphase = 0;
+   capture->filtersample = 0;
+   HW_BufferChainInit(&capture->sparechain);
    
    HW_ProcessInit(&capture->process, dev, processenabled);
+   HW_StatsInit(&capture->stats);
 
 
 	pthread_mutex_init(&capture->mutex, 0);
+	pthread_cond_init(&capture->processcond, 0);
+	pthread_cond_init(&capture->compresscond, 0);
+	capture->pending = 0;
 	capture->running = 1;
 
-	err = pthread_create(&capture->thread, NULL, HW_CaptureThread, capture);
+	// The process thread services the target's FIFO channel with low latency, while the
+	// compress thread deflates full nodes to disk. Both work on the same buffer chain.
+	if (processenabled)
+	{
+		err = pthread_create(&capture->processthread, NULL, HW_CaptureProcessThread, capture);
+
+		if (err != 0)
+		{
+			perror("error starting capture process thread");
+			exit(1);
+		}
+	}
+
+	err = pthread_create(&capture->compressthread, NULL, HW_CaptureCompressThread, capture);
 
 	if (err != 0)
 	{
-		perror("error starting capture thread");
+		perror("error starting capture compress thread");
 		exit(1);
 	}
 }
@@ -70,7 +137,12 @@ void HW_CaptureBegin(HWCapture* capture, FILE* outputFile, FTDIDevice* dev, int
 
 unsigned int HW_CaptureTryStop(HWCapture* capture)
 {
+   pthread_mutex_lock(&capture->mutex);
    capture->running = 0;
+   pthread_cond_broadcast(&capture->processcond);
+   pthread_cond_broadcast(&capture->compresscond);
+   pthread_mutex_unlock(&capture->mutex);
+   
    return capture->done;
 }
 
@@ -80,15 +152,36 @@ void HW_CaptureFinish(HWCapture* capture)
 {
 	int err;
 
+	pthread_mutex_lock(&capture->mutex);
 	capture->running = 0;
-	err = pthread_join(capture->thread, 0);
+	pthread_cond_broadcast(&capture->processcond);
+	pthread_cond_broadcast(&capture->compresscond);
+	pthread_mutex_unlock(&capture->mutex);
+	
+	if (capture->processenabled)
+	{
+		err = pthread_join(capture->processthread, 0);
+		
+		if (err != 0)
+		{
+			perror("error stopping capture process thread");
+			exit(1);
+		}
+	}
+	
+	err = pthread_join(capture->compressthread, 0);
 	
 	if (err != 0)
 	{
-		perror("error stopping capture thread");
+		perror("error stopping capture compress thread");
 		exit(1);
 	}
 	
+	while(HW_BufferChainGetFirst(&capture->sparechain))
+		HW_BufferChainDestroyFirst(&capture->sparechain);
+	
+	pthread_cond_destroy(&capture->compresscond);
+	pthread_cond_destroy(&capture->processcond);
 	pthread_mutex_destroy(&capture->mutex);
 	
 	HW_ProcessDestroy(&capture->process);
@@ -98,18 +191,179 @@ void HW_CaptureFinish(HWCapture* capture)
 
 void HW_CaptureDataBlock(HWCapture* capture, uint8_t* buffer, unsigned int length)
 {
-	HWBuffer* node = 0;
-	unsigned int pos = 0;
+	unsigned int firsterror;
+	
+	if (capture->running == 0)
+		return;
+	
+	// Keep the samples before the first bad header, the data was lost after them.
+	if (capture->resync == 0 && HW_CaptureCheckFraming(capture, buffer, length, &firsterror) >= FRAMING_MAXERRORS)
+	{
+		HW_CaptureAppend(capture, buffer, firsterror);
+		buffer += firsterror;
+		length -= firsterror;
+		HW_CaptureGap(capture);
+	}
+	
+	if (capture->resync)
+		HW_CaptureResync(capture, buffer, length);
+	else
+		HW_CaptureAppend(capture, buffer, length);
+}
+
+/*
+ * HW_CaptureGap --
+ *
+ *    Records a gap in the trace, after the device reported an overrun or the
+ *    sample framing was lost. The incomplete sample is padded with 0xFF, which
+ *    decodes as a write with all bytes masked, and a marker sample is added.
+ *    Data that follows is collected to find the sample alignment again.
+ */
+
+void HW_CaptureGap(HWCapture* capture)
+{
+	uint8_t gap[SAMPLESIZE * 2];
+	unsigned int padsize = (SAMPLESIZE - capture->samplephase) % SAMPLESIZE;
+	uint32_t gapnumber = (uint32_t)capture->stats.gaps;
 	
 	if (capture->running == 0)
 		return;
+	
+	// Data collected for an earlier resync is lost as well
+	if (capture->resync)
+	{
+		pthread_mutex_lock(&capture->mutex);
+		capture->stats.resyncbytes += capture->resyncsize;
+		pthread_mutex_unlock(&capture->mutex);
+		capture->resyncsize = 0;
+		return;
+	}
+	
+	memset(gap, 0xFF, sizeof(gap));
+	gap[padsize] = HWCAPTURE_GAPHEADER;
+	gap[padsize + 4] = gapnumber;
+	gap[padsize + 5] = gapnumber >> 8;
+	gap[padsize + 6] = gapnumber >> 16;
+	gap[padsize + 7] = gapnumber >> 24;
+	
+	HW_CaptureAppend(capture, gap, padsize + SAMPLESIZE);
+	
+	pthread_mutex_lock(&capture->mutex);
+	capture->stats.gaps++;
+	pthread_mutex_unlock(&capture->mutex);
+	
+	fprintf(stdout, "WARNING: Capture data lost, gap %d recorded\n", gapnumber);
+	
+	capture->resync = 1;
+	capture->resyncsize = 0;
+}
+
+/*
+ * HW_CaptureCheckFraming --
+ *
+ *    Returns the number of samples in the block, at the current sample
+ *    alignment, that have a header other than read or write. The position
+ *    of the first one is stored in 'firsterror', if given.
+ */
+
+static unsigned int HW_CaptureCheckFraming(HWCapture* capture, uint8_t* buffer, unsigned int length, unsigned int* firsterror)
+{
+	unsigned int pos = (SAMPLESIZE - capture->samplephase) % SAMPLESIZE;
+	unsigned int errors = 0;
+	
+	if (firsterror)
+		*firsterror = length;
+	
+	for(; pos < length; pos += SAMPLESIZE)
+	{
+		if (buffer[pos] > 1)
+		{
+			if (errors == 0 && firsterror)
+				*firsterror = pos;
+			errors++;
+		}
+	}
+	
+	return errors;
+}
+
+/*
+ * HW_CaptureResync --
+ *
+ *    Collects data after a gap until HWCAPTURE_RESYNCSIZE bytes are available,
+ *    then picks the sample alignment with the most valid sample headers,
+ *    drops the bytes before it and resumes capturing.
+ */
+
+static void HW_CaptureResync(HWCapture* capture, uint8_t* buffer, unsigned int length)
+{
+	unsigned int copysize = HWCAPTURE_RESYNCSIZE - capture->resyncsize;
+	unsigned int offset;
+	unsigned int bestoffset = 0;
+	unsigned int besterrors = ~0;
+	
+	if (copysize > length)
+		copysize = length;
+	
+	memcpy(capture->resyncbuffer + capture->resyncsize, buffer, copysize);
+	capture->resyncsize += copysize;
+	
+	if (capture->resyncsize < HWCAPTURE_RESYNCSIZE)
+		return;
+	
+	for(offset=0; offset<SAMPLESIZE; offset++)
+	{
+		unsigned int errors = 0;
+		unsigned int pos;
+		
+		for(pos = offset; pos < HWCAPTURE_RESYNCSIZE; pos += SAMPLESIZE)
+		{
+			if (capture->resyncbuffer[pos] > 1)
+				errors++;
+		}
+		
+		if (errors < besterrors)
+		{
+			besterrors = errors;
+			bestoffset = offset;
+		}
+	}
+	
+	pthread_mutex_lock(&capture->mutex);
+	capture->stats.resyncbytes += bestoffset;
+	pthread_mutex_unlock(&capture->mutex);
+	
+	capture->resync = 0;
+	capture->resyncsize = 0;
+	HW_CaptureAppend(capture, capture->resyncbuffer + bestoffset, HWCAPTURE_RESYNCSIZE - bestoffset);
+	
+	if (copysize < length)
+		HW_CaptureDataBlock(capture, buffer + copysize, length - copysize);
+}
+
+/*
+ * HW_CaptureAppend --
+ *
+ *    Copies a block of data to the end of the buffer chain.
+ */
+
+static void HW_CaptureAppend(HWCapture* capture, uint8_t* buffer, unsigned int length)
+{
+	HWBuffer* node = 0;
+	unsigned int pos = 0;
+	unsigned int filled = 0;
+	
+	capture->samplephase = (capture->samplephase + length) % SAMPLESIZE;
 
 	pthread_mutex_lock(&capture->mutex);
 	node = HW_BufferChainGetLast(&capture->chain);
 	
 
 	if (node == 0)
+	{
 		node = HW_BufferChainAppendNew(&capture->chain);
+		capture->stats.nodes++;
+	}
 	
 
 	while(pos < length)
@@ -121,22 +375,544 @@ void HW_CaptureDataBlock(HWCapture* capture, uint8_t* buffer, unsigned int lengt
 		}
 		
 		pos += HW_BufferFill(node, buffer + pos, length - pos);
+		
+		if (node->size == node->capacity)
+			filled = 1;
 					
 		if (pos < length)
+		{
 			node = HW_BufferChainAppendNew(&capture->chain);
+			capture->stats.nodes++;
+		}
+	}
+	
+	capture->stats.capturedbytes += length;
+	capture->stats.queuedbytes += length;
+	if (capture->stats.queuedbytes > capture->stats.queuedbytesmax)
+		capture->stats.queuedbytesmax = capture->stats.queuedbytes;
+	if (capture->stats.nodes > capture->stats.nodesmax)
+		capture->stats.nodesmax = capture->stats.nodes;
+	
+	if (filled)
+		pthread_cond_signal(&capture->compresscond);
+	
+	// Batch wakeups of the process thread, unless a node just filled up or
+	// the device ran dry, in which case the data is needed right away.
+	capture->pending += length;
+	if (capture->pending >= WAKEUP_SIZE || length < WAKEUP_PAYLOADSIZE || filled)
+	{
+		capture->pending = 0;
+		pthread_cond_signal(&capture->processcond);
 	}
 	
 	pthread_mutex_unlock(&capture->mutex);
 }
 
-static void* HW_CaptureThread(void* arg)
+/*
+ * HW_CaptureSwapBuffer --
+ *
+ *    Zero-copy counterpart of HW_CaptureDataBlock, used as the fastftdi buffer
+ *    callback. The filled transfer buffer is queued as a node of its own, and
+ *    an empty buffer from the spare chain is returned in its place. Nodes go
+ *    back to the spare chain once they're written out.
+ */
+
+uint8_t* HW_CaptureSwapBuffer(HWCapture* capture, uint8_t* buffer, int length)
+{
+	HWBuffer* node;
+	HWBuffer* last;
+	uint8_t* spare;
+	
+	if (buffer && (length <= 0 || capture->running == 0))
+	{
+		if (length >= 0)
+			return buffer;
+		
+		// Buffer given back at the end of the stream
+		node = malloc(sizeof(HWBuffer));
+		if (node == 0)
+			return 0;
+		node->buffer = buffer;
+		node->capacity = capture->transfersize;
+		node->flags = HWBUF_FLAG_ALLOC_NODE | HWBUF_FLAG_ALLOC_BUFFER | HWBUF_FLAG_TRANSFER;
+		HW_BufferClear(node);
+		node->next = 0;
+		
+		pthread_mutex_lock(&capture->mutex);
+		HW_BufferChainAppend(&capture->sparechain, node);
+		pthread_mutex_unlock(&capture->mutex);
+		return 0;
+	}
+	
+	// Transfers that need resynchronising take the copying path, and the
+	// buffer is reused as is.
+	if (buffer && (capture->resync || HW_CaptureCheckFraming(capture, buffer, length, 0) >= FRAMING_MAXERRORS))
+	{
+		HW_CaptureDataBlock(capture, buffer, length);
+		return buffer;
+	}
+	
+	pthread_mutex_lock(&capture->mutex);
+	node = HW_BufferChainRemoveFirst(&capture->sparechain);
+	pthread_mutex_unlock(&capture->mutex);
+	
+	if (node == 0)
+	{
+		node = malloc(sizeof(HWBuffer));
+		if (node == 0)
+			return 0;
+		HW_BufferInit(node, capture->transfersize);
+		node->flags |= HWBUF_FLAG_ALLOC_NODE | HWBUF_FLAG_TRANSFER;
+		if (node->buffer == 0)
+		{
+			free(node);
+			return 0;
+		}
+	}
+	
+	if (buffer == 0)
+	{
+		// Initial buffer for a transfer, the node itself isn't needed
+		spare = node->buffer;
+		free(node);
+		return spare;
+	}
+	
+	spare = node->buffer;
+	node->buffer = buffer;
+	node->size = length;
+	node->capacity = length;
+	node->pos = 0;
+	node->next = 0;
+	
+	capture->samplephase = (capture->samplephase + length) % SAMPLESIZE;
+	
+	pthread_mutex_lock(&capture->mutex);
+	
+	// A partly filled node from the copying path won't get any more data
+	last = HW_BufferChainGetLast(&capture->chain);
+	if (last && last->size < last->capacity)
+		last->capacity = last->size;
+	
+	HW_BufferChainAppend(&capture->chain, node);
+	
+	capture->stats.nodes++;
+	capture->stats.capturedbytes += length;
+	capture->stats.queuedbytes += length;
+	if (capture->stats.queuedbytes > capture->stats.queuedbytesmax)
+		capture->stats.queuedbytesmax = capture->stats.queuedbytes;
+	if (capture->stats.nodes > capture->stats.nodesmax)
+		capture->stats.nodesmax = capture->stats.nodes;
+	
+	// Every transfer is a full node, so both threads have work now.
+	capture->pending = 0;
+	pthread_cond_signal(&capture->compresscond);
+	pthread_cond_signal(&capture->processcond);
+	pthread_mutex_unlock(&capture->mutex);
+	
+	return spare;
+}
+
+/*
+ * HW_CaptureGetStats --
+ *
+ *    Takes a consistent snapshot of the capture pipeline statistics.
+ */
+
+void HW_CaptureGetStats(HWCapture* capture, HWStats* stats)
+{
+	pthread_mutex_lock(&capture->mutex);
+	*stats = capture->stats;
+	pthread_mutex_unlock(&capture->mutex);
+}
+
+/*
+ * HW_CaptureSetFilter --
+ *
+ *    Sets the filter for the samples that are saved. The compress thread
+ *    switches to it at the next sample boundary, and records it in the trace.
+ */
+
+void HW_CaptureSetFilter(HWCapture* capture, const HWFilter* filter)
+{
+	pthread_mutex_lock(&capture->mutex);
+	capture->newfilter = *filter;
+	capture->newfilterset = 1;
+	pthread_mutex_unlock(&capture->mutex);
+}
+
+static double HW_CaptureTime()
+{
+	struct timeval now;
+	
+	gettimeofday(&now, NULL);
+	return now.tv_sec + 1e-6 * now.tv_usec;
+}
+
+/*
+ * HW_CaptureReleaseFirst --
+ *
+ *    Releases the first node in the chain once it has been written out,
+ *    and accounts for it in the statistics.
+ */
+
+static void HW_CaptureReleaseFirst(HWCapture* capture, unsigned int size, unsigned int compressedsize, double compresstime)
+{
+	HWBuffer* node;
+	
+	pthread_mutex_lock(&capture->mutex);
+	node = HW_BufferChainRemoveFirst(&capture->chain);
+	if (node->flags & HWBUF_FLAG_TRANSFER)
+	{
+		node->capacity = capture->transfersize;
+		node->next = 0;
+		HW_BufferClear(node);
+		HW_BufferChainAppend(&capture->sparechain, node);
+	}
+	else
+	{
+		HW_BufferDestroy(node);
+	}
+	capture->stats.nodes--;
+	capture->stats.queuedbytes -= size;
+	capture->stats.compressinbytes += size;
+	capture->stats.compressoutbytes += compressedsize;
+	capture->stats.compresstime += compresstime;
+	pthread_mutex_unlock(&capture->mutex);
+}
+
+/*
+ * HW_CaptureGetProcessNode --
+ *
+ *    Returns the first node that still has data waiting to be processed,
+ *    or 0 if the process thread is up to date. Call with the mutex held.
+ */
+
+static HWBuffer* HW_CaptureGetProcessNode(HWCapture* capture)
+{
+	HWBuffer* node = HW_BufferChainGetFirst(&capture->chain);
+	
+	while(node)
+	{
+		if (node->pos < node->size)
+			return node;
+		if (node->pos < node->capacity)
+			return 0;
+		node = node->next;
+	}
+	
+	return 0;
+}
+
+/*
+ * HW_CaptureCanCompress --
+ *
+ *    Returns nonzero if the node is full, and done being read by the
+ *    process thread. Call with the mutex held.
+ */
+
+static int HW_CaptureCanCompress(HWCapture* capture, HWBuffer* node)
+{
+	if (node == 0 || node->size != node->capacity)
+		return 0;
+	
+	if (capture->processenabled && node->pos != node->capacity)
+		return 0;
+	
+	return 1;
+}
+
+static void* HW_CaptureProcessThread(void* arg)
+{
+	HWCapture* capture = (HWCapture*)arg;
+	unsigned int events = 0;
+
+	while(capture->running)
+	{
+		HWBuffer* node = 0;
+		unsigned char* buffer;
+		unsigned int buffersize;
+		unsigned int bufferpos;
+		double starttime;
+		
+		pthread_mutex_lock(&capture->mutex);
+		
+		node = HW_CaptureGetProcessNode(capture);
+		
+		while(capture->running && node == 0)
+		{
+			pthread_cond_wait(&capture->processcond, &capture->mutex);
+			node = HW_CaptureGetProcessNode(capture);
+		}
+		
+		if (node)
+		{
+			buffer = node->buffer;
+			buffersize = node->size;
+			bufferpos = node->pos;
+		}
+		
+		pthread_mutex_unlock(&capture->mutex);
+		
+		if (node == 0)
+			continue;
+		
+		// The node can't be released while pos is behind, so it's safe to read it unlocked.
+		starttime = HW_CaptureTime();
+		HW_Process(&capture->process, buffer + bufferpos, buffersize - bufferpos);
+		
+		if (capture->segments && capture->process.events != events)
+		{
+			events = capture->process.events;
+			HW_SegmentsTrigger(capture->segments);
+		}
+		
+		pthread_mutex_lock(&capture->mutex);
+		HW_StatsAddProcessTime(&capture->stats, HW_CaptureTime() - starttime);
+		capture->stats.processedbytes += buffersize - bufferpos;
+		node->pos = buffersize;
+		if (node->pos == node->capacity)
+			pthread_cond_signal(&capture->compresscond);
+		pthread_mutex_unlock(&capture->mutex);
+	}
+	
+	pthread_mutex_lock(&capture->mutex);
+	capture->processrunning = 0;
+	pthread_cond_signal(&capture->compresscond);
+	pthread_mutex_unlock(&capture->mutex);
+
+	return 0;
+}
+
+static unsigned int HW_CaptureCompress(HWCapture* capture, z_stream* stream, unsigned char* zbuffer, unsigned char* buffer, unsigned int size, int flush)
+{
+	int result;
+	unsigned int have;
+	unsigned int total = 0;
+	
+	stream->avail_in = size;
+	stream->next_in = buffer;
+	
+	do
+	{
+		stream->avail_out = ZCHUNK;
+		stream->next_out = zbuffer;
+		
+		result = deflate(stream, flush);
+		
+		if (result == Z_STREAM_ERROR)
+		{
+			fprintf(stderr, "Error compressing stream\n");
+			exit(1);
+		}
+		
+		have = ZCHUNK - stream->avail_out;
+		capture->compressedsize += have;
+		total += have;
+		if (capture->outputFile && have) 
+		{
+			if (HW_WriterWrite(capture->outputFile, zbuffer, have) != 0)
+			{
+				deflateEnd(stream);
+				fprintf(stderr, "Write error\n");
+				exit(1);
+			}			
+		}
+	} while(stream->avail_out == 0);
+	
+	return total;
+}
+
+/*
+ * HW_CaptureWrite --
+ *
+ *    Compresses a block of captured data to the output. When the current
+ *    segment is due, it's finished at the next sample boundary so that every
+ *    segment can be decoded on its own. Returns the compressed size.
+ */
+
+static unsigned int HW_CaptureWrite(HWCapture* capture, z_stream* stream, unsigned char* zbuffer, unsigned char* buffer, unsigned int size)
+{
+	unsigned int compressed = 0;
+	unsigned int chunk;
+	
+	while(size)
+	{
+		chunk = size;
+		if (capture->segments && chunk > HWCAPTURE_WRITECHUNK)
+			chunk = HWCAPTURE_WRITECHUNK;
+		
+		// Finish the segment once the current sample is complete
+		if (capture->rotate)
+		{
+			chunk = (SAMPLESIZE - capture->writephase) % SAMPLESIZE;
+			if (chunk == 0)
+			{
+				compressed += HW_CaptureRotate(capture, stream, zbuffer);
+				continue;
+			}
+			if (chunk > size)
+				chunk = size;
+		}
+		
+		compressed += HW_CaptureCompress(capture, stream, zbuffer, buffer, chunk, Z_NO_FLUSH);
+		capture->writephase = (capture->writephase + chunk) % SAMPLESIZE;
+		buffer += chunk;
+		size -= chunk;
+		
+		if (capture->segments && HW_SegmentsDue(capture->segments, stream->total_out))
+			capture->rotate = 1;
+	}
+	
+	return compressed;
+}
+
+/*
+ * HW_CaptureRotate --
+ *
+ *    Finishes the current segment and continues in a new one.
+ */
+
+static unsigned int HW_CaptureRotate(HWCapture* capture, z_stream* stream, unsigned char* zbuffer)
+{
+	unsigned int compressed = HW_CaptureCompress(capture, stream, zbuffer, NULL, 0, Z_FINISH);
+	
+	if (HW_WriterClose(capture->outputFile) != 0)
+	{
+		fprintf(stderr, "Write error\n");
+		exit(1);
+	}
+	capture->outputFile = HW_SegmentsOpen(capture->segments);
+	deflateReset(stream);
+	capture->rotate = 0;
+	
+	// Each segment describes the filter it was recorded with
+	if (capture->filteractive)
+	{
+		unsigned char header[HWFILTER_HEADERSIZE];
+		unsigned int size = HW_FilterHeader(&capture->filter, header);
+		
+		compressed += HW_CaptureCompress(capture, stream, zbuffer, header, size, Z_NO_FLUSH);
+	}
+	
+	return compressed;
+}
+
+/*
+ * HW_CaptureFilterWrite --
+ *
+ *    Filters a block of captured data and compresses what remains. A new
+ *    filter takes effect at the next sample boundary.
+ */
+
+static unsigned int HW_CaptureFilterWrite(HWCapture* capture, z_stream* stream, unsigned char* zbuffer, unsigned char* buffer, unsigned int size)
+{
+	unsigned int compressed = 0;
+	unsigned int head;
+	
+	if (capture->filterswitch)
+	{
+		head = (SAMPLESIZE - capture->filterphase) % SAMPLESIZE;
+		if (head > size)
+			head = size;
+		
+		compressed += HW_CaptureFilterBytes(capture, stream, zbuffer, buffer, head);
+		buffer += head;
+		size -= head;
+		
+		if (capture->filterphase == 0)
+			compressed += HW_CaptureFilterSwitch(capture, stream, zbuffer);
+	}
+	
+	compressed += HW_CaptureFilterBytes(capture, stream, zbuffer, buffer, size);
+	
+	return compressed;
+}
+
+static unsigned int HW_CaptureFilterBytes(HWCapture* capture, z_stream* stream, unsigned char* zbuffer, unsigned char* buffer, unsigned int size)
+{
+	unsigned int compressed = 0;
+	unsigned int count;
+	unsigned int whole;
+	
+	if (!capture->filteractive)
+	{
+		capture->filtersample += (capture->filterphase + size) / SAMPLESIZE;
+		capture->filterphase = (capture->filterphase + size) % SAMPLESIZE;
+		
+		return HW_CaptureWrite(capture, stream, zbuffer, buffer, size);
+	}
+	
+	// Complete the sample carried over from the previous block
+	if (capture->filterphase)
+	{
+		count = SAMPLESIZE - capture->filterphase;
+		if (count > size)
+			count = size;
+		
+		memcpy(capture->filterrest + capture->filterphase, buffer, count);
+		capture->filterphase += count;
+		buffer += count;
+		size -= count;
+		
+		if (capture->filterphase < SAMPLESIZE)
+			return 0;
+		
+		if (HW_FilterSample(&capture->filter, capture->filterrest, capture->filtersample))
+			compressed += HW_CaptureWrite(capture, stream, zbuffer, capture->filterrest, SAMPLESIZE);
+		capture->filtersample++;
+		capture->filterphase = 0;
+	}
+	
+	// The node is done with once compressed, so it's filtered in place
+	whole = size - (size % SAMPLESIZE);
+	count = HW_FilterBlock(&capture->filter, buffer, whole, &capture->filtersample);
+	compressed += HW_CaptureWrite(capture, stream, zbuffer, buffer, count);
+	
+	capture->filterphase = size - whole;
+	memcpy(capture->filterrest, buffer + whole, capture->filterphase);
+	
+	return compressed;
+}
+
+/*
+ * HW_CaptureFilterSwitch --
+ *
+ *    Switches to the filter set with HW_CaptureSetFilter, at a sample boundary,
+ *    and records it in the trace.
+ */
+
+static unsigned int HW_CaptureFilterSwitch(HWCapture* capture, z_stream* stream, unsigned char* zbuffer)
+{
+	unsigned char header[HWFILTER_HEADERSIZE];
+	unsigned int wasactive = capture->filteractive;
+	
+	pthread_mutex_lock(&capture->mutex);
+	capture->filter = capture->newfilter;
+	capture->newfilterset = 0;
+	pthread_mutex_unlock(&capture->mutex);
+	
+	capture->filterswitch = 0;
+	capture->filteractive = HW_FilterIsActive(&capture->filter);
+	
+	// An unfiltered trace stays free of filter records
+	if (!capture->filteractive && !wasactive)
+		return 0;
+	
+	return HW_CaptureWrite(capture, stream, zbuffer, header, HW_FilterHeader(&capture->filter, header));
+}
+
+static void* HW_CaptureCompressThread(void* arg)
 {
 	HWCapture* capture = (HWCapture*)arg;
 	z_stream stream;
 	unsigned char* zbuffer = 0;
 	int result;
 	unsigned int nodecount = 0;
-	unsigned int have = 0;
+	uint64_t queued;
+	uint64_t released;
+	uint64_t warnedbytes = 0;
+	unsigned int compressed;
 	int savecapture = 1;
 	
 
@@ -170,90 +946,65 @@ static void* HW_CaptureThread(void* arg)
 
 	while(capture->running)
 	{
-		
 		HWBuffer* node = 0;
-		unsigned int available;
 		unsigned int capacity;
 		unsigned char* buffer;
-      unsigned int buffersize;
-      unsigned int bufferpos;
+		int ready;
+		unsigned int compressed = 0;
+		double starttime;
    
 		pthread_mutex_lock(&capture->mutex);
 		
 		node = HW_BufferChainGetFirst(&capture->chain);
 		
-		if (node)
+		while(capture->running && !HW_CaptureCanCompress(capture, node))
+		{
+			pthread_cond_wait(&capture->compresscond, &capture->mutex);
+			node = HW_BufferChainGetFirst(&capture->chain);
+		}
+		
+		ready = HW_CaptureCanCompress(capture, node);
+		if (ready)
 		{
-			available = node->capacity - node->size;
-         buffersize = node->size;
-         bufferpos = node->pos;
 			buffer = node->buffer;
 			capacity = node->capacity;
-         
-         node->pos = node->size;
 		}
 		
+		if (capture->newfilterset)
+			capture->filterswitch = 1;
+		
 		pthread_mutex_unlock(&capture->mutex);
       
-      
-      if (node && (buffersize - bufferpos > 0))
-         HW_Process(&capture->process, buffer + bufferpos, buffersize - bufferpos);
-		
-		if (node == 0 || available != 0)
-		{
-			mssleep(1);
+		if (!ready)
 			continue;
-		}
       
+		starttime = HW_CaptureTime();
 	    if (savecapture)
-		{
-			stream.avail_in = capacity;
-			stream.next_in = buffer;
-			
-			do
-			{
-				stream.avail_out = ZCHUNK;
-				stream.next_out = zbuffer;
-				
-				result = deflate(&stream, Z_NO_FLUSH);
-				
-				if (result == Z_STREAM_ERROR)
-				{
-					fprintf(stderr, "Error compressing stream\n");
-					exit(1);
-				}
-				
-				have = ZCHUNK - stream.avail_out;
-				capture->compressedsize += have;
-				if (capture->outputFile) 
-				{
-					if (fwrite(zbuffer, have, 1, capture->outputFile) != 1) 
-					{
-						deflateEnd(&stream);
-						fprintf(stderr, "Write error\n");
-						exit(1);
-					}			
-				}
-			} while(stream.avail_out == 0);
-		}
+			compressed = HW_CaptureFilterWrite(capture, &stream, zbuffer, buffer, capacity);
 
+		HW_CaptureReleaseFirst(capture, capacity, compressed, HW_CaptureTime() - starttime);
 		
-		nodecount = 0;
+		// Warn about the backlog once per hwbuffer worth of data written out,
+		// regardless of whether the nodes are hwbuffers or USB transfers.
 		pthread_mutex_lock(&capture->mutex);
-		HW_BufferChainDestroyFirst(&capture->chain);
-		node = HW_BufferChainGetFirst(&capture->chain);
-		while(1)
-		{			
-			if (node == 0)
-				break;
-			node = node->next;
-			nodecount++;
-		}
+		queued = capture->stats.queuedbytes;
+		released = capture->stats.compressinbytes;
 		pthread_mutex_unlock(&capture->mutex);
-		if (nodecount > 1)
-			fprintf(stdout, "WARNING: %d hwbuffers still remaining\n", nodecount);
+		if (released - warnedbytes >= HWBUF_SIZE)
+		{
+			warnedbytes = released;
+			nodecount = (queued + HWBUF_SIZE - 1) / HWBUF_SIZE;
+			if (nodecount > 1)
+				fprintf(stdout, "WARNING: %d hwbuffers still remaining\n", nodecount);
+		}
 	}
 	
+	// Don't release any nodes until the process thread is done reading them.
+	pthread_mutex_lock(&capture->mutex);
+	while(capture->processrunning)
+		pthread_cond_wait(&capture->compresscond, &capture->mutex);
+	pthread_mutex_unlock(&capture->mutex);
+	
 	if (savecapture)
 	{
 		// Write last remaining data in the buffers
@@ -263,6 +1014,7 @@ static void* HW_CaptureThread(void* arg)
 			unsigned int available;
 			unsigned int capacity;
 			unsigned char* buffer;
+			double starttime;
 					
 			pthread_mutex_lock(&capture->mutex);
 			
@@ -283,71 +1035,16 @@ static void* HW_CaptureThread(void* arg)
 			if (available == capacity)
 				break;
 			
-			
-			stream.avail_in = capacity - available;
-			stream.next_in = buffer;
-			
-			do
-			{
-				stream.avail_out = ZCHUNK;
-				stream.next_out = zbuffer;
-				
-				result = deflate(&stream, Z_NO_FLUSH);
-				
-				if (result == Z_STREAM_ERROR)
-				{
-					fprintf(stderr, "Error compressing stream\n");
-					exit(1);
-				}
-				
-				have = ZCHUNK - stream.avail_out;
-				capture->compressedsize += have;
-				if (capture->outputFile) 
-				{
-					if (fwrite(zbuffer, have, 1, capture->outputFile) != 1)
-					{
-						deflateEnd(&stream);
-						fprintf(stderr, "Write error\n");
-						exit(1);
-					}
-				}
-				
-			} while(stream.avail_out == 0);
-					
-			pthread_mutex_lock(&capture->mutex);
-			HW_BufferChainDestroyFirst(&capture->chain);
-			pthread_mutex_unlock(&capture->mutex);		
+			starttime = HW_CaptureTime();
+			compressed = HW_CaptureFilterWrite(capture, &stream, zbuffer, buffer, capacity - available);
+			HW_CaptureReleaseFirst(capture, capacity - available, compressed, HW_CaptureTime() - starttime);
 		}
 		
-		stream.avail_in = 0;
-		stream.next_in = NULL;
-		
-		do
-		{
-			stream.avail_out = ZCHUNK;
-			stream.next_out = zbuffer;
-			
-			result = deflate(&stream, Z_FINISH);
-			
-			if (result == Z_STREAM_ERROR)
-			{
-				fprintf(stderr, "Error compressing stream\n");
-				exit(1);
-			}
-			
-			have = ZCHUNK - stream.avail_out;
-			capture->compressedsize += have;
-			if (capture->outputFile)
-			{
-				if (fwrite(zbuffer, have, 1, capture->outputFile) != 1)
-				{
-					deflateEnd(&stream);
-					fprintf(stderr, "Write error\n");
-					exit(1);
-				}		
-			}
-		} while(stream.avail_out == 0);
+		compressed = HW_CaptureCompress(capture, &stream, zbuffer, NULL, 0, Z_FINISH);
 		
+		pthread_mutex_lock(&capture->mutex);
+		capture->stats.compressoutbytes += compressed;
+		pthread_mutex_unlock(&capture->mutex);
 		
 		deflateEnd(&stream);
 		free(zbuffer);
@@ -358,4 +1055,3 @@ static void* HW_CaptureThread(void* arg)
 
 	return 0;
 }
-
@@ -30,32 +30,76 @@
 #include "hw_buffer.h"
 #include "fastftdi.h"
 #include "hw_process.h"
+#include "hw_stats.h"
+#include "hw_segment.h"
+#include "hw_writer.h"
+#include "hw_filter.h"
+
+// Header byte of the marker sample recorded where data was lost. Regular samples
+// have header 0 (write) or 1 (read). The marker is followed by a le32 gap number
+// at offset 4, and the incomplete sample before it is padded with 0xFF bytes.
+#define HWCAPTURE_GAPHEADER 0xFE
+
+// Number of bytes collected after a gap to find the sample alignment again.
+#define HWCAPTURE_RESYNCSIZE (SAMPLESIZE * 64)
+
+// Amount of data compressed between checks whether the segment is complete.
+#define HWCAPTURE_WRITECHUNK (1024 * 1024)
 
 /*
- * HWCapture -- Worker structure for a seperately running thread that does heavy processing
- *              on real-time captured RAM tracing data, such as compression and saving to disk. 
+ * HWCapture -- Worker structure for the seperately running threads that do processing
+ *              on real-time captured RAM tracing data. One thread services the target's
+ *              FIFO channel, the other does the heavy work of compression and saving to disk.
  */
 
 
 typedef struct
 {
-	FILE* outputFile;
+	HWWriter* outputFile;
 	unsigned int running;
    unsigned int done;
 	unsigned int compressedsize;
-	pthread_t thread;
+	unsigned int pending;
+	unsigned int processenabled;
+	unsigned int processrunning;
+	pthread_t processthread;
+	pthread_t compressthread;
 	pthread_mutex_t mutex;
+	pthread_cond_t processcond;
+	pthread_cond_t compresscond;
 	HWBufferChain chain;
+	HWBufferChain sparechain;
+	unsigned int transfersize;
+	unsigned int samplephase;
+	unsigned int writephase;
+	unsigned int rotate;
+	HWSegments* segments;
+	unsigned int resync;
+	unsigned int resyncsize;
+	unsigned char resyncbuffer[HWCAPTURE_RESYNCSIZE];
+	HWFilter filter;              // Filter used by the compress thread
+	HWFilter newfilter;           // Filter to switch to, protected by the mutex
+	unsigned int newfilterset;
+	unsigned int filterswitch;
+	unsigned int filteractive;
+	unsigned int filterphase;
+	uint64_t filtersample;
+	unsigned char filterrest[SAMPLESIZE];
    FTDIDevice* dev;
    HWProcess process;
+   HWStats stats;
 } HWCapture;
 
 /*
  * Public functions
  */
-void HW_CaptureBegin(HWCapture* capture, FILE* outputFile, FTDIDevice* dev, int processenabled);
+void HW_CaptureBegin(HWCapture* capture, HWWriter* outputFile, HWSegments* segments, FTDIDevice* dev, int processenabled, unsigned int transfersize);
 unsigned int HW_CaptureTryStop(HWCapture* capture);
 void HW_CaptureFinish(HWCapture* capture);
 void HW_CaptureDataBlock(HWCapture* capture, uint8_t* buffer, unsigned int length);
+void HW_CaptureGetStats(HWCapture* capture, HWStats* stats);
+uint8_t* HW_CaptureSwapBuffer(HWCapture* capture, uint8_t* buffer, int length);
+void HW_CaptureGap(HWCapture* capture);
+void HW_CaptureSetFilter(HWCapture* capture, const HWFilter* filter);
 
 #endif // __HW_CAPTURE_H_
@@ -55,7 +55,7 @@ void HW_CommandInit(HWCommand* command, int enabled)
 	command->curcmdsize = 0;
 	command->running = 0;
 	
-	HW_BufferInit(&command->buffer, 16);
+	HW_RingBufferInit(&command->buffer, 16);
 	HW_MemoryPoolInit(&command->mempool, 1024 * 1024);
 	pthread_mutex_init(&command->mutex, 0);
 	
@@ -108,7 +108,7 @@ void HW_CommandDestroy(HWCommand* command)
 		HW_CommandStop(command);
 		
 	pthread_mutex_destroy(&command->mutex);
-	HW_BufferDestroy(&command->buffer);
+	HW_RingBufferDestroy(&command->buffer);
 	HW_MemoryPoolDestroy(&command->mempool);
 #endif
 }
@@ -129,11 +129,11 @@ static int HW_CommandTryLock(HWCommand* command)
 }
 
 /**
-	Reads a command from the HWCommand context, and appends it to the HWBuffer.
+	Reads a command from the HWCommand context, and appends it to the HWRingBuffer.
 	
 	Returns 1 if a command was read, 0 otherwise.
  */
-unsigned int HW_CommandRead(HWCommand* command, HWBuffer* buffer)
+unsigned int HW_CommandRead(HWCommand* command, HWRingBuffer* buffer)
 {
 	unsigned int result = 0;
 	unsigned char dummybuffer[4] = {0, 0, 0, 0};
@@ -145,21 +145,21 @@ unsigned int HW_CommandRead(HWCommand* command, HWBuffer* buffer)
 		// move first command from internal context to buffer
 		if (command->buffer.size >= 8)
 		{
-			unsigned char* cmdbuf = command->buffer.buffer;
+			unsigned char* cmdbuf = HW_RingBufferPeek(&command->buffer, 8);
 			unsigned int cmdid = (cmdbuf[0]<<0) | (cmdbuf[1]<<8) | (cmdbuf[2]<<16) | (cmdbuf[3]<<24);
 			unsigned int cmdsize = (cmdbuf[4]<<0) | (cmdbuf[5]<<8) | (cmdbuf[6]<<16) | (cmdbuf[7]<<24);
 			unsigned int totalsize = 8+cmdsize;
 			
 			if (command->buffer.size >= totalsize)
 			{
-				HW_BufferAppend(buffer, cmdbuf, totalsize);
+				HW_RingBufferAppend(buffer, HW_RingBufferPeek(&command->buffer, totalsize), totalsize);
 				
 				alignedsize = (cmdsize+3) & (~3);
 				restsize = alignedsize - cmdsize;
 				if (restsize)
-					HW_BufferAppend(buffer, dummybuffer, restsize);
+					HW_RingBufferAppend(buffer, dummybuffer, restsize);
 					
-				HW_BufferRemoveFront(&command->buffer, totalsize);
+				HW_RingBufferRemoveFront(&command->buffer, totalsize);
 				result = 1;
 			}
 		}
@@ -186,13 +186,13 @@ static void HW_CommandAddBegin(HWCommand* command, unsigned int cmdid)
 	buffer[1] = cmdid>>8;
 	buffer[2] = cmdid>>16;
 	buffer[3] = cmdid>>24;
-	HW_BufferAppend(&command->buffer, buffer, 4);
+	HW_RingBufferAppend(&command->buffer, buffer, 4);
 	
 	buffer[0] = 0;
 	buffer[1] = 0;
 	buffer[2] = 0;
 	buffer[3] = 0;
-	HW_BufferAppend(&command->buffer, buffer, 4);
+	HW_RingBufferAppend(&command->buffer, buffer, 4);
 	
 	command->curcmdactive = 1;
 }
@@ -204,7 +204,7 @@ static void HW_CommandAddBuffer(HWCommand* command, unsigned char* buffer, unsig
 
 	command->curcmdsize += size;
 	
-	HW_BufferAppend(&command->buffer, buffer, size);	
+	HW_RingBufferAppend(&command->buffer, buffer, size);	
 }
 
 static void HW_CommandAddLong(HWCommand* command, unsigned int data)
@@ -272,7 +272,7 @@ static void HW_CommandAddEnd(HWCommand* command)
 	buffer[2] = command->curcmdsize >> 16;
 	buffer[3] = command->curcmdsize >> 24;
 	
-	memcpy(command->buffer.buffer + command->curcmdpos + 4, buffer, 4);
+	HW_RingBufferWriteAt(&command->buffer, command->curcmdpos + 4, buffer, 4);
 	
 	HW_CommandUnlock(command);
 	
@@ -92,7 +92,7 @@ typedef struct
 {
    pthread_mutex_t mutex;
    pthread_t thread;
-   HWBuffer buffer;
+   HWRingBuffer buffer;
    unsigned int curcmdpos;
    unsigned int curcmdsize;
    unsigned int curcmdactive;
@@ -110,7 +110,7 @@ typedef struct
  */
 void HW_CommandInit(HWCommand* command, int enabled);
 void HW_CommandDestroy(HWCommand* command);
-unsigned int HW_CommandRead(HWCommand* command, HWBuffer* buffer);
+unsigned int HW_CommandRead(HWCommand* command, HWRingBuffer* buffer);
 void HW_CommandWriteByte(HWCommand* command, unsigned int address, unsigned int data);
 void HW_CommandWriteShort(HWCommand* command, unsigned int address, unsigned int data);
 void HW_CommandWriteLong(HWCommand* command, unsigned int address, unsigned int data);
@@ -0,0 +1,216 @@
+/*
+ * hw_filter.c - Host-side filtering of captured samples.
+ *
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include "hw_filter.h"
+#include "hw_process.h"
+
+
+// Private functions
+static unsigned char* HW_FilterRecord(unsigned char* buffer, unsigned int type, uint64_t value0, uint32_t value1);
+
+
+void HW_FilterInit(HWFilter* filter)
+{
+	memset(filter, 0, sizeof(HWFilter));
+	
+	filter->types = HWFILTER_ALL;
+}
+
+/*
+ * HW_FilterAddRange --
+ *
+ *    Passes samples touching the byte addresses from 'start' up to 'end'.
+ *    Returns -1 if the range is empty or there are too many ranges.
+ */
+
+int HW_FilterAddRange(HWFilter* filter, uint32_t start, uint32_t end)
+{
+	if (end <= start || filter->rangecount >= HWFILTER_MAXRANGES)
+		return -1;
+	
+	filter->ranges[filter->rangecount].start = start;
+	filter->ranges[filter->rangecount].end = end;
+	filter->rangecount++;
+	
+	return 0;
+}
+
+void HW_FilterSetTypes(HWFilter* filter, unsigned int types)
+{
+	filter->types = types & HWFILTER_ALL;
+}
+
+/*
+ * HW_FilterSetWindow --
+ *
+ *    Passes samples from index 'firstsample' up to 'lastsample', counted from
+ *    the start of the capture. A 'lastsample' of 0 has no end.
+ */
+
+void HW_FilterSetWindow(HWFilter* filter, uint64_t firstsample, uint64_t lastsample)
+{
+	filter->firstsample = firstsample;
+	filter->lastsample = lastsample;
+}
+
+int HW_FilterIsActive(const HWFilter* filter)
+{
+	return filter->types != HWFILTER_ALL || filter->rangecount || filter->firstsample || filter->lastsample;
+}
+
+/*
+ * HW_FilterSample --
+ *
+ *    Returns nonzero if the sample at 'index' in the capture passes the filter.
+ */
+
+int HW_FilterSample(const HWFilter* filter, const unsigned char* sample, uint64_t index)
+{
+	unsigned int header = sample[0];
+	uint32_t address;
+	unsigned int i;
+	
+	// Gap and filter markers are kept
+	if (header >= 2)
+		return 1;
+	
+	if (index < filter->firstsample)
+		return 0;
+	if (filter->lastsample && index >= filter->lastsample)
+		return 0;
+	
+	if (!(filter->types & (header ? HWFILTER_READS : HWFILTER_WRITES)))
+		return 0;
+	
+	if (filter->rangecount == 0)
+		return 1;
+	
+	// Samples carry the address of an 8 byte word
+	address = (sample[1] | (sample[2]<<8) | (sample[3]<<16)) * 8;
+	
+	for(i=0; i<filter->rangecount; i++)
+	{
+		if (address < filter->ranges[i].end && address + 8 > filter->ranges[i].start)
+			return 1;
+	}
+	
+	return 0;
+}
+
+/*
+ * HW_FilterBlock --
+ *
+ *    Removes the samples that don't pass from 'buffer', which holds 'size'
+ *    bytes of whole samples. '*index' is the capture index of the first
+ *    sample, and is advanced past the block. Returns the size that remains.
+ */
+
+unsigned int HW_FilterBlock(const HWFilter* filter, unsigned char* buffer, unsigned int size, uint64_t* index)
+{
+	unsigned int in;
+	unsigned int out = 0;
+	uint64_t sampleindex = *index;
+	
+	for(in=0; in+SAMPLESIZE<=size; in+=SAMPLESIZE)
+	{
+		if (HW_FilterSample(filter, buffer + in, sampleindex++))
+		{
+			if (out != in)
+				memcpy(buffer + out, buffer + in, SAMPLESIZE);
+			out += SAMPLESIZE;
+		}
+	}
+	
+	*index = sampleindex;
+	
+	return out;
+}
+
+static unsigned char* HW_FilterRecord(unsigned char* buffer, unsigned int type, uint64_t value0, uint32_t value1)
+{
+	unsigned int i;
+	
+	memset(buffer, 0, SAMPLESIZE);
+	buffer[0] = HWFILTER_HEADER;
+	buffer[1] = type;
+	
+	for(i=0; i<8; i++)
+		buffer[4+i] = value0 >> (i*8);
+	for(i=0; i<4; i++)
+		buffer[8+i] |= value1 >> (i*8);
+	
+	return buffer + SAMPLESIZE;
+}
+
+/*
+ * HW_FilterHeader --
+ *
+ *    Describes the filter as marker samples, which are recorded in the trace so
+ *    decoders know which samples were left out. 'buffer' must hold
+ *    HWFILTER_HEADERSIZE bytes. Returns the size of the description.
+ */
+
+unsigned int HW_FilterHeader(const HWFilter* filter, unsigned char* buffer)
+{
+	unsigned char* p = buffer;
+	unsigned int i;
+	
+	p = HW_FilterRecord(p, HWFILTER_RECORD_TYPES, filter->types, 0);
+	
+	for(i=0; i<filter->rangecount; i++)
+		p = HW_FilterRecord(p, HWFILTER_RECORD_RANGE, filter->ranges[i].start, filter->ranges[i].end);
+	
+	if (filter->firstsample)
+		p = HW_FilterRecord(p, HWFILTER_RECORD_FIRST, filter->firstsample, 0);
+	if (filter->lastsample)
+		p = HW_FilterRecord(p, HWFILTER_RECORD_LAST, filter->lastsample, 0);
+	
+	return p - buffer;
+}
+
+void HW_FilterPrint(const HWFilter* filter)
+{
+	unsigned int i;
+	
+	if (!HW_FilterIsActive(filter))
+	{
+		printf("Filter: all samples\n");
+		return;
+	}
+	
+	printf("Filter: %s%s%s\n", (filter->types & HWFILTER_READS) ? "reads" : "",
+	       filter->types == HWFILTER_ALL ? " and " : "",
+	       (filter->types & HWFILTER_WRITES) ? "writes" : "");
+	
+	for(i=0; i<filter->rangecount; i++)
+		printf("Filter: address %08X-%08X\n", filter->ranges[i].start, filter->ranges[i].end);
+	
+	if (filter->firstsample || filter->lastsample)
+		printf("Filter: samples %llu-%llu\n", (unsigned long long)filter->firstsample, (unsigned long long)filter->lastsample);
+}
@@ -0,0 +1,90 @@
+/*
+ * hw_filter.h - Host-side filtering of captured samples.
+ *
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __HW_FILTER_H_
+#define __HW_FILTER_H_
+
+#include <stdint.h>
+
+#define HWFILTER_MAXRANGES 16
+
+// Sample types passed by the filter
+#define HWFILTER_WRITES (1<<0)
+#define HWFILTER_READS (1<<1)
+#define HWFILTER_ALL (HWFILTER_WRITES | HWFILTER_READS)
+
+// Header byte of the samples that describe the filter in the trace. A description
+// starts with a TYPES record and is recorded at the start of the trace, and again
+// whenever the filter changes. The record type is at offset 1.
+#define HWFILTER_HEADER 0xFD
+#define HWFILTER_RECORD_TYPES 0    // Passed sample types at offset 4
+#define HWFILTER_RECORD_RANGE 1    // le32 start and end address at offset 4 and 8
+#define HWFILTER_RECORD_FIRST 2    // le64 first sample index at offset 4
+#define HWFILTER_RECORD_LAST 3     // le64 sample index after the window at offset 4
+
+// Maximum size of a filter description.
+#define HWFILTER_HEADERSIZE ((HWFILTER_MAXRANGES + 3) * 13)
+
+/*
+ * HWFilterRange -- Range of byte addresses in the traced memory, 'end' excluded.
+ */
+
+typedef struct
+{
+	uint32_t start;
+	uint32_t end;
+} HWFilterRange;
+
+/*
+ * HWFilter -- Selects the samples that are saved. A sample passes when its type is
+ *             selected, it touches one of the address ranges (if any are given), and
+ *             its index in the capture is inside the sample window. Marker samples
+ *             always pass.
+ */
+
+typedef struct
+{
+	unsigned int types;
+	unsigned int rangecount;
+	HWFilterRange ranges[HWFILTER_MAXRANGES];
+	uint64_t firstsample;
+	uint64_t lastsample;       // 0 for no end
+} HWFilter;
+
+/*
+ * Public functions
+ */
+void HW_FilterInit(HWFilter* filter);
+int HW_FilterAddRange(HWFilter* filter, uint32_t start, uint32_t end);
+void HW_FilterSetTypes(HWFilter* filter, unsigned int types);
+void HW_FilterSetWindow(HWFilter* filter, uint64_t firstsample, uint64_t lastsample);
+int HW_FilterIsActive(const HWFilter* filter);
+int HW_FilterSample(const HWFilter* filter, const unsigned char* sample, uint64_t index);
+unsigned int HW_FilterBlock(const HWFilter* filter, unsigned char* buffer, unsigned int size, uint64_t* index);
+unsigned int HW_FilterHeader(const HWFilter* filter, unsigned char* buffer);
+void HW_FilterPrint(const HWFilter* filter);
+
+#endif // __HW_FILTER_H_
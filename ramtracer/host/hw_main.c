@@ -31,6 +31,8 @@
 
 #include "hw_main.h"
 #include "hw_capture.h"
+#include "hw_segment.h"
+#include "hw_filter.h"
 #include "hw_patch.h"
 #include "hw_config.h"
 #include "fpgaconfig.h"
@@ -50,6 +52,10 @@
 
 
 
+// Seconds between lines written to the stats file
+#define STATS_INTERVAL 1.0
+
+
 #define PATCHTAG_WRITETRIGGER		0xB00B0000
 #define PATCHTAG_BYPASSTRIGGER	0xB00B0001
 #define PATCHTAG_ADDPATCH			0xB00B0002
@@ -60,18 +66,44 @@
  * Private functions
  */
 static int HW_ReadCallback(FTDIDevice* dev, FTDICallbackType cbtype, uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata);
+static uint8_t* HW_BufferCallback(FTDIDevice* dev, uint8_t *buffer, int length, void *userdata);
 static void HW_SigintHandler(int signum);
+static void HW_UpdateFilter();
+static void HW_ShowProgress();
+static void HW_InstanceFileName(char* name, size_t namesize, const char* filename, const HWInstance* hw, unsigned int count);
+
+
+static const char* statsFileName;
+static int packetsPerTransfer = PACKETS_PER_TRANSFER;
+static int numTransfers = NUM_TRANSFERS;
+static bool autoTune = false;
+static bool zeroCopy = false;
+static bool directIO = false;
+static uint64_t segmentSize;
+static unsigned int segmentTime;
+static unsigned int segmentCount;
+static unsigned int segmentKeep;
+static HWFilter filter;
+static HWInstance* instances[HW_MAXINSTANCES];
+static unsigned int instanceCount;
 
+void HW_Init()
+{
+	HW_FilterInit(&filter);
+}
 
-static FILE* outputFile;
-static bool exitRequested;
-static bool processEnabled = 0;
-static HWCapture capture;
-static HWPatchContext patchctx;
+/*
+ * HW_InstanceInit --
+ *
+ *    Prepares the state of rig number 'index'. The device is opened
+ *    separately into hw->dev.
+ */
 
-void HW_Init()
+void HW_InstanceInit(HWInstance* hw, unsigned int index)
 {
-	HW_PatchInit(&patchctx);
+	memset(hw, 0, sizeof(HWInstance));
+	hw->index = index;
+	HW_PatchInit(&hw->patchctx);
 }
 
 /*
@@ -81,8 +113,9 @@ void HW_Init()
  *    'bitstream' is optional. If non-NULL, the FPGA is reconfigured.
  */
 
-void HW_Setup(FTDIDevice *dev, const char *bitstream)
+void HW_Setup(HWInstance* hw, const char *bitstream)
 {
+	FTDIDevice* dev = &hw->dev;
 	int err;
 
 	if (bitstream) {
@@ -98,13 +131,13 @@ void HW_Setup(FTDIDevice *dev, const char *bitstream)
 		exit(1);
 	}
 	
-	if (dev->patchcapability && patchctx.mode == 1)
+	if (dev->patchcapability && hw->patchctx.mode == 1)
 	{
-		HW_PatchDevice(&patchctx, dev);
+		HW_PatchDevice(&hw->patchctx, dev);
 	}
 }
 
-void HW_LoadFlatPatchFile(unsigned int address, const char* filename)
+void HW_LoadFlatPatchFile(HWInstance* hw, unsigned int address, const char* filename)
 {
 	FILE *f = fopen(filename, "rb");
 	unsigned int buffersize;
@@ -135,14 +168,14 @@ void HW_LoadFlatPatchFile(unsigned int address, const char* filename)
 	}
 	
 	printf("PATCH: Adding patch @ 0x%08X with size %d bytes.\n", address, buffersize);
-	HW_AddPatch(&patchctx, address, buffer, buffersize);
+	HW_AddPatch(&hw->patchctx, address, buffer, buffersize);
 	
 	free(buffer);
 	fclose(f);
 }
 	
 
-void HW_LoadPatchFile(const char* filename)
+void HW_LoadPatchFile(HWInstance* hw, const char* filename)
 {
 	FILE *f = fopen(filename, "rb");
 	Elf32_Ehdr ehdr;
@@ -226,8 +259,15 @@ void HW_LoadPatchFile(const char* filename)
 					switch(tag) 
 					{
                   case PATCHTAG_PROCESSENABLE:
-                     processEnabled = 1;
-                     HW_SetPatchFifoHook(&patchctx, 1);
+                     // Real-time processing reads commands from stdin and
+                     // serves the one server port, which only one rig can
+                     // own, so it runs on the first rig only.
+                     if (hw->index != 0) {
+                        printf("PATCH: Real-time processing is only available on device 0, skipped.\n");
+                        break;
+                     }
+                     hw->processenabled = 1;
+                     HW_SetPatchFifoHook(&hw->patchctx, 1);
                      printf("PATCH: Enabling real-time processing.\n");
                      break;                     
 						case PATCHTAG_WRITETRIGGER: 
@@ -235,19 +275,19 @@ void HW_LoadPatchFile(const char* filename)
 							triggercount = buffer_readle32(buffer, &bufferpos, buffersize);
 							triggerdata = buffer_readdata(buffer, &bufferpos, buffersize, 8);
 							printf("PATCH: Setting write trigger @ 0x%08X with count %d.\n", triggeraddress, triggercount);
-							HW_SetPatchWriteTrigger(&patchctx, triggeraddress, triggercount, triggerdata);
+							HW_SetPatchWriteTrigger(&hw->patchctx, triggeraddress, triggercount, triggerdata);
 							break;
 						case PATCHTAG_BYPASSTRIGGER:
 							triggeraddress = buffer_readle32(buffer, &bufferpos, buffersize) & 0x0FFFFFFF;
 							printf("PATCH: Setting trigger bypass @ 0x%08X.\n", triggeraddress);
-							HW_SetPatchTriggerBypass(&patchctx, triggeraddress);
+							HW_SetPatchTriggerBypass(&hw->patchctx, triggeraddress);
 							break;
 						case PATCHTAG_ADDPATCH:
 							patchaddress = buffer_readle32(buffer, &bufferpos, buffersize) & 0x0FFFFFFF;
 							patchsize = buffer_readle32(buffer, &bufferpos, buffersize);
 							patchdata = buffer_readdata(buffer, &bufferpos, buffersize, patchsize);
 							printf("PATCH: Adding patch @ 0x%08X with size %d bytes.\n", patchaddress, patchsize);
-							HW_AddPatch(&patchctx, patchaddress, patchdata, patchsize);
+							HW_AddPatch(&hw->patchctx, patchaddress, patchdata, patchsize);
 							break;							
 						default:
 							perror("Got unknown patch tag");
@@ -283,7 +323,7 @@ void HW_LoadPatchFile(const char* filename)
 						}
 						
 						printf("PATCH: Adding patch @ 0x%08X with size %d bytes.\n", addr, buffersize);
-						HW_AddPatch(&patchctx, addr, buffer, buffersize);
+						HW_AddPatch(&hw->patchctx, addr, buffer, buffersize);
 					}
 					break;
 					
@@ -300,7 +340,157 @@ void HW_LoadPatchFile(const char* filename)
 	
 	fclose(f);
 	
-	HW_SetPatchingMode(&patchctx, 1);
+	HW_SetPatchingMode(&hw->patchctx, 1);
+}
+
+
+/*
+ * HW_SetTransferParams --
+ *
+ *    Overrides the USB transfer size and the number of transfers used to
+ *    stream trace data. Zero keeps the default. With 'autotune' set,
+ *    'numtransfers' is the upper limit for the transfers kept in flight.
+ *    With 'zerocopy' set, whole transfers are queued for capture processing
+ *    by reference instead of being copied packet by packet.
+ */
+
+void HW_SetTransferParams(int packetspertransfer, int numtransfers, bool autotune, bool zerocopy)
+{
+	if (packetspertransfer > 0)
+		packetsPerTransfer = packetspertransfer;
+	if (numtransfers > 0)
+		numTransfers = numtransfers;
+	autoTune = autotune;
+	zeroCopy = zerocopy;
+}
+
+
+/*
+ * HW_SetSegmentParams --
+ *
+ *    Enables rotation of the trace file over segments of 'size' compressed
+ *    bytes or 'time' seconds, whichever comes first. Only the last 'count'
+ *    segments are kept, or all if 0. A FIFO channel event keeps 'keep'
+ *    segments on either side of it.
+ */
+
+void HW_SetSegmentParams(uint64_t size, unsigned int time, unsigned int count, unsigned int keep)
+{
+	segmentSize = size;
+	segmentTime = time;
+	segmentCount = count;
+	segmentKeep = keep;
+}
+
+
+/*
+ * HW_SetDirectIO --
+ *
+ *    Writes the trace with direct I/O, so that long captures don't fill
+ *    the page cache and push out the capture buffers.
+ */
+
+void HW_SetDirectIO(bool direct)
+{
+	directIO = direct;
+}
+
+
+/*
+ * HW_SetStatsFile --
+ *
+ *    Enables periodic export of the capture pipeline statistics.
+ *    A line of JSON is appended to 'filename' every STATS_INTERVAL seconds
+ *    while tracing. 'filename' may also be a named pipe. When tracing
+ *    several rigs, each gets a file of its own, see HW_InstanceFileName.
+ */
+
+void HW_SetStatsFile(const char* filename)
+{
+	statsFileName = filename;
+}
+
+
+/*
+ * HW_AddFilterRange --
+ *
+ *    Saves only samples touching the byte addresses from 'start' up to
+ *    'end', together with those in the other ranges added. Can be used
+ *    before and during tracing, as can the other filter functions.
+ */
+
+int HW_AddFilterRange(uint32_t start, uint32_t end)
+{
+	if (HW_FilterAddRange(&filter, start, end) != 0)
+	{
+		fprintf(stderr, "Invalid filter range %08X-%08X, at most %d ranges are allowed\n", start, end, HWFILTER_MAXRANGES);
+		return -1;
+	}
+
+	HW_UpdateFilter();
+	return 0;
+}
+
+void HW_SetFilterTypes(unsigned int types)
+{
+	HW_FilterSetTypes(&filter, types);
+	HW_UpdateFilter();
+}
+
+/*
+ * HW_SetFilterWindow --
+ *
+ *    Saves only samples from index 'firstsample' up to 'lastsample' in the
+ *    capture. A 'lastsample' of 0 has no end.
+ */
+
+void HW_SetFilterWindow(uint64_t firstsample, uint64_t lastsample)
+{
+	HW_FilterSetWindow(&filter, firstsample, lastsample);
+	HW_UpdateFilter();
+}
+
+void HW_ClearFilter()
+{
+	HW_FilterInit(&filter);
+	HW_UpdateFilter();
+}
+
+void HW_ShowFilter()
+{
+	HW_FilterPrint(&filter);
+}
+
+static void HW_UpdateFilter()
+{
+	unsigned int i;
+
+	if (instanceCount == 0)
+		return;
+
+	for(i=0; i<instanceCount; i++)
+	{
+		if (instances[i]->tracing)
+			HW_CaptureSetFilter(&instances[i]->capture, &filter);
+	}
+
+	HW_FilterPrint(&filter);
+}
+
+
+/*
+ * HW_InstanceFileName --
+ *
+ *    Names the output of one rig. With a single rig it's 'filename'
+ *    itself, otherwise the device number is appended.
+ */
+
+static void HW_InstanceFileName(char* name, size_t namesize, const char* filename, const HWInstance* hw, unsigned int count)
+{
+	if (count > 1)
+		snprintf(name, namesize, "%s.dev%u", filename, hw->index);
+	else
+		snprintf(name, namesize, "%s", filename);
 }
 
 
@@ -309,54 +499,132 @@ void HW_LoadPatchFile(const char* filename)
  *
  *    A very high-level function to trace memory activity.
  *    Writes progress to stderr. If 'filename' is non-NULL, writes
- *    the output to disk.
+ *    the output to disk. All 'count' rigs are traced at once, each
+ *    with its own capture pipeline and output file, until the user
+ *    stops tracing or all of them have stopped.
  */
 
-void HW_Trace(FTDIDevice *dev, const char *filename)
+void HW_Trace(HWInstance** hws, unsigned int count, const char *filename)
 {
-	int err;
+	FTDIDevice* devs[HW_MAXINSTANCES];
+	void* userdata[HW_MAXINSTANCES];
+	int results[HW_MAXINSTANCES];
+	char name[1024];
+	bool failed = false;
+	unsigned int i;
 
 
+	if (count > HW_MAXINSTANCES)
+	{
+		fprintf(stderr, "At most %d devices can be traced at once\n", HW_MAXINSTANCES);
+		exit(1);
+	}
+
 	// Blank line between initialization messages and live tracing
 	fprintf(stderr, "\n");
 
-	exitRequested = false;
-	outputFile = 0;
+	for(i=0; i<count; i++)
+	{
+		HWInstance* hw = hws[i];
+
+		hw->exitrequested = false;
+		hw->outputFile = 0;
+		hw->segmented = false;
+
+		// Open file where the captured RAM tracing data will be stored to.
+		if (filename) {
+			HW_InstanceFileName(name, sizeof name, filename, hw, count);
+
+			if (segmentSize || segmentTime) {
+				HW_SegmentsInit(&hw->segments, name, segmentSize, segmentTime, segmentCount, segmentKeep, directIO);
+				hw->outputFile = HW_SegmentsOpen(&hw->segments);
+				hw->segmented = true;
+			} else {
+				hw->outputFile = HW_WriterOpen(name, directIO);
+				if (!hw->outputFile) {
+					perror("Error opening output file");
+					exit(1);
+				}
+			}
+		}
 
-	// Open file where the captured RAM tracing data will be stored to.
-	if (filename) {
-		outputFile = fopen(filename, "wb");
-		if (!outputFile) {
-			perror("Error opening output file");
-			exit(1);
+		if (statsFileName) {
+			HW_InstanceFileName(name, sizeof name, statsFileName, hw, count);
+
+			hw->statsFile = fopen(name, "a");
+			if (!hw->statsFile) {
+				perror("Error opening stats file");
+				exit(1);
+			}
 		}
-	} 
 
-	// Drain any junk out of the read buffer and discard it before
-	// enabling memory traces.
+		// Drain any junk out of the read buffer and discard it before
+		// enabling memory traces.
 
-	while (FTDIDevice_ReadByteSync(dev, FTDI_INTERFACE_A, NULL) >= 0);
+		while (FTDIDevice_ReadByteSync(&hw->dev, FTDI_INTERFACE_A, NULL) >= 0);
+	}
 
 	// Capture data until we're interrupted.
 	signal(SIGINT, HW_SigintHandler);
 
-	HW_CaptureBegin(&capture, outputFile, dev, processEnabled);
+	for(i=0; i<count; i++)
+	{
+		HWInstance* hw = hws[i];
+
+		HW_CaptureBegin(&hw->capture, hw->outputFile, hw->segmented ? &hw->segments : NULL, &hw->dev, hw->processenabled, packetsPerTransfer * FTDI_PACKET_SIZE);
+		hw->statsTime = 0;
 
+		if (HW_FilterIsActive(&filter))
+			HW_CaptureSetFilter(&hw->capture, &filter);
+		hw->tracing = true;
 
-	err = FTDIDevice_ReadStream(dev, FTDI_INTERFACE_A, HW_ReadCallback, NULL, PACKETS_PER_TRANSFER, NUM_TRANSFERS);
-	if (err < 0 && !exitRequested)
-	{
-		fprintf(stderr, "Error reading stream (%d)\n", err);
-		exit(1);
+		devs[i] = &hw->dev;
+		userdata[i] = hw;
+		instances[i] = hw;
 	}
+	instanceCount = count;
+
+	if (HW_FilterIsActive(&filter))
+		HW_FilterPrint(&filter);
+
 
-	HW_CaptureFinish(&capture);
+	FTDIDevice_ReadStreams(devs, count, FTDI_INTERFACE_A, HW_ReadCallback, userdata, results, packetsPerTransfer, numTransfers, autoTune,
+	                       zeroCopy ? HW_BufferCallback : NULL);
 
-	if (outputFile) {
-		fclose(outputFile);
-		outputFile = 0;
+	for(i=0; i<count; i++)
+	{
+		HWInstance* hw = hws[i];
+
+		if (results[i] < 0 && !hw->exitrequested)
+		{
+			fprintf(stderr, "Error reading stream from device %u (%d)\n", hw->index, results[i]);
+			failed = true;
+		}
+
+		hw->tracing = false;
+		HW_CaptureFinish(&hw->capture);
+
+		// The capture may have moved on to another segment
+		if (hw->capture.outputFile) {
+			if (HW_WriterClose(hw->capture.outputFile) != 0)
+				fprintf(stderr, "Error writing output file\n");
+			hw->outputFile = 0;
+		}
+
+		if (hw->segmented)
+			HW_SegmentsDestroy(&hw->segments);
+
+		if (hw->statsFile) {
+			fclose(hw->statsFile);
+			hw->statsFile = 0;
+		}
 	}
 
+	instanceCount = 0;
+
+	if (failed)
+		exit(1);
+
 	fprintf(stdout, "\nCapture ended.\n");
 }
 
@@ -371,36 +639,93 @@ void HW_Trace(FTDIDevice *dev, const char *filename)
 
 static int HW_ReadCallback(FTDIDevice* dev, FTDICallbackType cbtype, uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata)
 {
-	unsigned int pos = 0;
+   HWInstance* hw = userdata;
    unsigned int canExit = 0;
 
    
-   if (exitRequested)
+   // A stream that ended on an error winds down its capture as well
+   if (hw->exitrequested || cbtype == FTDI_CALLBACK_CLEANUP)
    {
-      canExit = HW_CaptureTryStop(&capture);
+      canExit = HW_CaptureTryStop(&hw->capture);
+      return canExit ? 1 : 0;
    }
-   else 
-   {
-      
-      if (length) 
-         HW_CaptureDataBlock(&capture, buffer, length);
       
-      if (progress) 
+   if (cbtype == FTDI_CALLBACK_OVERRUN)
+      HW_CaptureGap(&hw->capture);
+
+   if (length) 
+      HW_CaptureDataBlock(&hw->capture, buffer, length);
+   
+   if (progress) 
+   {
+      double seconds = progress->totalTime;
+
+      hw->seconds = seconds;
+      hw->totalbytes = progress->current.totalBytes;
+      hw->currentrate = progress->currentRate;
+      HW_ShowProgress();
+
+      if (hw->statsFile && seconds - hw->statsTime >= STATS_INTERVAL)
       {
-         double seconds = progress->totalTime;
-         double mb = progress->current.totalBytes / (1024.0 * 1024.0);
-         double mbcomp = capture.compressedsize / (1024.0 * 1024.0);
-         char x[512];
-         
-         fprintf(stderr, "\e]2;%10.02fs [ %9.3f/%.3f MB captured/compressed ] %7.1f kB/s current\a",
-                 seconds, mb, mbcomp, progress->currentRate / 1024.0);
-         fflush(stderr);
-         fflush(stdout);         
-      }      
+         HWStats stats;
+
+         HW_CaptureGetStats(&hw->capture, &stats);
+         HW_StatsWrite(hw->statsFile, &stats, progress);
+         fflush(hw->statsFile);
+         hw->statsTime = seconds;
+      }
+   }      
+
+
+	return 0;
+}
+
+
+/*
+ * HW_ShowProgress --
+ *
+ *    Shows the progress of all rigs together in the terminal title.
+ */
+
+static void HW_ShowProgress()
+{
+   double seconds = 0.0;
+   double mb = 0.0;
+   double mbcomp = 0.0;
+   double rate = 0.0;
+   unsigned int i;
+
+   for(i=0; i<instanceCount; i++)
+   {
+      HWInstance* hw = instances[i];
+
+      if (hw->seconds > seconds)
+         seconds = hw->seconds;
+      mb += hw->totalbytes / (1024.0 * 1024.0);
+      mbcomp += hw->capture.compressedsize / (1024.0 * 1024.0);
+      if (hw->tracing && !hw->exitrequested)
+         rate += hw->currentrate;
    }
 
+   fprintf(stderr, "\e]2;%10.02fs [ %9.3f/%.3f MB captured/compressed ] %7.1f kB/s current\a",
+           seconds, mb, mbcomp, rate / 1024.0);
+   fflush(stderr);
+   fflush(stdout);         
+}
+
+
+/*
+ * HW_BufferCallback --
+ *
+ *    Callback from fastftdi in zero-copy mode, swaps a filled transfer
+ *    buffer for an empty one from the capture.
+ */
+
+static uint8_t* HW_BufferCallback(FTDIDevice* dev, uint8_t *buffer, int length, void *userdata)
+{
+	HWInstance* hw = userdata;
 
-	return (exitRequested && canExit) ? 1 : 0;
+	return HW_CaptureSwapBuffer(&hw->capture, buffer, length);
 }
 
 
@@ -415,7 +740,16 @@ static void HW_SigintHandler(int signum)
    HW_RequestExit();
 }
 
+/*
+ * HW_RequestExit --
+ *
+ *    Stops tracing on all rigs.
+ */
+
 void HW_RequestExit()
 {
-  exitRequested = true;
-}
\ No newline at end of file
+  unsigned int i;
+
+  for(i=0; i<instanceCount; i++)
+    instances[i]->exitrequested = true;
+}
@@ -28,6 +28,38 @@
 #define __HW_COMMON_H_
 
 #include "fastftdi.h"
+#include "hw_capture.h"
+#include "hw_patch.h"
+#include "hw_segment.h"
+#include "hw_writer.h"
+#include "hw_filter.h"
+
+// Most rigs traced by one process
+#define HW_MAXINSTANCES 16
+
+/*
+ * HWInstance -- One tracing rig: its device, the patches for it, and its own capture
+ *               pipeline and output. Several of them can be traced at once, see HW_Trace.
+ */
+
+typedef struct
+{
+	FTDIDevice dev;
+	unsigned int index;
+	HWPatchContext patchctx;
+	bool processenabled;
+	HWWriter* outputFile;
+	HWSegments segments;
+	bool segmented;
+	FILE* statsFile;
+	double statsTime;
+	bool tracing;
+	bool exitrequested;
+	double seconds;
+	double currentrate;
+	uint64_t totalbytes;
+	HWCapture capture;
+} HWInstance;
 
 
 /*
@@ -35,11 +67,20 @@
  */
 
 void HW_Init();
-void HW_LoadPatchFile(const char* filename);
-void HW_Patch(FTDIDevice *dev, const char *filename);
-void HW_LoadFlatPatchFile(unsigned int address, const char* filename);
-void HW_Setup(FTDIDevice *dev, const char *bitstream);
-void HW_Trace(FTDIDevice *dev, const char *filename);
+void HW_InstanceInit(HWInstance* hw, unsigned int index);
+void HW_LoadPatchFile(HWInstance* hw, const char* filename);
+void HW_LoadFlatPatchFile(HWInstance* hw, unsigned int address, const char* filename);
+void HW_Setup(HWInstance* hw, const char *bitstream);
+void HW_Trace(HWInstance** instances, unsigned int count, const char *filename);
+void HW_SetStatsFile(const char* filename);
+void HW_SetDirectIO(bool direct);
+void HW_SetSegmentParams(uint64_t size, unsigned int time, unsigned int count, unsigned int keep);
+void HW_SetTransferParams(int packetspertransfer, int numtransfers, bool autotune, bool zerocopy);
+int HW_AddFilterRange(uint32_t start, uint32_t end);
+void HW_SetFilterTypes(unsigned int types);
+void HW_SetFilterWindow(uint64_t firstsample, uint64_t lastsample);
+void HW_ClearFilter();
+void HW_ShowFilter();
 void HW_RequestExit();
 
 #endif // __HW_COMMON_H_
@@ -28,27 +28,35 @@
 #include <string.h>
 #include <pthread.h>
 #include <zlib.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 #include "hw_config.h"
 #include "utils.h"
 #include "hw_process.h"
 #include "hw_command.h"
 #include "server.h"
 
+// Private functions
+static int HW_ProcessIsFifoSample(const uint8_t* sampledata);
+static void HW_ProcessScanScalar(HWProcess* process, uint8_t* buffer, unsigned int samplecount);
+static void HW_ProcessScan(HWProcess* process, uint8_t* buffer, unsigned int samplecount);
+
+/*
+ * Puts the traced data bytes back in memory order, a 16 bit rotate of the
+ * little-endian word, like the decoders do.
+ */
 static void fix_data_order(unsigned int *mask, unsigned char *data)
 {
-	unsigned char input_data[8];
+	uint64_t word;
    
 	*mask = ((*mask << 2) | (*mask >> 6)) & 0xFF;
    
-	memcpy(input_data, data, 8);
-	data[0] = input_data[6];
-	data[1] = input_data[7];
-	data[2] = input_data[0];
-	data[3] = input_data[1];
-	data[4] = input_data[2];
-	data[5] = input_data[3];
-	data[6] = input_data[4];
-	data[7] = input_data[5];
+	memcpy(&word, data, 8);
+	word = (word << 16) | (word >> 48);
+	memcpy(data, &word, 8);
 }
 
 
@@ -65,9 +73,11 @@ void HW_ProcessInit(HWProcess* process, FTDIDevice* dev, int enabled)
    
    process->enabled = enabled;
    process->dev = dev;
+   process->samplerestsize = 0;
+   process->events = 0;
    process->writefifocapacity = 256;
-   HW_BufferInit(&process->writefifo, 16);
-   HW_BufferInit(&process->readfifo, 16);
+   HW_RingBufferInit(&process->writefifo, 16);
+   HW_RingBufferInit(&process->readfifo, 16);
    HW_BufferInit(&process->databuffer, 16);   
    HW_ConfigInit(&process->config);  
 
@@ -89,7 +99,8 @@ void HW_ProcessDestroy(HWProcess* process)
 
    HW_CommandDestroy(&process->command);
 
-   HW_BufferDestroy(&process->writefifo);
+   HW_RingBufferDestroy(&process->writefifo);
+   HW_RingBufferDestroy(&process->readfifo);
    HW_BufferDestroy(&process->config);
 }
 
@@ -144,7 +155,7 @@ void HW_ProcessServiceFopen(HWProcess* process, unsigned int command, unsigned c
    process->filemap[index].used = 1;
    process->filemap[index].file = f;
      
-   HW_BufferAppend(&process->writefifo, &index, 4);
+   HW_RingBufferAppend(&process->writefifo, &index, 4);
 }
 
 void HW_ProcessServiceFwrite(HWProcess* process, unsigned int command, unsigned char* buffer, unsigned int buffersize)
@@ -213,12 +224,12 @@ void HW_ProcessServiceFread(HWProcess* process, unsigned int command, unsigned c
       return;
    }
 
-   HW_BufferAppend(&process->writefifo, &readsize, 4);
-   HW_BufferAppend(&process->writefifo, process->databuffer.buffer, readsize);
+   HW_RingBufferAppend(&process->writefifo, &readsize, 4);
+   HW_RingBufferAppend(&process->writefifo, process->databuffer.buffer, readsize);
    
    readsizealigned = (readsize+3) & (~3);
    if (readsizealigned != readsize)
-      HW_BufferAppend(&process->writefifo, dummybuffer, readsizealigned-readsize);
+      HW_RingBufferAppend(&process->writefifo, dummybuffer, readsizealigned-readsize);
    HW_BufferClear(&process->databuffer);
 }
 
@@ -351,7 +362,7 @@ void HW_ProcessServiceFsize(HWProcess* process, unsigned int command, unsigned c
    filesize = ftell(file);
    fseek(file, 0, SEEK_SET);
    
-   HW_BufferAppend(&process->writefifo, &filesize, 4);
+   HW_RingBufferAppend(&process->writefifo, &filesize, 4);
 }
 
 void HW_ProcessServiceCommandRequest(HWProcess* process, unsigned int command, unsigned char* buffer, unsigned int buffersize)
@@ -367,7 +378,7 @@ void HW_ProcessServiceCommandRequest(HWProcess* process, unsigned int command, u
 		  if (0 == DebuggerRead(&process->debugger, &process->writefifo))
 		  {	  
 			  // No commands in queue, so send the idle command
-			  HW_BufferAppend(&process->writefifo, idle, 8);
+			  HW_RingBufferAppend(&process->writefifo, idle, 8);
 		  }
 	  }
    }
@@ -377,6 +388,9 @@ void HW_ProcessServiceCommandRequest(HWProcess* process, unsigned int command, u
 
 void HW_ProcessServiceCommandResponse(HWProcess* process, unsigned int command, unsigned char* buffer, unsigned int buffersize)
 {
+   // Counted so the capture can keep the trace around events
+   process->events++;
+
    if (buffersize >= 4)
    {
       command = (buffer[0]<<0) | (buffer[1]<<8) | (buffer[2]<<16) | (buffer[3]<<24);
@@ -406,9 +420,9 @@ void HW_Process(HWProcess* process, unsigned char* buffer, unsigned int buffersi
    {
       if (process->readfifo.size >= 5)
       {
-         unsigned char* readfifobuffer = process->readfifo.buffer;
+         unsigned char* readfifobuffer = HW_RingBufferPeek(&process->readfifo, 5);
          unsigned int readfifopos = 0;
-         unsigned int readfifosize = process->readfifo.size;
+         unsigned int readfifosize = 5;
 
          unsigned int command = buffer_readbyte(readfifobuffer, &readfifopos, readfifosize);
          unsigned int commandsize = buffer_readle32(readfifobuffer, &readfifopos, readfifosize);
@@ -416,6 +430,8 @@ void HW_Process(HWProcess* process, unsigned char* buffer, unsigned int buffersi
 
          if (process->readfifo.size >= 5 + commandsize)
          {
+            readfifobuffer = HW_RingBufferPeek(&process->readfifo, 5 + commandsize);
+
             if (command == 0x01)
                HW_ProcessServicePrint(process, command, readfifobuffer+readfifopos, commandsize);
             else if (command == 0x02 || command == 0x03)
@@ -437,7 +453,7 @@ void HW_Process(HWProcess* process, unsigned char* buffer, unsigned int buffersi
             else if (command == 0x0B)
                HW_ProcessServiceFcopy(process, command, readfifobuffer+readfifopos, commandsize);
 			   
-            HW_BufferRemoveFront(&process->readfifo, 5 + commandsize);
+            HW_RingBufferRemoveFront(&process->readfifo, 5 + commandsize);
          }
          else 
          {
@@ -457,9 +473,9 @@ void HW_Process(HWProcess* process, unsigned char* buffer, unsigned int buffersi
    
    if (maxsize)
    {
-      HW_FifoWrite(&process->config, process->writefifo.buffer, maxsize);
+      HW_FifoWrite(&process->config, HW_RingBufferPeek(&process->writefifo, maxsize), maxsize);
       process->writefifocapacity -= maxsize;
-      HW_BufferRemoveFront(&process->writefifo, maxsize);
+      HW_RingBufferRemoveFront(&process->writefifo, maxsize);
    }
    
    if (process->config.size)
@@ -479,7 +495,6 @@ int HW_ProcessSample(HWProcess* process, uint8_t* sampledata)
 {
    unsigned int header;
 	unsigned int address;
-	static unsigned int fifocount = 0;
    unsigned int i;
    unsigned char resynctoken[16] = {0x11, 0x11, 0x11, 0x11, 0x66, 0x66, 0x66, 0x66, 0xCC, 0xCC, 0xCC, 0xCC, 0x33, 0x33, 0x33, 0x33};
    unsigned char magictoken[3] = {0x33, 0xAB, 0xB0};
@@ -500,9 +515,9 @@ int HW_ProcessSample(HWProcess* process, uint8_t* sampledata)
 	  // Communication interrupt received, clear read and write fifo, and send the resynchronization token
       if (!memcmp(memdata+1, magictoken, 3) && memdata[0] <= 4)
       {
-		 HW_BufferClear(&process->readfifo);
-		 HW_BufferClear(&process->writefifo);
-		 HW_BufferAppend(&process->writefifo, resynctoken, 16);
+		 HW_RingBufferClear(&process->readfifo);
+		 HW_RingBufferClear(&process->writefifo);
+		 HW_RingBufferAppend(&process->writefifo, resynctoken, 16);
       }      
    }
    else if ( (header != 1) && (address == 0x7FFFE4))
@@ -523,7 +538,7 @@ int HW_ProcessSample(HWProcess* process, uint8_t* sampledata)
 		 
          if (!memcmp(process->fifoincoming+1, magictoken, 3) && process->fifoincoming[0] <= 4)
          {
-            HW_BufferAppend(&process->readfifo, process->fifoincoming+4, process->fifoincoming[0]);
+            HW_RingBufferAppend(&process->readfifo, process->fifoincoming+4, process->fifoincoming[0]);
          }
 		 memset(process->fifoincoming, 0, 8);
       }
@@ -532,7 +547,6 @@ int HW_ProcessSample(HWProcess* process, uint8_t* sampledata)
 	{
       unsigned char memdata[8];
       unsigned int mask = sampledata[12];
-      static unsigned char testbuffer[4] = {1, 2, 3, 4};
       		
       memcpy(memdata, sampledata+4, 8);
       fix_data_order(&mask, memdata);
@@ -544,34 +558,126 @@ int HW_ProcessSample(HWProcess* process, uint8_t* sampledata)
 	}
 }
 
-int HW_ProcessBlock(HWProcess* process, uint8_t *buffer, int length)
+/*
+ * HW_ProcessIsFifoSample --
+ *
+ *    Returns nonzero if the sample touches one of the FIFO channel
+ *    addresses (0x7FFFE0, 0x7FFFE4 or 0x7FFFE8).
+ */
+
+static int HW_ProcessIsFifoSample(const uint8_t* sampledata)
+{
+	if (sampledata[3] != 0x7F || sampledata[2] != 0xFF)
+		return 0;
+	
+	return (sampledata[1] == 0xE0 || sampledata[1] == 0xE4 || sampledata[1] == 0xE8);
+}
+
+static void HW_ProcessScanScalar(HWProcess* process, uint8_t* buffer, unsigned int samplecount)
 {
-	static unsigned int samplesize = 0;
-	static unsigned char sampledata[13];
+	unsigned int i;
 	
-	if (samplesize && (samplesize+length >= 13))
+	for(i=0; i<samplecount; i++)
 	{
-		unsigned int readlen = 13-samplesize;
-		memcpy(sampledata+samplesize, buffer, readlen);
+		if (HW_ProcessIsFifoSample(buffer))
+			HW_ProcessSample(process, buffer);
 		
-		HW_ProcessSample(process, sampledata);
+		buffer += SAMPLESIZE;
+	}
+}
+
+/*
+ * HW_ProcessScan --
+ *
+ *    Only a tiny fraction of the samples belong to the FIFO channel, so
+ *    look for the 0x7F address byte (at offset 3 of each sample) a vector
+ *    at a time, and only go through the samples one by one when there is
+ *    a candidate. A group of 16 (SSE2) or 32 (AVX2) samples spans exactly
+ *    13 vectors, and the masks select the bytes that are at offset 3.
+ */
+
+static void HW_ProcessScan(HWProcess* process, uint8_t* buffer, unsigned int samplecount)
+{
+	unsigned int i = 0;
+	unsigned int k;
+	
+#if defined(__AVX2__)
+	static const unsigned int phasemask[SAMPLESIZE] = 
+	{
+		0x20010008, 0x00800400, 0x40020010, 0x01000800, 0x80040020, 0x02001000, 0x00080040, 
+		0x04002001, 0x00100080, 0x08004002, 0x00200100, 0x10008004, 0x00400200,
+	};
+	__m256i key = _mm256_set1_epi8(0x7F);
+	
+	for(; i + 32 <= samplecount; i += 32)
+	{
+		uint8_t* group = buffer + i * SAMPLESIZE;
+		unsigned int hits = 0;
 		
-		length -= readlen;
-		samplesize = 0;
-		buffer += readlen;
+		for(k=0; k<SAMPLESIZE; k++)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i*)(group + k * 32));
+			hits |= (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, key)) & phasemask[k];
+		}
+		
+		if (hits)
+			HW_ProcessScanScalar(process, group, 32);
 	}
+#elif defined(__SSE2__) || defined(_M_X64)
+	static const unsigned int phasemask[SAMPLESIZE] = 
+	{
+		0x0008, 0x2001, 0x0400, 0x0080, 0x0010, 0x4002, 0x0800, 
+		0x0100, 0x0020, 0x8004, 0x1000, 0x0200, 0x0040,
+	};
+	__m128i key = _mm_set1_epi8(0x7F);
 	
-	while(length >= 13)
+	for(; i + 16 <= samplecount; i += 16)
 	{
-		HW_ProcessSample(process, buffer);
+		uint8_t* group = buffer + i * SAMPLESIZE;
+		unsigned int hits = 0;
 		
-		buffer += 13;
-		length -= 13;
+		for(k=0; k<SAMPLESIZE; k++)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(group + k * 16));
+			hits |= (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, key)) & phasemask[k];
+		}
+		
+		if (hits)
+			HW_ProcessScanScalar(process, group, 16);
 	}
+#endif
+	
+	HW_ProcessScanScalar(process, buffer + i * SAMPLESIZE, samplecount - i);
+}
+
+int HW_ProcessBlock(HWProcess* process, uint8_t *buffer, int length)
+{
+	unsigned int samplecount;
+	
+	if (process->samplerestsize && (process->samplerestsize+length >= SAMPLESIZE))
+	{
+		unsigned int readlen = SAMPLESIZE-process->samplerestsize;
+		memcpy(process->samplerestdata+process->samplerestsize, buffer, readlen);
+		
+		if (HW_ProcessIsFifoSample(process->samplerestdata))
+			HW_ProcessSample(process, process->samplerestdata);
+		
+		length -= readlen;
+		process->samplerestsize = 0;
+		buffer += readlen;
+	}
+	
+	samplecount = length / SAMPLESIZE;
+	HW_ProcessScan(process, buffer, samplecount);
+	
+	buffer += samplecount * SAMPLESIZE;
+	length -= samplecount * SAMPLESIZE;
 	
 	if (length)
 	{
-		memcpy(sampledata+samplesize, buffer, length);
-		samplesize += length;
+		memcpy(process->samplerestdata+process->samplerestsize, buffer, length);
+		process->samplerestsize += length;
 	}
-}      
+	
+	return 0;
+}
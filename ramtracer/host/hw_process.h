@@ -38,6 +38,7 @@
  */
 
 #define MAXFILES 16
+#define SAMPLESIZE 13
 
 typedef struct
 {
@@ -49,16 +50,19 @@ typedef struct
 {
    unsigned int writefifocapacity;
    HWBuffer config;   
-   HWBuffer writefifo;
-   HWBuffer readfifo;   
+   HWRingBuffer writefifo;
+   HWRingBuffer readfifo;   
    HWBuffer databuffer;
    FTDIDevice* dev;
    int enabled;
    unsigned char fifoincoming[8];
+   unsigned int samplerestsize;
+   unsigned char samplerestdata[SAMPLESIZE];
    filenode filemap[MAXFILES];
    HWCommand command;
    Server server;
    Debugger debugger;
+   unsigned int events;
 } HWProcess;
 
 /*
@@ -0,0 +1,181 @@
+/*
+ * hw_segment.c - Rotation of the capture output over a ring of segment files.
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hw_segment.h"
+
+
+// Private functions
+static void HW_SegmentsName(HWSegments* segments, unsigned int index, char* name, unsigned int namesize);
+static void HW_SegmentsSetKeep(HWSegments* segments, unsigned int index);
+
+
+void HW_SegmentsInit(HWSegments* segments, const char* filename, uint64_t maxsize, unsigned int maxtime, unsigned int maxcount, unsigned int keepcount, int direct)
+{
+	memset(segments, 0, sizeof(HWSegments));
+	
+	segments->filename = strdup(filename);
+	segments->maxsize = maxsize;
+	segments->maxtime = maxtime;
+	segments->maxcount = maxcount;
+	segments->keepcount = keepcount;
+	segments->direct = direct;
+	segments->index = ~0;
+	
+	pthread_mutex_init(&segments->mutex, 0);
+}
+
+void HW_SegmentsDestroy(HWSegments* segments)
+{
+	pthread_mutex_destroy(&segments->mutex);
+	free(segments->keep);
+	free(segments->filename);
+	segments->keep = 0;
+	segments->filename = 0;
+}
+
+static void HW_SegmentsName(HWSegments* segments, unsigned int index, char* name, unsigned int namesize)
+{
+	snprintf(name, namesize, "%s.%06u", segments->filename, index);
+}
+
+/*
+ * HW_SegmentsOpen --
+ *
+ *    Opens the next segment file, and deletes the segment that drops out of
+ *    the ring, unless it was kept by a trigger.
+ */
+
+HWWriter* HW_SegmentsOpen(HWSegments* segments)
+{
+	char name[1024];
+	HWWriter* f;
+	
+	pthread_mutex_lock(&segments->mutex);
+	
+	segments->index++;
+	segments->starttime = time(0);
+	
+	if (segments->maxcount && segments->index >= segments->maxcount)
+	{
+		unsigned int oldindex = segments->index - segments->maxcount;
+		
+		if (oldindex >= segments->keepcapacity || segments->keep[oldindex] == 0)
+		{
+			HW_SegmentsName(segments, oldindex, name, sizeof(name));
+			remove(name);
+		}
+	}
+	
+	HW_SegmentsName(segments, segments->index, name, sizeof(name));
+	
+	pthread_mutex_unlock(&segments->mutex);
+	
+	f = HW_WriterOpen(name, segments->direct);
+	if (!f)
+	{
+		perror("Error opening output segment");
+		exit(1);
+	}
+	
+	return f;
+}
+
+/*
+ * HW_SegmentsDue --
+ *
+ *    Returns nonzero if the current segment, with 'size' bytes written to
+ *    it so far, is complete.
+ */
+
+int HW_SegmentsDue(HWSegments* segments, uint64_t size)
+{
+	if (segments->maxsize && size >= segments->maxsize)
+		return 1;
+	
+	if (segments->maxtime && time(0) - segments->starttime >= segments->maxtime)
+		return 1;
+	
+	return 0;
+}
+
+static void HW_SegmentsSetKeep(HWSegments* segments, unsigned int index)
+{
+	if (index >= segments->keepcapacity)
+	{
+		unsigned int capacity = segments->keepcapacity * 2;
+		
+		if (capacity < 64)
+			capacity = 64;
+		while(capacity <= index)
+			capacity *= 2;
+		
+		segments->keep = realloc(segments->keep, capacity);
+		if (segments->keep == 0)
+		{
+			fprintf(stderr, "Error allocating segment keep flags\n");
+			exit(1);
+		}
+		memset(segments->keep + segments->keepcapacity, 0, capacity - segments->keepcapacity);
+		segments->keepcapacity = capacity;
+	}
+	
+	segments->keep[index] = 1;
+}
+
+/*
+ * HW_SegmentsTrigger --
+ *
+ *    Keeps the current segment and 'keepcount' segments before and after it
+ *    on disk, so the window around an interesting event survives the ring.
+ */
+
+void HW_SegmentsTrigger(HWSegments* segments)
+{
+	unsigned int first;
+	unsigned int i;
+	int kept;
+	
+	if (segments->keepcount == 0)
+		return;
+	
+	pthread_mutex_lock(&segments->mutex);
+	
+	kept = (segments->index < segments->keepcapacity && segments->keep[segments->index]);
+	
+	first = 0;
+	if (segments->index > segments->keepcount)
+		first = segments->index - segments->keepcount;
+	
+	for(i=first; i<=segments->index + segments->keepcount; i++)
+		HW_SegmentsSetKeep(segments, i);
+	
+	pthread_mutex_unlock(&segments->mutex);
+	
+	if (!kept)
+		printf("SEGMENT: Keeping segments around %s.%06u\n", segments->filename, segments->index);
+}
@@ -0,0 +1,66 @@
+/*
+ * hw_segment.h - Rotation of the capture output over a ring of segment files.
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __HW_SEGMENT_H_
+#define __HW_SEGMENT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "hw_writer.h"
+
+/*
+ * HWSegments -- Flight recorder style output. The capture is split into segment
+ *               files named <filename>.<number>, each a complete compressed trace
+ *               that starts on a sample boundary. Only the last 'maxcount' segments
+ *               are kept on disk, except for segments kept by a trigger.
+ */
+
+typedef struct
+{
+	char* filename;
+	unsigned int index;        // Number of the segment being written
+	uint64_t maxsize;          // Compressed bytes per segment, 0 for no limit
+	unsigned int maxtime;      // Seconds per segment, 0 for no limit
+	unsigned int maxcount;     // Segments kept on disk, 0 to keep all of them
+	unsigned int keepcount;    // Segments kept on either side of a trigger, 0 to ignore triggers
+	int direct;                // Write segments with direct I/O
+	time_t starttime;
+	unsigned char* keep;
+	unsigned int keepcapacity;
+	pthread_mutex_t mutex;
+} HWSegments;
+
+/*
+ * Public functions
+ */
+void HW_SegmentsInit(HWSegments* segments, const char* filename, uint64_t maxsize, unsigned int maxtime, unsigned int maxcount, unsigned int keepcount, int direct);
+void HW_SegmentsDestroy(HWSegments* segments);
+HWWriter* HW_SegmentsOpen(HWSegments* segments);
+int HW_SegmentsDue(HWSegments* segments, uint64_t size);
+void HW_SegmentsTrigger(HWSegments* segments);
+
+#endif // __HW_SEGMENT_H_
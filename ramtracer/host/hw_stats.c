@@ -0,0 +1,98 @@
+/*
+ * hw_stats.c - Capture pipeline statistics.
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include "hw_stats.h"
+
+
+void HW_StatsInit(HWStats* stats)
+{
+	memset(stats, 0, sizeof(HWStats));
+}
+
+void HW_StatsAddProcessTime(HWStats* stats, double seconds)
+{
+	double us = seconds * 1e6;
+	unsigned int bucket = 0;
+	
+	while(bucket < HW_STATS_HISTOGRAMSIZE-1 && us >= 1.0)
+	{
+		us /= 2.0;
+		bucket++;
+	}
+	
+	stats->processhistogram[bucket]++;
+	stats->processcalls++;
+	stats->processtime += seconds;
+	if (seconds > stats->processtimemax)
+		stats->processtimemax = seconds;
+}
+
+/*
+ * HW_StatsWrite --
+ *
+ *    Writes a snapshot of the capture statistics as a single line of JSON,
+ *    so a stats file can be followed with tail -f and parsed line by line.
+ */
+
+void HW_StatsWrite(FILE* f, const HWStats* stats, const FTDIProgressInfo* progress)
+{
+	double ratio = 0.0;
+	double compressrate = 0.0;
+	double transferlatency = 0.0;
+	double processlatency = 0.0;
+	unsigned int i;
+	
+	if (stats->compressoutbytes)
+		ratio = (double)stats->compressinbytes / stats->compressoutbytes;
+	if (stats->compresstime > 0.0)
+		compressrate = stats->compressinbytes / stats->compresstime;
+	if (progress->transfers)
+		transferlatency = progress->transferLatency / progress->transfers;
+	if (stats->processcalls)
+		processlatency = stats->processtime / stats->processcalls;
+	
+	fprintf(f, "{\"time\": %.3f, ", progress->totalTime);
+	fprintf(f, "\"usb\": {\"bytes\": %llu, \"rate\": %.0f, \"transfers\": %llu, \"inflight\": %d, \"latency\": %.6f, \"latencymax\": %.6f, \"overruns\": %llu}, ",
+			(unsigned long long)progress->current.totalBytes, progress->currentRate,
+			(unsigned long long)progress->transfers, progress->inflight, transferlatency, progress->transferLatencyMax,
+			(unsigned long long)progress->overruns);
+	fprintf(f, "\"queue\": {\"bytes\": %llu, \"bytesmax\": %llu, \"nodes\": %u, \"nodesmax\": %u}, ",
+			(unsigned long long)stats->queuedbytes, (unsigned long long)stats->queuedbytesmax,
+			stats->nodes, stats->nodesmax);
+	fprintf(f, "\"capture\": {\"bytes\": %llu, \"gaps\": %llu, \"resyncbytes\": %llu}, ",
+			(unsigned long long)stats->capturedbytes, (unsigned long long)stats->gaps,
+			(unsigned long long)stats->resyncbytes);
+	fprintf(f, "\"process\": {\"bytes\": %llu, \"calls\": %llu, \"latency\": %.6f, \"latencymax\": %.6f, \"histogram\": [",
+			(unsigned long long)stats->processedbytes, (unsigned long long)stats->processcalls,
+			processlatency, stats->processtimemax);
+	for(i=0; i<HW_STATS_HISTOGRAMSIZE; i++)
+		fprintf(f, i ? ", %u" : "%u", stats->processhistogram[i]);
+	fprintf(f, "]}, ");
+	fprintf(f, "\"compress\": {\"inbytes\": %llu, \"outbytes\": %llu, \"ratio\": %.3f, \"rate\": %.0f}}\n",
+			(unsigned long long)stats->compressinbytes, (unsigned long long)stats->compressoutbytes,
+			ratio, compressrate);
+}
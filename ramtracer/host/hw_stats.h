@@ -0,0 +1,68 @@
+/*
+ * hw_stats.h - Capture pipeline statistics.
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __HW_STATS_H_
+#define __HW_STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "fastftdi.h"
+
+// Process latency histogram. Bucket 0 counts calls under 1 us, bucket i
+// counts calls from 2^(i-1) up to 2^i us, the last bucket counts everything slower.
+#define HW_STATS_HISTOGRAMSIZE 24
+
+/*
+ * HWStats -- Counters for the capture pipeline. Each counter is only written by
+ *            the thread owning that stage, while holding the capture mutex.
+ */
+
+typedef struct
+{
+	uint64_t capturedbytes;
+	uint64_t processedbytes;
+	uint64_t compressinbytes;
+	uint64_t compressoutbytes;
+	double compresstime;
+	uint64_t queuedbytes;
+	uint64_t queuedbytesmax;
+	unsigned int nodes;
+	unsigned int nodesmax;
+	uint64_t processcalls;
+	double processtime;
+	double processtimemax;
+	unsigned int processhistogram[HW_STATS_HISTOGRAMSIZE];
+	uint64_t gaps;
+	uint64_t resyncbytes;
+} HWStats;
+
+/*
+ * Public functions
+ */
+void HW_StatsInit(HWStats* stats);
+void HW_StatsAddProcessTime(HWStats* stats, double seconds);
+void HW_StatsWrite(FILE* f, const HWStats* stats, const FTDIProgressInfo* progress);
+
+#endif // __HW_STATS_H_
@@ -0,0 +1,323 @@
+/*
+ * hw_writer.c - Double-buffered output file writer for the capture.
+ *
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "hw_writer.h"
+
+
+// Private functions
+static void* HW_WriterThread(void* arg);
+static void HW_WriterSubmit(HWWriter* writer, unsigned int size);
+static void HW_WriterPreallocate(HWWriter* writer, uint64_t end);
+
+
+/*
+ * HW_WriterOpen --
+ *
+ *    Creates 'filename' for writing. With 'direct' set, the page cache is
+ *    bypassed where the filesystem supports it. Anything but a regular file,
+ *    like a pipe to another program, is written sequentially instead.
+ *    Returns 0 on failure, with errno set.
+ */
+
+HWWriter* HW_WriterOpen(const char* filename, int direct)
+{
+	HWWriter* writer;
+	struct stat st;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	int err;
+	int fd = -1;
+	
+	// Direct I/O means something else on a pipe, only use it on files
+	if (stat(filename, &st) == 0 && !S_ISREG(st.st_mode))
+		direct = 0;
+	
+#ifdef O_DIRECT
+	if (direct)
+	{
+		fd = open(filename, flags | O_DIRECT, 0666);
+		
+		// Not every filesystem (tmpfs for one) does direct I/O
+		if (fd < 0 && errno == EINVAL)
+		{
+			fprintf(stderr, "WARNING: Direct I/O not supported for %s, using buffered writes\n", filename);
+			direct = 0;
+		}
+		else if (fd < 0)
+		{
+			return 0;
+		}
+	}
+#endif
+
+	if (fd < 0)
+	{
+		fd = open(filename, flags, 0666);
+		if (fd < 0)
+			return 0;
+	}
+	
+	if (fstat(fd, &st) != 0)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return 0;
+	}
+	
+	if (!S_ISREG(st.st_mode))
+		direct = 0;
+	
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+	if (direct)
+		fcntl(fd, F_NOCACHE, 1);
+#endif
+
+	writer = calloc(1, sizeof(HWWriter));
+	if (writer == 0)
+	{
+		fprintf(stderr, "Error allocating writer\n");
+		exit(1);
+	}
+	
+	writer->fd = fd;
+	writer->direct = direct;
+	writer->stream = !S_ISREG(st.st_mode);
+	writer->prealloc = !writer->stream;
+	writer->running = 1;
+	
+	if (posix_memalign((void**)&writer->buffer[0], HWWRITER_ALIGN, HWWRITER_BUFFERSIZE) ||
+	    posix_memalign((void**)&writer->buffer[1], HWWRITER_ALIGN, HWWRITER_BUFFERSIZE))
+	{
+		fprintf(stderr, "Error allocating writer buffers\n");
+		exit(1);
+	}
+	
+	pthread_mutex_init(&writer->mutex, 0);
+	pthread_cond_init(&writer->cond, 0);
+	
+	err = pthread_create(&writer->thread, NULL, HW_WriterThread, writer);
+	if (err != 0)
+	{
+		perror("error starting writer thread");
+		exit(1);
+	}
+	
+	return writer;
+}
+
+/*
+ * HW_WriterWrite --
+ *
+ *    Appends 'size' bytes to the file. Returns -1 if writing to the file
+ *    has failed, now or earlier.
+ */
+
+int HW_WriterWrite(HWWriter* writer, const void* data, unsigned int size)
+{
+	const unsigned char* src = data;
+	unsigned int count;
+	
+	while(size)
+	{
+		count = HWWRITER_BUFFERSIZE - writer->size;
+		if (count > size)
+			count = size;
+		
+		memcpy(writer->buffer[writer->current] + writer->size, src, count);
+		writer->size += count;
+		src += count;
+		size -= count;
+		
+		if (writer->size == HWWRITER_BUFFERSIZE)
+			HW_WriterSubmit(writer, HWWRITER_BUFFERSIZE);
+	}
+	
+	return writer->error ? -1 : 0;
+}
+
+/*
+ * HW_WriterClose --
+ *
+ *    Writes out the remaining data and closes the file. Returns -1 if
+ *    writing to the file has failed.
+ */
+
+int HW_WriterClose(HWWriter* writer)
+{
+	uint64_t filesize = writer->offset + writer->size;
+	unsigned int size = writer->size;
+	int error;
+	
+	// Direct I/O only writes whole blocks, the padding is cut off below
+	if (writer->direct)
+		size = (size + HWWRITER_ALIGN - 1) & ~(HWWRITER_ALIGN - 1);
+	
+	if (size)
+	{
+		memset(writer->buffer[writer->current] + writer->size, 0, size - writer->size);
+		HW_WriterSubmit(writer, size);
+	}
+	
+	pthread_mutex_lock(&writer->mutex);
+	writer->running = 0;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+	
+	pthread_join(writer->thread, NULL);
+	
+	if (!writer->stream && ftruncate(writer->fd, filesize) != 0)
+		writer->error = 1;
+	if (close(writer->fd) != 0)
+		writer->error = 1;
+	
+	error = writer->error;
+	
+	pthread_mutex_destroy(&writer->mutex);
+	pthread_cond_destroy(&writer->cond);
+	free(writer->buffer[0]);
+	free(writer->buffer[1]);
+	free(writer);
+	
+	return error ? -1 : 0;
+}
+
+/*
+ * HW_WriterSubmit --
+ *
+ *    Hands the current buffer to the writer thread, once it's done with
+ *    the previous one, and continues in the other buffer.
+ */
+
+static void HW_WriterSubmit(HWWriter* writer, unsigned int size)
+{
+	pthread_mutex_lock(&writer->mutex);
+	
+	while(writer->pending)
+		pthread_cond_wait(&writer->cond, &writer->mutex);
+	
+	writer->pending = writer->buffer[writer->current];
+	writer->pendingsize = size;
+	pthread_cond_broadcast(&writer->cond);
+	
+	pthread_mutex_unlock(&writer->mutex);
+	
+	writer->current ^= 1;
+	writer->offset += size;
+	writer->size = 0;
+}
+
+/*
+ * HW_WriterPreallocate --
+ *
+ *    Makes sure disk space is reserved up to 'end', reserving
+ *    HWWRITER_PREALLOC bytes at a time. The file size is left alone.
+ */
+
+static void HW_WriterPreallocate(HWWriter* writer, uint64_t end)
+{
+	if (!writer->prealloc || end <= writer->allocated)
+		return;
+	
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+	if (fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, writer->allocated, HWWRITER_PREALLOC) == 0)
+	{
+		writer->allocated += HWWRITER_PREALLOC;
+		return;
+	}
+#endif
+
+	// Not supported here, just write without it
+	writer->prealloc = 0;
+}
+
+static void* HW_WriterThread(void* arg)
+{
+	HWWriter* writer = (HWWriter*)arg;
+	unsigned char* buffer;
+	unsigned int size;
+	unsigned int done;
+	ssize_t result;
+	uint64_t offset;
+	int error = 0;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&writer->mutex);
+		
+		while(writer->running && writer->pending == 0)
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+		
+		buffer = writer->pending;
+		size = writer->pendingsize;
+		offset = writer->written;
+		
+		pthread_mutex_unlock(&writer->mutex);
+		
+		if (buffer == 0)
+			break;
+		
+		HW_WriterPreallocate(writer, offset + size);
+		
+		done = 0;
+		while(done < size && !error)
+		{
+			if (writer->stream)
+				result = write(writer->fd, buffer + done, size - done);
+			else
+				result = pwrite(writer->fd, buffer + done, size - done, offset + done);
+			if (result < 0 && errno == EINTR)
+				continue;
+			if (result <= 0)
+			{
+				perror("Error writing output file");
+				error = 1;
+				break;
+			}
+			done += result;
+		}
+		
+		pthread_mutex_lock(&writer->mutex);
+		writer->written += size;
+		writer->pending = 0;
+		if (error)
+			writer->error = 1;
+		pthread_cond_broadcast(&writer->cond);
+		pthread_mutex_unlock(&writer->mutex);
+	}
+	
+	return 0;
+}
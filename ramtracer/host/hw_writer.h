@@ -0,0 +1,78 @@
+/*
+ * hw_writer.h - Double-buffered output file writer for the capture.
+ *
+ *
+ * Copyright (C) 2012 neimod
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __HW_WRITER_H_
+#define __HW_WRITER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Size of each of the two output buffers.
+#define HWWRITER_BUFFERSIZE (8 * 1024 * 1024)
+
+// Alignment of buffers, offsets and sizes for direct I/O.
+#define HWWRITER_ALIGN 4096
+
+// Disk space reserved ahead of the write position.
+#define HWWRITER_PREALLOC (256 * 1024 * 1024)
+
+/*
+ * HWWriter -- Writes a file through two aligned buffers. One buffer is filled by
+ *             the caller while a thread writes the other one out, so disk stalls
+ *             don't hold up compression. With direct I/O the data bypasses the
+ *             page cache, and space is preallocated ahead of the writes to keep
+ *             the file contiguous.
+ */
+
+typedef struct
+{
+	int fd;
+	int direct;
+	int stream;                // Not a regular file (a pipe or a tty), written in order
+	int error;
+	unsigned char* buffer[2];
+	unsigned int current;      // Buffer being filled by the caller
+	unsigned int size;         // Bytes in the current buffer
+	unsigned char* pending;    // Buffer handed to the thread, or 0
+	unsigned int pendingsize;
+	uint64_t offset;           // File offset of the current buffer
+	uint64_t written;          // File offset up to where the thread has written
+	uint64_t allocated;        // File offset up to where space is reserved
+	int prealloc;
+	int running;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} HWWriter;
+
+/*
+ * Public functions
+ */
+HWWriter* HW_WriterOpen(const char* filename, int direct);
+int HW_WriterWrite(HWWriter* writer, const void* data, unsigned int size);
+int HW_WriterClose(HWWriter* writer);
+
+#endif // __HW_WRITER_H_
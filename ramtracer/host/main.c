@@ -34,6 +34,15 @@
 #include "server.h"
 #include "debugger.h"
 
+// Most patch files given on the command line
+#define MAX_PATCHES 32
+
+typedef struct {
+   const char *filename;
+   unsigned int address;
+   bool flat;
+} PatchOption;
+
 static void usage(const char *argv0);
 
 
@@ -45,6 +54,23 @@ static void usage(const char *argv0)
            "\n"
            "Options:\n"
            "  -b, --bitstream=FILE  Load an FPGA bitstream from the provided file.\n"
+           "  -r, --replay=FILE     Replay a recorded trace file instead of using the device. Can be repeated.\n"
+           "  --replay-rate=KBPS    Replay speed in kB/s (default: as fast as possible).\n"
+           "  --device=N            Trace the Nth connected rig (default: 0). Can be repeated to trace\n"
+           "                        several rigs at once, each to [trace file].devN.\n"
+           "  --stats=FILE          Append capture pipeline statistics to FILE every second.\n"
+           "  --packets=N           USB packets per bulk transfer.\n"
+           "  --transfers=N         Number of bulk transfers to keep in flight.\n"
+           "  --autotune            Adjust the transfers in flight at runtime, up to --transfers.\n"
+           "  --zerocopy            Queue whole USB transfers for capture instead of copying them.\n"
+           "  --direct-io           Write the trace file without going through the page cache.\n"
+           "  --segment-size=MB     Rotate the trace file into segments of this compressed size.\n"
+           "  --segment-time=SEC    Rotate the trace file into segments of this duration.\n"
+           "  --segments=N          Keep only the last N segments on disk.\n"
+           "  --keep-on-event=N     Keep N segments on either side of a FIFO channel event.\n"
+           "  --filter-range=A:B    Only save accesses to addresses A up to B. Can be repeated.\n"
+           "  --filter-type=TYPE    Only save accesses of TYPE, 'reads' or 'writes'.\n"
+           "  --filter-window=A:B   Only save samples A up to B of the capture.\n"
            "Copyright (C) 2009 Micah Dowty <micah@navi.cx>\n",
 		   "Copyright (C) 2012 neimod <neimod@gmail.com>\n",
            argv0);
@@ -55,7 +81,26 @@ int main(int argc, char **argv)
 {
    const char *bitstream = NULL;
    const char *tracefile = NULL;
-   FTDIDevice dev;
+   const char *replayfiles[HW_MAXINSTANCES];
+   unsigned int replaycount = 0;
+   int deviceindices[HW_MAXINSTANCES];
+   unsigned int devicecount = 0;
+   PatchOption patches[MAX_PATCHES];
+   unsigned int patchcount = 0;
+   HWInstance *instances[HW_MAXINSTANCES];
+   unsigned int instancecount;
+   libusb_context *libusb = NULL;
+   unsigned int replayrate = 0;
+   int packetspertransfer = 0;
+   int numtransfers = 0;
+   bool autotune = false;
+   bool zerocopy = false;
+   bool directio = false;
+   uint64_t segmentsize = 0;
+   unsigned int segmenttime = 0;
+   unsigned int segmentcount = 0;
+   unsigned int segmentkeep = 0;
+   unsigned int i, j;
    int err, c;
    HW_Init();
    
@@ -73,10 +118,26 @@ int main(int argc, char **argv)
          {"flatpatch", 1, NULL, 'l'},
 		 {"server", 0, NULL, 's'},
 		 {"gdb", 0, NULL, 'd'},
+         {"replay", 1, NULL, 'r'},
+         {"replay-rate", 1, NULL, 'R'},
+         {"device", 1, NULL, 'I'},
+         {"stats", 1, NULL, 'S'},
+         {"packets", 1, NULL, 'P'},
+         {"transfers", 1, NULL, 'T'},
+         {"autotune", 0, NULL, 'A'},
+         {"zerocopy", 0, NULL, 'Z'},
+         {"direct-io", 0, NULL, 'D'},
+         {"segment-size", 1, NULL, 'G'},
+         {"segment-time", 1, NULL, 'M'},
+         {"segments", 1, NULL, 'N'},
+         {"keep-on-event", 1, NULL, 'K'},
+         {"filter-range", 1, NULL, 'F'},
+         {"filter-type", 1, NULL, 'Y'},
+         {"filter-window", 1, NULL, 'W'},
          {NULL},
       };
 
-      c = getopt_long(argc, argv, "sb:p:l:d", long_options, &option_index);
+      c = getopt_long(argc, argv, "sb:p:l:dr:", long_options, &option_index);
       if (c == -1)
          break;
 
@@ -91,8 +152,80 @@ int main(int argc, char **argv)
       case 'b':
          bitstream = strdup(optarg);
          break;
+      case 'r':
+         if (replaycount + devicecount >= HW_MAXINSTANCES)
+            usage(argv[0]);
+         replayfiles[replaycount++] = strdup(optarg);
+         break;
+      case 'I':
+         if (replaycount + devicecount >= HW_MAXINSTANCES)
+            usage(argv[0]);
+         deviceindices[devicecount++] = strtoul(optarg, 0, 0);
+         break;
+      case 'R':
+         replayrate = strtoul(optarg, 0, 0) * 1024;
+         break;
+      case 'S':
+         HW_SetStatsFile(optarg);
+         break;
+      case 'P':
+         packetspertransfer = strtoul(optarg, 0, 0);
+         break;
+      case 'T':
+         numtransfers = strtoul(optarg, 0, 0);
+         break;
+      case 'A':
+         autotune = true;
+         break;
+      case 'Z':
+         zerocopy = true;
+         break;
+      case 'D':
+         directio = true;
+         break;
+      case 'G':
+         segmentsize = strtoull(optarg, 0, 0) * 1024 * 1024;
+         break;
+      case 'M':
+         segmenttime = strtoul(optarg, 0, 0);
+         break;
+      case 'N':
+         segmentcount = strtoul(optarg, 0, 0);
+         break;
+      case 'K':
+         segmentkeep = strtoul(optarg, 0, 0);
+         break;
+      case 'F':
+         {
+            unsigned int start = strtoul(optarg, &pchr, 0);
+            unsigned int end = (*pchr == ':') ? strtoul(pchr + 1, 0, 0) : 0;
+
+            if (HW_AddFilterRange(start, end) != 0)
+               usage(argv[0]);
+         }
+         break;
+      case 'Y':
+         if (strcmp(optarg, "reads") == 0)
+            HW_SetFilterTypes(HWFILTER_READS);
+         else if (strcmp(optarg, "writes") == 0)
+            HW_SetFilterTypes(HWFILTER_WRITES);
+         else
+            usage(argv[0]);
+         break;
+      case 'W':
+         {
+            uint64_t first = strtoull(optarg, &pchr, 0);
+            uint64_t last = (*pchr == ':') ? strtoull(pchr + 1, 0, 0) : 0;
+
+            HW_SetFilterWindow(first, last);
+         }
+         break;
 	  case 'p':
-		 HW_LoadPatchFile(optarg);
+		 if (patchcount >= MAX_PATCHES)
+			 usage(argv[0]);
+		 patches[patchcount].filename = strdup(optarg);
+		 patches[patchcount].flat = false;
+		 patchcount++;
 		 break;
 	  case 'l':
 		  {
@@ -102,7 +235,12 @@ int main(int argc, char **argv)
 			  if (patchfilename != optarg)
 				  patchfilename++;
 			  
- 			  HW_LoadFlatPatchFile(patchaddress, patchfilename);
+			  if (patchcount >= MAX_PATCHES)
+				  usage(argv[0]);
+			  patches[patchcount].filename = strdup(patchfilename);
+			  patches[patchcount].address = patchaddress;
+			  patches[patchcount].flat = true;
+			  patchcount++;
 		  }
 		 break;
       default:
@@ -121,19 +259,82 @@ int main(int argc, char **argv)
       usage(argv[0]);
    }
 
-   err = FTDIDevice_Open(&dev);
-   if (err) 
+   if (devicecount == 0 && replaycount == 0)
+      deviceindices[devicecount++] = 0;
+
+   if (devicecount)
    {
-      fprintf(stderr, "USB: Error opening device\n");
-      return 1;
+      // All rigs share one libusb context, so one event loop streams from all of them
+      err = libusb_init(&libusb);
+      if (err)
+      {
+         fprintf(stderr, "USB: Error initializing libusb\n");
+         return 1;
+      }
+   }
+
+   instancecount = devicecount + replaycount;
+   for (i = 0; i < instancecount; i++)
+   {
+      HWInstance *hw = malloc(sizeof(HWInstance));
+
+      if (!hw)
+      {
+         perror("Error allocating device");
+         return 1;
+      }
+
+      instances[i] = hw;
+      HW_InstanceInit(hw, i);
+
+      if (i < devicecount)
+      {
+         err = FTDIDevice_OpenIndex(&hw->dev, libusb, deviceindices[i]);
+         if (err) 
+         {
+            fprintf(stderr, "USB: Error opening device %d\n", deviceindices[i]);
+            return 1;
+         }
+      }
+      else
+      {
+         err = FTDIDevice_OpenReplay(&hw->dev, replayfiles[i - devicecount], replayrate);
+         if (err)
+         {
+            fprintf(stderr, "Replay: Error opening trace file\n");
+            return 1;
+         }
+      }
+
+      for (j = 0; j < patchcount; j++)
+      {
+         if (patches[j].flat)
+            HW_LoadFlatPatchFile(hw, patches[j].address, patches[j].filename);
+         else
+            HW_LoadPatchFile(hw, patches[j].filename);
+      }
+   }
+
+   if (replaycount && bitstream)
+   {
+      fprintf(stderr, "Replay: Ignoring bitstream %s\n", bitstream);
    }
 
-   HW_Setup(&dev, bitstream);
-   HW_Trace(&dev, tracefile);
+   HW_SetTransferParams(packetspertransfer, numtransfers, autotune, zerocopy);
+   HW_SetDirectIO(directio);
+   HW_SetSegmentParams(segmentsize, segmenttime, segmentcount, segmentkeep);
+   for (i = 0; i < instancecount; i++)
+      HW_Setup(instances[i], i < devicecount ? bitstream : NULL);
+   HW_Trace(instances, instancecount, tracefile);
 
-   FTDIDevice_Close(&dev);
+   for (i = 0; i < instancecount; i++)
+   {
+      FTDIDevice_Close(&instances[i]->dev);
+      free(instances[i]);
+   }
+
+   if (libusb)
+      libusb_exit(libusb);
    
    changeterminal(0);
 }
-
-
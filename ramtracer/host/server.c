@@ -133,7 +133,7 @@ void ServerBegin(Server* server)
 		exit(1);
 	}	
 	
-	HW_BufferInit(&server->receivebuffer, SERVER_MAX_BUFFERSIZE);
+	HW_RingBufferInit(&server->receivebuffer, SERVER_MAX_BUFFERSIZE);
 	pthread_mutex_init(&server->receivemutex, 0);
 
 	err = pthread_create(&server->listenthread, NULL, ServerListenThread, server);
@@ -180,7 +180,7 @@ void ServerFinish(Server* server)
 		exit(1);
 	}
 	
-	HW_BufferDestroy(&server->receivebuffer);	
+	HW_RingBufferDestroy(&server->receivebuffer);	
 	pthread_mutex_destroy(&server->receivemutex);
 }
 	
@@ -355,11 +355,11 @@ void ServerWrite(Server* server, unsigned int command, unsigned char* buffer, un
 }
 
 /**
-	Reads a command from the receive buffer, and appends it to the HWBuffer.
+	Reads a command from the receive buffer, and appends it to the HWRingBuffer.
 	
 	Returns 1 if a command was read, 0 otherwise.
  */
-unsigned int ServerRead(Server* server, HWBuffer* buffer)
+unsigned int ServerRead(Server* server, HWRingBuffer* buffer)
 {
 	unsigned int result = 0;
 	unsigned char dummybuffer[4] = {0, 0, 0, 0};
@@ -371,7 +371,7 @@ unsigned int ServerRead(Server* server, HWBuffer* buffer)
 		// move first command to buffer
 		if (server->receivebuffer.size >= 8)
 		{
-			unsigned char* cmdbuf = server->receivebuffer.buffer;
+			unsigned char* cmdbuf = HW_RingBufferPeek(&server->receivebuffer, 8);
 			unsigned int cmdid = (cmdbuf[0]<<0) | (cmdbuf[1]<<8) | (cmdbuf[2]<<16) | (cmdbuf[3]<<24);
 			unsigned int cmdsize = (cmdbuf[4]<<0) | (cmdbuf[5]<<8) | (cmdbuf[6]<<16) | (cmdbuf[7]<<24);
 			unsigned int totalsize = 8+cmdsize;
@@ -390,9 +390,14 @@ unsigned int ServerRead(Server* server, HWBuffer* buffer)
 			{
 				if (server->receivebuffer.size >= 16)
 				{
-					unsigned int payloadblockcount = (cmdbuf[8]<<0) | (cmdbuf[9]<<8) | (cmdbuf[10]<<16) | (cmdbuf[11]<<24);
-					unsigned int assocblockcount = (cmdbuf[12]<<0) | (cmdbuf[13]<<8) | (cmdbuf[14]<<16) | (cmdbuf[15]<<24);
-					unsigned int expectedsize = payloadblockcount * 16 + assocblockcount * 16 + 28;
+					unsigned int payloadblockcount;
+					unsigned int assocblockcount;
+					unsigned int expectedsize;
+					
+					cmdbuf = HW_RingBufferPeek(&server->receivebuffer, 16);
+					payloadblockcount = (cmdbuf[8]<<0) | (cmdbuf[9]<<8) | (cmdbuf[10]<<16) | (cmdbuf[11]<<24);
+					assocblockcount = (cmdbuf[12]<<0) | (cmdbuf[13]<<8) | (cmdbuf[14]<<16) | (cmdbuf[15]<<24);
+					expectedsize = payloadblockcount * 16 + assocblockcount * 16 + 28;
 					
 					if (payloadblockcount <= 0xFFFF && assocblockcount <= 0xFFFF && cmdsize == expectedsize)
 						valid = 1;
@@ -404,17 +409,17 @@ unsigned int ServerRead(Server* server, HWBuffer* buffer)
 			{
 				if (valid && cmdid >= SERVER_MIN_CMD_ID)
 				{					
-					HW_BufferAppend(buffer, cmdbuf, totalsize);
+					HW_RingBufferAppend(buffer, HW_RingBufferPeek(&server->receivebuffer, totalsize), totalsize);
 					
 					alignedsize = (cmdsize+3) & (~3);
 					restsize = alignedsize - cmdsize;
 					if (restsize)
-						HW_BufferAppend(buffer, dummybuffer, restsize);
+						HW_RingBufferAppend(buffer, dummybuffer, restsize);
 						
 					result = 1;
 				}
 					
-				HW_BufferRemoveFront(&server->receivebuffer, totalsize);
+				HW_RingBufferRemoveFront(&server->receivebuffer, totalsize);
 			}
 		}
 		
@@ -442,7 +447,7 @@ static void* ServerReceiveThread(void* arg)
 		int nbytes;
 		struct timeval timeout;
 		unsigned int maxsize = sizeof(buf);
-		unsigned int availablesize = server->receivebuffer.capacity - server->receivebuffer.size;
+		unsigned int availablesize = HW_RingBufferAvailable(&server->receivebuffer);
 		
 		if (maxsize > availablesize)
 			maxsize = availablesize;
@@ -457,7 +462,7 @@ static void* ServerReceiveThread(void* arg)
 			server->remoteflush = 0;
 			
 			pthread_mutex_lock(&server->receivemutex);
-			HW_BufferClear(&server->receivebuffer);
+			HW_RingBufferClear(&server->receivebuffer);
 			pthread_mutex_unlock(&server->receivemutex);			
 		}
 
@@ -540,7 +545,7 @@ static void* ServerReceiveThread(void* arg)
 				}
 				
 				pthread_mutex_lock(&server->receivemutex);
-				HW_BufferFill(&server->receivebuffer, buf, nbytes);
+				HW_RingBufferFill(&server->receivebuffer, buf, nbytes);
 				pthread_mutex_unlock(&server->receivemutex);
 			}
 		}
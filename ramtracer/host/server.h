@@ -57,7 +57,7 @@ typedef struct
 	unsigned char auth[SERVER_MAX_CHALLENGESIZE];
 	int shutdownpipe[2];
 	pthread_mutex_t receivemutex;
-	HWBuffer receivebuffer;
+	HWRingBuffer receivebuffer;
 } Server;
 
 /*
@@ -67,7 +67,7 @@ int  ServerIsEnabled();
 void ServerSetEnabled(int enabled);
 void ServerBegin(Server* server);
 void ServerFinish(Server* server);
-unsigned int ServerRead(Server* server, HWBuffer* buffer);
+unsigned int ServerRead(Server* server, HWRingBuffer* buffer);
 void ServerWriteBuffer(Server* server, unsigned char* buffer, unsigned int buffersize);
 void ServerWrite(Server* server, unsigned int command, unsigned char* buffer, unsigned int buffersize);
 
@@ -0,0 +1,159 @@
+/*
+ * blockring.h - Bounded ring of blocks handed between threads
+ */
+
+#ifndef __BLOCKRING_H_
+#define __BLOCKRING_H_
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * Bounded ring of equally sized blocks, handing data from one thread to
+ * another. The producer fills the block returned by ring_acquire and passes it
+ * on with ring_post; the consumer gets the posted blocks in order from
+ * ring_take and gives each back with ring_release once done with it.
+ * ring_acquire and ring_take return 0 once the ring is aborted, ring_take also
+ * once the ring is closed and all posted blocks were taken.
+ */
+typedef struct
+{
+	unsigned char* data;
+	unsigned int size;
+} ringblock;
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	ringblock* blocks;
+	unsigned int count;
+	unsigned long long posted;
+	unsigned long long taken;
+	unsigned long long released;
+	int closed;
+	int aborted;
+} blockring;
+
+static void ring_destroy(blockring* ring)
+{
+	unsigned int i;
+
+	if (ring == 0)
+		return;
+
+	pthread_mutex_destroy(&ring->mutex);
+	pthread_cond_destroy(&ring->cond);
+	for(i=0; i<ring->count; i++)
+		free(ring->blocks[i].data);
+	free(ring->blocks);
+	free(ring);
+}
+
+static blockring* ring_create(unsigned int count, unsigned int blocksize)
+{
+	blockring* ring = calloc(1, sizeof(blockring));
+	unsigned int i;
+
+	if (ring == 0)
+		return 0;
+
+	pthread_mutex_init(&ring->mutex, 0);
+	pthread_cond_init(&ring->cond, 0);
+	ring->count = count;
+	ring->blocks = calloc(count, sizeof(ringblock));
+	if (ring->blocks == 0)
+	{
+		ring->count = 0;
+		ring_destroy(ring);
+		return 0;
+	}
+
+	for(i=0; i<count; i++)
+	{
+		ring->blocks[i].data = malloc(blocksize);
+		if (ring->blocks[i].data == 0)
+		{
+			ring_destroy(ring);
+			return 0;
+		}
+	}
+
+	return ring;
+}
+
+static ringblock* ring_acquire(blockring* ring)
+{
+	ringblock* block = 0;
+
+	pthread_mutex_lock(&ring->mutex);
+	while(!ring->aborted && ring->posted - ring->released >= ring->count)
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	if (!ring->aborted)
+	{
+		block = &ring->blocks[ring->posted % ring->count];
+		block->size = 0;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+
+	return block;
+}
+
+static void ring_post(blockring* ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->posted++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+static ringblock* ring_take(blockring* ring)
+{
+	ringblock* block = 0;
+
+	pthread_mutex_lock(&ring->mutex);
+	while(!ring->aborted && !ring->closed && ring->taken == ring->posted)
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	if (!ring->aborted && ring->taken != ring->posted)
+		block = &ring->blocks[ring->taken++ % ring->count];
+	pthread_mutex_unlock(&ring->mutex);
+
+	return block;
+}
+
+static void ring_release(blockring* ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->released++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/*
+ * Waits until the consumer is done with every block posted so far.
+ */
+static void ring_drain(blockring* ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	while(!ring->aborted && ring->released != ring->posted)
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+static void ring_close(blockring* ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->closed = 1;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+static void ring_abort(blockring* ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->aborted = 1;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+#endif // __BLOCKRING_H_
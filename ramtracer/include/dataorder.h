@@ -0,0 +1,49 @@
+/*
+ * dataorder.h - Undoes the byte and bit order of the traced data bus
+ */
+
+#ifndef __DATAORDER_H_
+#define __DATAORDER_H_
+
+#include <string.h>
+
+static unsigned char shuffle(unsigned int order, unsigned char c)
+{
+	unsigned char out = 0;
+	int i;
+	for (i = 0; i < 8; i++) {
+		out |= ((c >> ((order >> (i*4)) & 0xF)) & 1) << i;
+	}
+	return out;
+}
+
+/*
+ * Fills 'table' with shuffle(order, c) for every byte c, so bytes are shuffled
+ * with a lookup each.
+ */
+static void shuffle_table(unsigned char* table, unsigned int order)
+{
+	unsigned int c;
+
+	for(c=0; c<256; c++)
+		table[c] = shuffle(order, c);
+}
+
+/*
+ * Puts the traced data bytes back in memory order, byte i being bus byte
+ * (i + 6) & 7, and the mask bits with them. On a little-endian host that's a
+ * 16 bit rotate of the word, a single instruction, and a 2 bit rotate of the
+ * mask.
+ */
+static void fix_data_order(unsigned int *mask, unsigned char *data)
+{
+	unsigned long long word;
+
+	*mask = ((*mask << 2) | (*mask >> 6)) & 0xFF;
+
+	memcpy(&word, data, 8);
+	word = (word << 16) | (word >> 48);
+	memcpy(data, &word, 8);
+}
+
+#endif // __DATAORDER_H_
@@ -0,0 +1,118 @@
+/*
+ * decoder.h - Core shared by the RAM trace decoders
+ *
+ * A decoder is a single source file. It includes this header, defines
+ * SAMPLESIZE, its ramcontext and processsample, and then includes
+ * decoderstream.h for the sample stream handling around processsample. The
+ * core is defined in the headers, so every decoder is compiled with its own
+ * sample size and gets processsample inlined into its sample loop.
+ */
+
+#ifndef __DECODER_H_
+#define __DECODER_H_
+
+#include "blockring.h"
+#include "outbuffer.h"
+#include "rammemory.h"
+#include "sdram.h"
+#include "rwaccumulator.h"
+#include "dataorder.h"
+#include "watchlist.h"
+
+#define VERBOSE_SDRAM (1<<0)
+#define VERBOSE_LEQ (1<<1)
+#define VERBOSE_GEQ (1<<2)
+#define VERBOSE_READS (1<<3)
+#define VERBOSE_WRITES (1<<4)
+#define VERBOSE_VERIFY (1<<5)
+#define VERBOSE_ADDRESS (1<<6)
+#define VERBOSE_COMPACT (1<<7)
+#define VERBOSE_EVENTS (1<<8)
+
+// Inflated trace blocks queued between the inflate and the decode thread
+#define PIPELINEBLOCKS 8
+#define PIPELINEBLOCKSIZE (4 * 1024 * 1024)
+
+// Most inflated trace data held in memory for a benchmark run
+#define BENCHMARK_MAXSIZE (256 * 1024 * 1024)
+
+/*
+ * Options every decoder takes. A decoder numbers its own options from
+ * OPT_DECODER on, and lists them after DECODER_LONGOPTIONS and DECODER_USAGE.
+ */
+enum decoderopts
+{
+	OPT_VERBOSE = 'v',
+	OPT_HELP = 'h',
+	OPT_OUTPUT_MEMORY = 'o',
+	OPT_VERBOSE_LEQ = 256,
+	OPT_VERBOSE_GEQ = 257,
+	OPT_STOP = 258,
+	OPT_VERBOSE_ADDRESS = 259,
+	OPT_VERBOSE_SDRAM = 260,
+	OPT_VERBOSE_VERIFY = 261,
+	OPT_VERBOSE_READS = 262,
+	OPT_VERBOSE_WRITES = 263,
+	OPT_VERBOSE_COMPACT = 264,
+	OPT_BENCHMARK = 265,
+	OPT_EVENTS = 266,
+	OPT_NO_PIPELINE = 267,
+	OPT_OUTPUT_PAGES = 268,
+	OPT_ADDRESS_BITS = 269,
+	OPT_WATCH = 270,
+	OPT_DECODER = 271,
+};
+
+#define DECODER_SHORTOPTIONS "vho:"
+
+#define DECODER_LONGOPTIONS \
+			{"verbose-leq", 1, NULL, OPT_VERBOSE_LEQ}, \
+			{"verbose-geq", 1, NULL, OPT_VERBOSE_GEQ}, \
+			{"verbose-address", 1, NULL, OPT_VERBOSE_ADDRESS}, \
+			{"verbose-sdram", 0, NULL, OPT_VERBOSE_SDRAM}, \
+			{"verbose-verify", 0, NULL, OPT_VERBOSE_VERIFY}, \
+			{"verbose-reads", 0, NULL, OPT_VERBOSE_READS}, \
+			{"verbose-writes", 0, NULL, OPT_VERBOSE_WRITES}, \
+			{"verbose-compact", 0, NULL, OPT_VERBOSE_COMPACT}, \
+			{"stop", 1, NULL, OPT_STOP}, \
+			{"verbose", 0, NULL, OPT_VERBOSE}, \
+			{"help", 0, NULL, OPT_HELP}, \
+			{"out", 1, NULL, OPT_OUTPUT_MEMORY}, \
+			{"benchmark", 0, NULL, OPT_BENCHMARK}, \
+			{"events", 1, NULL, OPT_EVENTS}, \
+			{"no-pipeline", 0, NULL, OPT_NO_PIPELINE}, \
+			{"out-pages", 1, NULL, OPT_OUTPUT_PAGES}, \
+			{"address-bits", 1, NULL, OPT_ADDRESS_BITS}, \
+			{"watch", 1, NULL, OPT_WATCH}
+
+// Help for the options above, takes MEMORYBITS as its one printf argument
+#define DECODER_USAGE \
+		   "  -h, --help              Print this help info.\n" \
+		   "  -v, --verbose           Be verbose.\n" \
+		   "      --verbose-leq=x     Sample index must be <= x to be verbose.\n" \
+		   "      --verbose-geq=x     Sample index must be >= x to be verbose.\n" \
+		   "      --verbose-address=x Sample must have an address related to reads/writes to be verbose.\n" \
+		   "      --verbose-verify    Be verbose about verification.\n" \
+		   "      --verbose-reads     Be verbose about reads.\n" \
+		   "      --verbose-writes    Be verbose about writes.\n" \
+		   "      --verbose-sdram     Be verbose about SDRAM commands.\n" \
+		   "      --verbose-compact   Be verbose about the compact form.\n" \
+		   "      --stop=x            Stop at sample index x.\n" \
+		   "  -o, --out=file          Output final memory contents to file\n" \
+		   "      --out-pages=file    Output only the memory pages written to, with a bitmap of the bytes written.\n" \
+		   "      --address-bits=n    Size of the memory as a power of two (default %d, 128 MB).\n" \
+		   "      --events=file       Write every read and write to file as binary event records.\n" \
+		   "      --watch=file        Report the accesses to the byte ranges listed in file, one per line as\n" \
+		   "                          start[-end|+size] [read] [write] [=value|changed|bit=n].\n" \
+		   "      --benchmark         Time inflating and decoding the trace, reported in samples/s.\n" \
+		   "      --no-pipeline       Inflate, decode and write the output all on one thread.\n"
+
+typedef struct
+{
+	FILE* fmem;
+	FILE* fpages;
+	unsigned int addressbits;
+	int dobenchmark;
+} decoderoptions;
+
+#endif // __DECODER_H_
@@ -0,0 +1,557 @@
+/*
+ * decoderstream.h - Sample stream handling around a decoder's processsample
+ *
+ * Included by a decoder once it has defined SAMPLESIZE, its ramcontext and
+ * processsample(ramcontext*, unsigned char*). ramcontext has at least the
+ * sampleindex, samplerestsize, samplerestdata, stopindex, verbose settings,
+ * acc, memory, out, events and pipeline fields every decoder uses. The decoder
+ * defines tracesequential and resetcontext after it. A decoder that defines
+ * DECODER_FASTFORWARD also provides fastforward(ramcontext*, unsigned char*,
+ * unsigned int), which decodes as many of the given samples as it can without
+ * output and returns how many that were.
+ */
+
+#ifndef __DECODERSTREAM_H_
+#define __DECODERSTREAM_H_
+
+#include <stdio.h>
+#include <zlib.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include "decoder.h"
+
+int tracesequential(ramcontext* context, FILE* f);
+void resetcontext(ramcontext* context);
+
+static int processbuffer(ramcontext* context, unsigned char* buffer, unsigned int size)
+{
+	unsigned int samplecount;
+	unsigned int samplecopysize;
+	unsigned int i;
+
+
+	if (context->samplerestsize)
+	{
+		samplecopysize = SAMPLESIZE - context->samplerestsize;
+		if (samplecopysize > size)
+			samplecopysize = size;
+
+		memcpy(context->samplerestdata + context->samplerestsize, buffer, samplecopysize);
+
+		context->samplerestsize += samplecopysize;
+		buffer += samplecopysize;
+		size -= samplecopysize;
+
+		if (context->samplerestsize == SAMPLESIZE)
+		{
+			if (0 == processsample(context, context->samplerestdata))
+				return 0;
+			context->sampleindex++;
+			context->samplerestsize = 0;
+		}
+	}
+
+	if (size)
+	{
+		samplecount = size / SAMPLESIZE;
+
+		for(i=0; i<samplecount; i++)
+		{
+#ifdef DECODER_FASTFORWARD
+			// Stretches of samples without output take the decoder's quiet path
+			i += fastforward(context, buffer + i*SAMPLESIZE, samplecount - i);
+			if (i == samplecount)
+				break;
+#endif
+			if (0 == processsample(context, buffer + i*SAMPLESIZE))
+				return 0;
+			context->sampleindex++;
+		}
+
+		context->samplerestsize = size - (samplecount * SAMPLESIZE);
+		memcpy(context->samplerestdata, buffer + samplecount*SAMPLESIZE, context->samplerestsize);
+	}
+
+	return 1;
+}
+
+typedef struct
+{
+	FILE* f;
+	blockring* ring;
+	int result;
+} inflatejob;
+
+/*
+ * Inflates the trace into the blocks of the pipeline ring, until the trace ends
+ * or the decode thread aborts the ring.
+ */
+static void* inflatethread(void* arg)
+{
+	inflatejob* job = arg;
+	unsigned int inbuffersize = 64 * 1024;
+	unsigned char* inbuffer = 0;
+	ringblock* block = 0;
+	z_stream stream;
+	int result;
+
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+	result = inflateInit(&stream);
+    if (result != Z_OK)
+		goto done;
+
+	inbuffer = malloc(inbuffersize);
+	if (inbuffer == 0)
+	{
+		result = Z_MEM_ERROR;
+		goto clean;
+	}
+
+	block = ring_acquire(job->ring);
+	if (block == 0)
+		goto clean;
+
+	do
+	{
+		stream.avail_in = fread(inbuffer, 1, inbuffersize, job->f);
+		stream.next_in = inbuffer;
+		if (stream.avail_in == 0)
+			break;
+
+		do
+		{
+			stream.avail_out = PIPELINEBLOCKSIZE - block->size;
+			stream.next_out = block->data + block->size;
+
+			result = inflate(&stream, Z_NO_FLUSH);
+
+			switch(result)
+			{
+				case Z_NEED_DICT:
+					result = Z_DATA_ERROR;
+				case Z_DATA_ERROR:
+				case Z_MEM_ERROR:
+					goto flush;
+			}
+
+			block->size = PIPELINEBLOCKSIZE - stream.avail_out;
+			if (block->size == PIPELINEBLOCKSIZE)
+			{
+				ring_post(job->ring);
+				block = ring_acquire(job->ring);
+				if (block == 0)
+				{
+					// The decoder stopped early
+					result = Z_OK;
+					goto clean;
+				}
+			}
+		} while(stream.avail_out == 0);
+
+	} while(result != Z_STREAM_END);
+
+	if (result == Z_STREAM_END)
+		result = Z_OK;
+
+flush:
+	// What was inflated before an error is still decoded, like tracesequential does
+	if (block->size)
+		ring_post(job->ring);
+
+clean:
+	inflateEnd(&stream);
+	free(inbuffer);
+done:
+	job->result = result;
+	ring_close(job->ring);
+	return 0;
+}
+
+/*
+ * Inflates the trace on a separate thread, while the calling thread decodes the
+ * inflated blocks, so a run takes about as long as the slower of the two.
+ */
+static int tracepipelined(ramcontext* context, FILE* f)
+{
+	inflatejob job;
+	pthread_t thread;
+	ringblock* block;
+	int stopped = 0;
+
+	job.f = f;
+	job.result = Z_OK;
+	job.ring = ring_create(PIPELINEBLOCKS, PIPELINEBLOCKSIZE);
+	if (job.ring == 0)
+		return Z_MEM_ERROR;
+
+	if (0 != pthread_create(&thread, NULL, inflatethread, &job))
+	{
+		ring_destroy(job.ring);
+		return tracesequential(context, f);
+	}
+
+	while((block = ring_take(job.ring)) != 0)
+	{
+		if (0 == processbuffer(context, block->data, block->size))
+		{
+			stopped = 1;
+			ring_abort(job.ring);
+			break;
+		}
+		ring_release(job.ring);
+	}
+
+	pthread_join(thread, 0);
+	ring_destroy(job.ring);
+
+	return stopped? Z_OK : job.result;
+}
+
+static double benchtime()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / frequency.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static void benchreport(const char* stage, unsigned long long samplecount, double seconds)
+{
+	if (seconds <= 0)
+		seconds = 1e-9;
+
+	fprintf(stderr, "%-14s %12llu samples %9.3f s %14.0f samples/s %9.1f MB/s\n", stage, samplecount, seconds,
+			samplecount / seconds, samplecount * SAMPLESIZE / seconds / (1024 * 1024));
+}
+
+/*
+ * Times the decoding stages separately: inflating the trace, processbuffer on
+ * the inflated data in the chunks tracesequential hands it over in, and
+ * processsample on every whole sample. Unless pipelining is off, a whole
+ * pipelined run over the trace is timed last. The trace is inflated into
+ * memory first, up to BENCHMARK_MAXSIZE, so the later stages don't include
+ * inflating. The results go to stderr, so the decoder output can be thrown
+ * away.
+ */
+static int benchmark(ramcontext* context, FILE* f)
+{
+	unsigned int inbuffersize = 64 * 1024;
+	unsigned int chunksize = 64 * 1024;
+	unsigned char* inbuffer = 0;
+	unsigned char* tracebuffer = 0;
+	unsigned int tracesize = 0;
+	unsigned int tracecapacity = 0;
+	unsigned long long samplecount;
+	unsigned long long i;
+	unsigned int pos;
+	z_stream stream;
+	int result;
+	double start;
+
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+	result = inflateInit(&stream);
+    if (result != Z_OK)
+		return result;
+
+	inbuffer = malloc(inbuffersize);
+	tracecapacity = 64 * 1024 * 1024;
+	tracebuffer = malloc(tracecapacity);
+	if (inbuffer == 0 || tracebuffer == 0)
+	{
+		result = Z_MEM_ERROR;
+		goto clean;
+	}
+
+	start = benchtime();
+	do
+	{
+		stream.avail_in = fread(inbuffer, 1, inbuffersize, f);
+		stream.next_in = inbuffer;
+		if (stream.avail_in == 0)
+			break;
+
+		do
+		{
+			if (tracesize == tracecapacity)
+			{
+				unsigned char* newbuffer;
+
+				if (tracecapacity >= BENCHMARK_MAXSIZE)
+					break;
+
+				newbuffer = realloc(tracebuffer, tracecapacity * 2);
+				if (newbuffer == 0)
+				{
+					result = Z_MEM_ERROR;
+					goto clean;
+				}
+				tracebuffer = newbuffer;
+				tracecapacity *= 2;
+			}
+
+			stream.avail_out = tracecapacity - tracesize;
+			stream.next_out = tracebuffer + tracesize;
+
+			result = inflate(&stream, Z_NO_FLUSH);
+
+			switch(result)
+			{
+				case Z_NEED_DICT:
+					result = Z_DATA_ERROR;
+				case Z_DATA_ERROR:
+				case Z_MEM_ERROR:
+					goto clean;
+			}
+
+			tracesize = tracecapacity - stream.avail_out;
+		} while(stream.avail_out == 0);
+
+	} while(result != Z_STREAM_END && tracesize < BENCHMARK_MAXSIZE);
+
+	samplecount = tracesize / SAMPLESIZE;
+	benchreport("inflate", samplecount, benchtime() - start);
+
+	if (tracesize >= BENCHMARK_MAXSIZE)
+		fprintf(stderr, "Only the first %d MB of the trace are benchmarked.\n", BENCHMARK_MAXSIZE / (1024 * 1024));
+
+	resetcontext(context);
+	start = benchtime();
+	for(pos=0; pos<tracesize; pos+=chunksize)
+	{
+		unsigned int size = tracesize - pos;
+
+		if (size > chunksize)
+			size = chunksize;
+		if (0 == processbuffer(context, tracebuffer + pos, size))
+			break;
+	}
+	out_flush(&context->out);
+	if (context->events.f)
+		out_flush(&context->events);
+	benchreport("processbuffer", context->sampleindex, benchtime() - start);
+
+	// processsample works on the sample in place, so start over from a fresh copy
+	stream.avail_in = 0;
+	inflateReset(&stream);
+	fseek(f, 0, SEEK_SET);
+	tracesize = 0;
+	do
+	{
+		stream.avail_in = fread(inbuffer, 1, inbuffersize, f);
+		stream.next_in = inbuffer;
+		if (stream.avail_in == 0)
+			break;
+
+		stream.avail_out = tracecapacity - tracesize;
+		stream.next_out = tracebuffer + tracesize;
+		result = inflate(&stream, Z_NO_FLUSH);
+		tracesize = tracecapacity - stream.avail_out;
+	} while(result == Z_OK && stream.avail_out != 0);
+
+	resetcontext(context);
+	start = benchtime();
+	for(i=0; i<samplecount; i++)
+	{
+		if (0 == processsample(context, tracebuffer + i*SAMPLESIZE))
+			break;
+		context->sampleindex++;
+	}
+	out_flush(&context->out);
+	if (context->events.f)
+		out_flush(&context->events);
+	benchreport("processsample", context->sampleindex, benchtime() - start);
+
+	if (context->pipeline)
+	{
+		fseek(f, 0, SEEK_SET);
+		resetcontext(context);
+		start = benchtime();
+		result = tracepipelined(context, f);
+		out_flush(&context->out);
+		if (context->events.f)
+			out_flush(&context->events);
+		if (result != Z_OK)
+			goto clean;
+		benchreport("pipeline", context->sampleindex, benchtime() - start);
+	}
+
+	result = Z_OK;
+
+clean:
+	inflateEnd(&stream);
+	free(tracebuffer);
+	free(inbuffer);
+	return result;
+}
+
+static void decoder_initoptions(decoderoptions* options)
+{
+	options->fmem = 0;
+	options->fpages = 0;
+	options->addressbits = MEMORYBITS;
+	options->dobenchmark = 0;
+}
+
+/*
+ * Takes option 'c' with argument 'arg' when it's one every decoder has. Returns
+ * 1 when it was, 0 for the decoder's own options and --help, and -1 when the
+ * option can't be used.
+ */
+static int decoder_option(ramcontext* context, decoderoptions* options, int c, const char* arg)
+{
+	switch (c) 
+	{
+		case OPT_OUTPUT_MEMORY:
+			options->fmem = fopen(arg, "wb");
+			if (options->fmem == 0)
+				printf("error opening output file\n");
+		break;
+
+		case OPT_VERBOSE:
+			context->verbose |= VERBOSE_SDRAM | VERBOSE_READS | VERBOSE_WRITES | VERBOSE_VERIFY;
+		break;
+
+		case OPT_VERBOSE_SDRAM:
+			context->verbose |= VERBOSE_SDRAM;
+		break;
+
+		case OPT_VERBOSE_COMPACT:
+			context->verbose |= VERBOSE_COMPACT;
+		break;
+
+		case OPT_VERBOSE_READS:
+			context->verbose |= VERBOSE_READS;
+		break;
+
+		case OPT_VERBOSE_WRITES:
+			context->verbose |= VERBOSE_WRITES;
+		break;
+
+		case OPT_VERBOSE_ADDRESS:
+			context->verboseaddress = strtoul(arg, 0, 0);
+			context->verbose |= VERBOSE_ADDRESS;
+		break;
+
+		case OPT_VERBOSE_VERIFY:
+			context->verbose |= VERBOSE_VERIFY;
+		break;
+
+		case OPT_VERBOSE_LEQ:
+			context->verboseleq = strtoull(arg, 0, 0);
+			context->verbose |= VERBOSE_LEQ;
+		break;
+
+		case OPT_VERBOSE_GEQ:
+			context->verbosegeq = strtoull(arg, 0, 0);
+			context->verbose |= VERBOSE_GEQ;
+		break;
+
+		case OPT_STOP:
+			context->stopindex = strtoull(arg, 0, 0);
+		break;
+
+		case OPT_BENCHMARK:
+			options->dobenchmark = 1;
+		break;
+
+		case OPT_EVENTS:
+			if (context->events.f == 0)
+			{
+				FILE* fevents = fopen(arg, "wb");
+
+				if (fevents == 0)
+				{
+					printf("error opening events file\n");
+					return -1;
+				}
+				out_init(&context->events, fevents, OUTBUFFERSIZE);
+			}
+			context->verbose |= VERBOSE_EVENTS;
+		break;
+
+		case OPT_NO_PIPELINE:
+			context->pipeline = 0;
+		break;
+
+		case OPT_OUTPUT_PAGES:
+			options->fpages = fopen(arg, "wb");
+			if (options->fpages == 0)
+				printf("error opening output file\n");
+		break;
+
+		case OPT_ADDRESS_BITS:
+			options->addressbits = strtoul(arg, 0, 0);
+			if (options->addressbits < MEMORYMINBITS || options->addressbits > MEMORYMAXBITS)
+			{
+				printf("error address bits must be %d to %d\n", MEMORYMINBITS, MEMORYMAXBITS);
+				return -1;
+			}
+		break;
+
+		case OPT_WATCH:
+			if (watch_load(&context->watch, arg) != 0)
+				return -1;
+		break;
+
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Writes the memory contents asked for once the trace is decoded.
+ */
+static int decoder_writememory(ramcontext* context, decoderoptions* options)
+{
+	if (options->fmem)
+	{
+		if (0 != mem_writeimage(&context->memory, options->fmem))
+		{
+			printf("error writing memory file\n");
+			return -1;
+		}
+	}
+
+	if (options->fpages)
+	{
+		if (0 != mem_writepages(&context->memory, options->fpages))
+		{
+			printf("error writing memory pages file\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void decoder_closeoptions(decoderoptions* options)
+{
+	if (options->fmem)
+		fclose(options->fmem);
+	if (options->fpages)
+		fclose(options->fpages);
+}
+
+#endif // __DECODERSTREAM_H_
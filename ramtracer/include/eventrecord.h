@@ -0,0 +1,28 @@
+/*
+ * eventrecord.h - Binary event records the decoders write with --events
+ */
+
+#ifndef __EVENTRECORD_H_
+#define __EVENTRECORD_H_
+
+/*
+ * Every read and write is a fixed EVENTSIZE record, little-endian:
+ *   0  le64  sample index
+ *   8  u8    type, EVENT_WRITE, EVENT_READ or EVENT_GAP
+ *   9  u8    byte mask, bit i set when data byte i wasn't written
+ *  10  le16  reserved, 0
+ *  12  le32  byte address of data byte 0 (the gap number for EVENT_GAP)
+ *  16  u8[8] data
+ */
+#define EVENTSIZE 24
+#define EVENTOFFSET_SAMPLE 0
+#define EVENTOFFSET_TYPE 8
+#define EVENTOFFSET_MASK 9
+#define EVENTOFFSET_ADDRESS 12
+#define EVENTOFFSET_DATA 16
+
+#define EVENT_WRITE 0
+#define EVENT_READ 1
+#define EVENT_GAP 0xFE
+
+#endif // __EVENTRECORD_H_
@@ -0,0 +1,274 @@
+/*
+ * outbuffer.h - Buffered decoder output, text formatting and event records
+ */
+
+#ifndef __OUTBUFFER_H_
+#define __OUTBUFFER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "blockring.h"
+#include "eventrecord.h"
+
+// Decoded output is collected in a buffer of this size before it's written
+#define OUTBUFFERSIZE (4 * 1024 * 1024)
+// Longest line formatted at once
+#define OUTLINEMAX 512
+
+// Formatted output buffers queued for the writer thread
+#define WRITERBLOCKS 4
+
+/*
+ * Output buffer. Decoded text and event records are formatted straight into a
+ * large buffer, which is written out when full, instead of going through printf
+ * for every field. After out_startwriter the full buffers are written by a
+ * separate thread, so decoding goes on while the output is written.
+ */
+typedef struct
+{
+	FILE* f;
+	char* buffer;
+	unsigned int size;
+	unsigned int capacity;
+	blockring* writerring;
+	ringblock* writerblock;
+	pthread_t writerthread;
+} outbuffer;
+
+static void out_init(outbuffer* out, FILE* f, unsigned int capacity)
+{
+	out->f = f;
+	out->size = 0;
+	out->capacity = capacity;
+	out->buffer = malloc(capacity);
+	out->writerring = 0;
+	out->writerblock = 0;
+}
+
+static void* out_writerthread(void* arg)
+{
+	outbuffer* out = arg;
+	ringblock* block;
+
+	while((block = ring_take(out->writerring)) != 0)
+	{
+		fwrite(block->data, 1, block->size, out->f);
+		ring_release(out->writerring);
+	}
+
+	return 0;
+}
+
+/*
+ * Hands the buffered output to the writer thread, or writes it directly when
+ * there's none.
+ */
+static void out_write(outbuffer* out)
+{
+	if (out->writerring)
+	{
+		if (out->size == 0)
+			return;
+
+		out->writerblock->size = out->size;
+		ring_post(out->writerring);
+		out->writerblock = ring_acquire(out->writerring);
+		out->buffer = (char*)out->writerblock->data;
+	}
+	else if (out->size)
+	{
+		fwrite(out->buffer, 1, out->size, out->f);
+	}
+	out->size = 0;
+}
+
+static void out_startwriter(outbuffer* out)
+{
+	blockring* ring = ring_create(WRITERBLOCKS, out->capacity);
+
+	// Without a writer thread the output is simply written on the calling thread
+	if (ring == 0)
+		return;
+
+	out_write(out);
+	out->writerring = ring;
+	if (0 != pthread_create(&out->writerthread, NULL, out_writerthread, out))
+	{
+		out->writerring = 0;
+		ring_destroy(ring);
+		return;
+	}
+
+	free(out->buffer);
+	out->writerblock = ring_acquire(ring);
+	out->buffer = (char*)out->writerblock->data;
+}
+
+static void out_flush(outbuffer* out)
+{
+	out_write(out);
+	if (out->writerring)
+		ring_drain(out->writerring);
+	fflush(out->f);
+}
+
+static void out_destroy(outbuffer* out)
+{
+	if (out->writerring)
+	{
+		out_write(out);
+		ring_close(out->writerring);
+		pthread_join(out->writerthread, 0);
+		ring_destroy(out->writerring);
+		out->writerring = 0;
+		out->buffer = 0;
+		fflush(out->f);
+	}
+	else if (out->f)
+	{
+		out_flush(out);
+	}
+	free(out->buffer);
+	out->buffer = 0;
+}
+
+/*
+ * Returns where to format up to 'size' bytes. out_commit is then called with the
+ * end of what was formatted.
+ */
+static char* out_reserve(outbuffer* out, unsigned int size)
+{
+	if (out->capacity - out->size < size)
+		out_write(out);
+	return out->buffer + out->size;
+}
+
+static void out_commit(outbuffer* out, char* end)
+{
+	out->size = end - out->buffer;
+}
+
+static void out_printf(outbuffer* out, const char* format, ...)
+{
+	char* p = out_reserve(out, OUTLINEMAX);
+	va_list args;
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(p, OUTLINEMAX, format, args);
+	va_end(args);
+
+	if (length > 0)
+		out_commit(out, p + (length < OUTLINEMAX ? length : OUTLINEMAX - 1));
+}
+
+
+/*
+ * Appends everything in file 'f' to the output.
+ */
+static void out_append(outbuffer* out, FILE* f)
+{
+	char* p;
+	unsigned int size;
+
+	rewind(f);
+	do
+	{
+		p = out_reserve(out, out->capacity);
+		size = fread(p, 1, out->capacity - out->size, f);
+		out_commit(out, p + size);
+	} while(size);
+}
+
+static const char hexupper[] = "0123456789ABCDEF";
+static const char hexlower[] = "0123456789abcdef";
+
+static char* fmt_str(char* p, const char* s)
+{
+	while(*s)
+		*p++ = *s++;
+	return p;
+}
+
+static char* fmt_hex(char* p, unsigned long long value, unsigned int digits, const char* hex)
+{
+	unsigned int i;
+
+	for(i=0; i<digits; i++)
+		p[i] = hex[(value >> ((digits-1-i)*4)) & 0xF];
+	return p + digits;
+}
+
+// Bits 'high' down to 'high'-'count'+1 of 'value', as 0 and 1
+static char* fmt_bits(char* p, unsigned int value, unsigned int high, unsigned int count)
+{
+	unsigned int i;
+
+	for(i=0; i<count; i++)
+		*p++ = '0' + ((value >> (high-i)) & 1);
+	return p;
+}
+
+// Same as printf(" %8llu", value), which for indices below 2^31 is "% 9d"
+static char* fmt_index(char* p, unsigned long long value)
+{
+	char digits[20];
+	unsigned int count = 0;
+	unsigned int width;
+
+	do
+	{
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while(value);
+
+	*p++ = ' ';
+	for(width = count; width < 8; width++)
+		*p++ = ' ';
+	while(count)
+		*p++ = digits[--count];
+	return p;
+}
+
+// The 8 data bytes, as "XX.XX.XX.XX.XX.XX.XX.XX"
+static char* fmt_data(char* p, unsigned char* data)
+{
+	unsigned int i;
+
+	for(i=0; i<8; i++)
+	{
+		if (i != 0)
+			*p++ = '.';
+		*p++ = hexupper[data[i] >> 4];
+		*p++ = hexupper[data[i] & 0xF];
+	}
+	return p;
+}
+
+/*
+ * Binary event output, one record per read, write or gap as laid out in
+ * eventrecord.h.
+ */
+static void out_event(outbuffer* out, unsigned long long sampleindex, unsigned int type, unsigned int address, unsigned int mask, unsigned char* data)
+{
+	unsigned char* p = (unsigned char*)out_reserve(out, EVENTSIZE);
+	unsigned int i;
+
+	for(i=0; i<8; i++)
+		p[EVENTOFFSET_SAMPLE + i] = sampleindex >> (i*8);
+	p[EVENTOFFSET_TYPE] = type;
+	p[EVENTOFFSET_MASK] = mask;
+	p[10] = 0;
+	p[11] = 0;
+	for(i=0; i<4; i++)
+		p[EVENTOFFSET_ADDRESS + i] = address >> (i*8);
+	if (data)
+		memcpy(p + EVENTOFFSET_DATA, data, 8);
+	else
+		memset(p + EVENTOFFSET_DATA, 0, 8);
+	out_commit(out, (char*)p + EVENTSIZE);
+}
+
+#endif // __OUTBUFFER_H_
@@ -0,0 +1,220 @@
+/*
+ * rammemory.h - Sparse memory image the decoders replay writes into
+ */
+
+#ifndef __RAMMEMORY_H_
+#define __RAMMEMORY_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Memory image, 128 MB unless --address-bits says otherwise
+#define MEMORYBITS 27
+#define MEMORYMINBITS 16
+#define MEMORYMAXBITS 32
+#define MEMORYPAGESHIFT 12
+#define MEMORYPAGESIZE (1<<MEMORYPAGESHIFT)
+
+
+/*
+ * Sparse memory image. Pages are allocated when first written, each with a
+ * bitmap of the bytes that were ever written, so untouched memory costs
+ * nothing and can be told apart from memory that was written with zeroes.
+ * Addresses beyond the configured size wrap around, like on a smaller part.
+ * Data is always accessed as aligned 8 byte words, as it's traced.
+ */
+typedef struct
+{
+	unsigned char data[MEMORYPAGESIZE];
+	unsigned char written[MEMORYPAGESIZE / 8];
+} memorypage;
+
+typedef struct
+{
+	unsigned int addressbits;
+	unsigned int addressmask;
+	unsigned int pagecount;
+	memorypage** pages;
+} rammemory;
+
+static int mem_init(rammemory* mem, unsigned int addressbits)
+{
+	mem->addressbits = addressbits;
+	mem->addressmask = (unsigned int)(((unsigned long long)1 << addressbits) - 1);
+	mem->pagecount = 1 << (addressbits - MEMORYPAGESHIFT);
+	mem->pages = calloc(mem->pagecount, sizeof(memorypage*));
+	return (mem->pages == 0)? -1 : 0;
+}
+
+static void mem_destroy(rammemory* mem)
+{
+	unsigned int i;
+
+	if (mem->pages == 0)
+		return;
+
+	for(i=0; i<mem->pagecount; i++)
+		free(mem->pages[i]);
+	free(mem->pages);
+	mem->pages = 0;
+}
+
+static memorypage* mem_page(rammemory* mem, unsigned int pageindex)
+{
+	memorypage* page = mem->pages[pageindex];
+
+	if (page == 0)
+	{
+		page = calloc(1, sizeof(memorypage));
+		if (page == 0)
+		{
+			printf("error allocating RAM memory\n");
+			exit(1);
+		}
+		mem->pages[pageindex] = page;
+	}
+
+	return page;
+}
+
+/*
+ * Expands the 8 bit byte mask 'mask' to a word with 0xFF in the bytes whose bit
+ * is set, without branches: each bit is moved to the top of its own byte, and
+ * from there smeared over the byte. Words are loaded as they are in memory, so
+ * this relies on a little-endian host, like the trace formats.
+ */
+static unsigned long long mem_bytemask(unsigned int mask)
+{
+	unsigned long long bits = ((mask & 0xFF) * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+
+	bits = (bits + 0x7F7F7F7F7F7F7F7FULL) & 0x8080808080808080ULL;
+	return (bits >> 7) * 0xFF;
+}
+
+/*
+ * Writes the bytes of the word at 'address' whose bit in 'mask' is clear.
+ */
+static void mem_write(rammemory* mem, unsigned int address, unsigned char* data, unsigned int mask)
+{
+	memorypage* page;
+	unsigned int offset;
+	unsigned long long keep = mem_bytemask(mask);
+	unsigned long long word;
+	unsigned long long value;
+
+	address &= mem->addressmask;
+	page = mem_page(mem, address >> MEMORYPAGESHIFT);
+	offset = address & (MEMORYPAGESIZE - 1);
+
+	memcpy(&word, page->data + offset, 8);
+	memcpy(&value, data, 8);
+	word = (word & keep) | (value & ~keep);
+	memcpy(page->data + offset, &word, 8);
+	page->written[offset >> 3] |= ~mask & 0xFF;
+}
+
+/*
+ * Reads the word at 'address', returning a mask of the bytes that were ever
+ * written. Bytes never written read as zero.
+ */
+static unsigned int mem_read(rammemory* mem, unsigned int address, unsigned char* data)
+{
+	memorypage* page;
+	unsigned int offset;
+
+	address &= mem->addressmask;
+	page = mem->pages[address >> MEMORYPAGESHIFT];
+	offset = address & (MEMORYPAGESIZE - 1);
+
+	if (page == 0)
+	{
+		memset(data, 0, 8);
+		return 0;
+	}
+
+	memcpy(data, page->data + offset, 8);
+	return page->written[offset >> 3];
+}
+
+/*
+ * Returns whether 'data' read from 'address' differs from what was written
+ * there, with the memory contents in 'expected'. Bytes never written can't
+ * differ.
+ */
+static int mem_verify(rammemory* mem, unsigned int address, unsigned char* data, unsigned char* expected)
+{
+	unsigned int written = mem_read(mem, address, expected);
+	unsigned long long word;
+	unsigned long long value;
+
+	memcpy(&word, expected, 8);
+	memcpy(&value, data, 8);
+	return ((word ^ value) & mem_bytemask(written)) != 0;
+}
+
+static int seekfile(FILE* f, unsigned long long offset)
+{
+#ifdef _WIN32
+	return _fseeki64(f, offset, SEEK_SET);
+#else
+	return fseeko(f, offset, SEEK_SET);
+#endif
+}
+
+/*
+ * Writes the whole memory image, skipping over pages never written so they
+ * become holes in the file where the file system supports it.
+ */
+static int mem_writeimage(rammemory* mem, FILE* f)
+{
+	unsigned long long size = (unsigned long long)mem->pagecount << MEMORYPAGESHIFT;
+	unsigned int i;
+
+	for(i=0; i<mem->pagecount; i++)
+	{
+		if (mem->pages[i] == 0)
+			continue;
+		if (0 != seekfile(f, (unsigned long long)i << MEMORYPAGESHIFT))
+			return -1;
+		if (fwrite(mem->pages[i]->data, MEMORYPAGESIZE, 1, f) != 1)
+			return -1;
+	}
+
+	// Give the file its full size when it ends in unwritten memory
+	if (mem->pages[mem->pagecount - 1] == 0)
+	{
+		if (0 != seekfile(f, size - 1) || fputc(0, f) == EOF)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes only the pages written to, each as its le32 byte address, the page
+ * data and the bitmap of written bytes, bit (i & 7) of byte (i >> 3) for data
+ * byte i.
+ */
+static int mem_writepages(rammemory* mem, FILE* f)
+{
+	unsigned char address[4];
+	unsigned int i;
+
+	for(i=0; i<mem->pagecount; i++)
+	{
+		if (mem->pages[i] == 0)
+			continue;
+
+		address[0] = i << MEMORYPAGESHIFT;
+		address[1] = (i << MEMORYPAGESHIFT) >> 8;
+		address[2] = (i << MEMORYPAGESHIFT) >> 16;
+		address[3] = (i << MEMORYPAGESHIFT) >> 24;
+		if (fwrite(address, 4, 1, f) != 1 || fwrite(mem->pages[i], sizeof(memorypage), 1, f) != 1)
+			return -1;
+	}
+
+	return 0;
+}
+
+#endif // __RAMMEMORY_H_
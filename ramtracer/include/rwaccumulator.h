@@ -0,0 +1,167 @@
+/*
+ * rwaccumulator.h - Merges consecutive accesses for the compact output
+ */
+
+#ifndef __RWACCUMULATOR_H_
+#define __RWACCUMULATOR_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include "outbuffer.h"
+#include "sdram.h"
+
+typedef struct
+{
+	unsigned int type;
+	unsigned int curaddress;
+	unsigned int orgaddress;
+	unsigned int size;
+	unsigned int capacity;
+	unsigned char* buffer;
+} rwaccumulator;
+
+static void rwacc_init(rwaccumulator* acc)
+{
+	acc->type = ~0;
+	acc->curaddress = 0;
+	acc->orgaddress = 0;
+	acc->size = 0;
+	acc->capacity = 0;
+	acc->buffer = 0;
+}
+
+static void rwacc_destroy(rwaccumulator* acc)
+{
+	free(acc->buffer);
+}
+
+static int rwacc_sametransaction(rwaccumulator* acc, unsigned int type, unsigned int address)
+{
+	return (acc->type == type && address == acc->curaddress);
+}
+
+#define DUMPWIDTH 32
+static char* rwacc_fmtascii(char* p, unsigned char* data, unsigned int count, unsigned long long sampleindex)
+{
+	unsigned int digits = 8;
+	unsigned int j;
+
+	p = fmt_str(p, "  ");
+	for(j=0; j<count; j++)
+	{
+		if (data[j] >= 0x20 && data[j] <= 0x7e)
+			*p++ = data[j];
+		else
+			*p++ = '.';
+	}
+	p = fmt_str(p, "  ");
+	// At least 8 digits, more once the index doesn't fit them
+	while(digits < 16 && (sampleindex >> (digits*4)))
+		digits++;
+	p = fmt_hex(p, sampleindex, digits, hexlower);
+	*p++ = '\n';
+	return p;
+}
+static void rwacc_dump(rwaccumulator* acc, outbuffer* out, unsigned long long sampleindex)
+{
+	unsigned int i,j;
+	unsigned char data[DUMPWIDTH];
+	unsigned int x = 0;
+	unsigned int address = acc->orgaddress;
+	char* p = 0;
+
+	if (acc->size == 0)
+		return;
+
+
+
+	for(i=0; i<acc->size; i++)
+	{
+		if (x == 0)
+		{
+			p = out_reserve(out, OUTLINEMAX);
+			if (acc->type == READ)
+				p = fmt_str(p, "RD ");
+			else if (acc->type == WRITE)
+				p = fmt_str(p, "WR ");
+			p = fmt_hex(p, address, 8, hexupper);
+		}
+		
+		data[x] = acc->buffer[i];
+		address++;
+		*p++ = ' ';
+		p = fmt_hex(p, data[x], 2, hexupper);
+		x++;
+		if (x >= DUMPWIDTH)
+		{
+			p = rwacc_fmtascii(p, data, DUMPWIDTH, sampleindex);
+			out_commit(out, p);
+			x = 0;
+		}
+	}
+
+	if (x)
+	{
+		for(j=x; j<DUMPWIDTH; j++)
+			p = fmt_str(p, "   ");
+		p = rwacc_fmtascii(p, data, x, sampleindex);
+		out_commit(out, p);
+	}
+}
+
+static void rwacc_settransaction(rwaccumulator* acc, unsigned int type, unsigned int address)
+{
+	acc->type = type;
+	acc->orgaddress = address;
+	acc->curaddress = address;
+	acc->size = 0;
+}
+
+static void rwacc_addbuffer(rwaccumulator* acc, unsigned char* buffer, unsigned int size)
+{
+	unsigned int available = acc->capacity - acc->size;
+	
+
+	if (available < size)
+	{
+		unsigned char* newbuffer = 0;
+		unsigned int newcapacity = acc->capacity * 2;
+
+		if (newcapacity <= 0)
+			newcapacity = 2;
+
+		while( (newcapacity - acc->size) < size )
+			newcapacity *= 2;
+
+		
+		newbuffer = malloc(newcapacity);
+
+		if (acc->buffer)
+		{
+			memcpy(newbuffer, acc->buffer, acc->capacity);
+
+			free(acc->buffer);
+		}
+
+		acc->capacity = newcapacity;
+		acc->buffer = newbuffer;
+	}
+
+	memcpy(acc->buffer + acc->size, buffer, size);
+
+	acc->size += size;
+	acc->curaddress += size;
+}
+
+static void rwacc_addsample(rwaccumulator* acc, outbuffer* out, unsigned long long sampleindex, unsigned int type, unsigned int address, unsigned char* data, unsigned int size)
+{
+	if (!rwacc_sametransaction(acc, type, address))
+	{
+		rwacc_dump(acc, out, sampleindex);
+		rwacc_settransaction(acc, type, address);
+	}
+
+	rwacc_addbuffer(acc, data, size);
+}
+
+#endif // __RWACCUMULATOR_H_
@@ -0,0 +1,38 @@
+/*
+ * sdram.h - SDRAM commands and decoder states
+ */
+
+#ifndef __SDRAM_H_
+#define __SDRAM_H_
+
+
+typedef struct
+{
+	unsigned int active;
+	unsigned int row;
+	unsigned int column;
+	unsigned int bank;
+	unsigned int cs;
+	unsigned int address;
+} entryrwqueue;
+
+typedef enum commands
+{
+	UNKNOWN = 0,
+	NOP,
+	MSR,
+	ACTIVATE,
+	PRECHARGE,
+	WRITE,
+	BST,
+	READ
+};
+
+typedef enum states
+{
+	IDLING,
+	READING,
+	WRITING,
+};
+
+#endif // __SDRAM_H_
@@ -0,0 +1,386 @@
+/*
+ * watchlist.h - Address ranges the decoders report the accesses to
+ */
+
+#ifndef __WATCHLIST_H_
+#define __WATCHLIST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "outbuffer.h"
+#include "rammemory.h"
+#include "sdram.h"
+
+#define WATCH_READS (1<<0)
+#define WATCH_WRITES (1<<1)
+
+// What an access to a watched range must do to be reported
+#define WATCH_ANY 0
+#define WATCH_EQUALS 1
+#define WATCH_CHANGED 2
+#define WATCH_BITSET 3
+
+// Pages of the watch bitmap, so most accesses are turned down with one lookup
+#define WATCHPAGESHIFT 12
+#define WATCHPAGECOUNT (1 << (32 - WATCHPAGESHIFT))
+
+#define WATCHLINEMAX 256
+
+// Deepest the range tree gets, one level per bit of the range count
+#define WATCHTREEDEPTH 32
+
+/*
+ * A byte range 'start' up to 'end'. A range with a predicate is the value
+ * stored in it, 1, 2, 4 or 8 bytes little-endian within one word, and 'value'
+ * is what it's compared to, or the bit number for WATCH_BITSET.
+ */
+typedef struct
+{
+	unsigned long long start;
+	unsigned long long end;
+	unsigned long long value;
+	unsigned int line;
+	unsigned int types;
+	unsigned int predicate;
+} watchrange;
+
+/*
+ * Ranges sorted by start, taken as a balanced binary tree: the middle range of
+ * any span is the parent of the middle ranges of the halves on either side of
+ * it. 'maxend' holds the highest end in the subtree of each range, so a lookup
+ * skips every subtree ending before the address, and takes time logarithmic in
+ * the number of ranges plus the ranges found, wide ones included. 'pages' has
+ * a bit set for every 4 KB page any range touches.
+ */
+typedef struct
+{
+	watchrange* ranges;
+	unsigned long long* maxend;
+	unsigned int count;
+	unsigned char* pages;
+} watchlist;
+
+static int watch_compare(const void* a, const void* b)
+{
+	const watchrange* ra = a;
+	const watchrange* rb = b;
+
+	if (ra->start != rb->start)
+		return (ra->start < rb->start)? -1 : 1;
+	return (ra->line < rb->line)? -1 : (ra->line > rb->line);
+}
+
+/*
+ * Fills in 'maxend' for the subtree of the ranges 'low' up to 'high', returning
+ * the highest end in it.
+ */
+static unsigned long long watch_build(watchlist* list, unsigned int low, unsigned int high)
+{
+	unsigned int middle = low + (high - low) / 2;
+	unsigned long long maxend;
+	unsigned long long end;
+
+	if (low >= high)
+		return 0;
+
+	maxend = list->ranges[middle].end;
+	end = watch_build(list, low, middle);
+	if (end > maxend)
+		maxend = end;
+	end = watch_build(list, middle + 1, high);
+	if (end > maxend)
+		maxend = end;
+
+	list->maxend[middle] = maxend;
+	return maxend;
+}
+
+/*
+ * Parses one line of a watch file into 'range': a byte address, optionally
+ * followed by "-end" (exclusive) or "+size", then any of "read", "write" and
+ * one predicate, "=value", "changed" or "bit=n". Returns 0 for a blank line or
+ * a comment, 1 for a range and -1 when it can't be parsed.
+ */
+static int watch_parse(watchrange* range, char* line)
+{
+	char* p = line;
+	char* end;
+	char* word;
+	unsigned long long size;
+
+	while(*p == ' ' || *p == '\t')
+		p++;
+	if (*p == '#' || *p == '\r' || *p == '\n' || *p == 0)
+		return 0;
+
+	range->start = strtoull(p, &end, 0);
+	if (end == p || range->start > 0xFFFFFFFFULL)
+		return -1;
+	p = end;
+
+	range->end = range->start + 1;
+	if (*p == '-' || *p == '+')
+	{
+		unsigned long long value = strtoull(p + 1, &end, 0);
+
+		if (end == p + 1)
+			return -1;
+		range->end = (*p == '-')? value : range->start + value;
+		p = end;
+	}
+	if (range->end <= range->start || range->end > 0x100000000ULL)
+		return -1;
+
+	range->types = 0;
+	range->predicate = WATCH_ANY;
+	range->value = 0;
+
+	for(word = strtok(p, " \t\r\n"); word; word = strtok(0, " \t\r\n"))
+	{
+		if (strcmp(word, "read") == 0)
+			range->types |= WATCH_READS;
+		else if (strcmp(word, "write") == 0)
+			range->types |= WATCH_WRITES;
+		else if (range->predicate != WATCH_ANY)
+			return -1;
+		else if (strcmp(word, "changed") == 0)
+			range->predicate = WATCH_CHANGED;
+		else if (word[0] == '=')
+		{
+			range->predicate = WATCH_EQUALS;
+			range->value = strtoull(word + 1, &end, 0);
+			if (end == word + 1 || *end)
+				return -1;
+		}
+		else if (strncmp(word, "bit=", 4) == 0)
+		{
+			range->predicate = WATCH_BITSET;
+			range->value = strtoull(word + 4, &end, 0);
+			if (end == word + 4 || *end)
+				return -1;
+		}
+		else
+			return -1;
+	}
+
+	if (range->types == 0)
+		range->types = WATCH_READS | WATCH_WRITES;
+
+	if (range->predicate != WATCH_ANY)
+	{
+		size = range->end - range->start;
+		if (size != 1 && size != 2 && size != 4 && size != 8)
+			return -1;
+		if ((range->start & 7) + size > 8)
+			return -1;
+		if (range->predicate == WATCH_EQUALS && size < 8 && (range->value >> (size * 8)))
+			return -1;
+		if (range->predicate == WATCH_BITSET && range->value >= size * 8)
+			return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Reads the watch file 'fname', adding its ranges to 'list'.
+ */
+static int watch_load(watchlist* list, const char* fname)
+{
+	FILE* f = fopen(fname, "r");
+	char line[WATCHLINEMAX];
+	unsigned int linenumber = 0;
+	unsigned int i;
+	unsigned long long page;
+	int result;
+
+	if (f == 0)
+	{
+		printf("error opening watch file\n");
+		return -1;
+	}
+
+	if (list->pages == 0)
+		list->pages = calloc(WATCHPAGECOUNT / 8, 1);
+	if (list->pages == 0)
+		goto nomemory;
+
+	while(fgets(line, sizeof(line), f))
+	{
+		watchrange* ranges;
+
+		linenumber++;
+		ranges = realloc(list->ranges, (list->count + 1) * sizeof(watchrange));
+		if (ranges == 0)
+			goto nomemory;
+		list->ranges = ranges;
+
+		result = watch_parse(&list->ranges[list->count], line);
+		if (result < 0)
+		{
+			printf("error in watch file line %d\n", linenumber);
+			fclose(f);
+			return -1;
+		}
+		if (result == 0)
+			continue;
+
+		list->ranges[list->count].line = linenumber;
+		list->count++;
+	}
+	fclose(f);
+
+	qsort(list->ranges, list->count, sizeof(watchrange), watch_compare);
+
+	free(list->maxend);
+	list->maxend = malloc((list->count + 1) * sizeof(unsigned long long));
+	if (list->maxend == 0)
+		return -1;
+
+	watch_build(list, 0, list->count);
+
+	for(i=0; i<list->count; i++)
+	{
+		watchrange* range = &list->ranges[i];
+
+		for(page = range->start >> WATCHPAGESHIFT; page <= (range->end - 1) >> WATCHPAGESHIFT; page++)
+			list->pages[page >> 3] |= 1 << (page & 7);
+	}
+
+	return 0;
+
+nomemory:
+	printf("error allocating watch list\n");
+	fclose(f);
+	return -1;
+}
+
+static void watch_destroy(watchlist* list)
+{
+	free(list->ranges);
+	free(list->maxend);
+	free(list->pages);
+	memset(list, 0, sizeof(watchlist));
+}
+
+// Whether any range touches the page of the word at 'address'
+static int watch_page(watchlist* list, unsigned int address)
+{
+	unsigned int page = address >> WATCHPAGESHIFT;
+
+	return list->count && (list->pages[page >> 3] & (1 << (page & 7)));
+}
+
+// The value of the range with a predicate, out of the word at 'address'
+static unsigned long long watch_value(watchrange* range, unsigned int address, unsigned char* data)
+{
+	unsigned int offset = (unsigned int)(range->start - address);
+	unsigned int i = (unsigned int)(range->end - range->start);
+	unsigned long long value = 0;
+
+	while(i--)
+		value = (value << 8) | data[offset + i];
+	return value;
+}
+
+/*
+ * Reports the ranges hit by a read or write 'type' of the word at byte address
+ * 'address' in sample 'sampleindex'. Must be called before a write goes into
+ * 'mem', so what changes can be seen. Bytes of a write whose bit in 'mask' is
+ * set weren't written, and don't hit anything.
+ */
+static void watch_access(watchlist* list, rammemory* mem, outbuffer* out, unsigned long long sampleindex, unsigned int type, unsigned int address, unsigned char* data, unsigned int mask)
+{
+	unsigned int types = (type == READ)? WATCH_READS : WATCH_WRITES;
+	unsigned int written = (type == READ)? 0xFF : (~mask & 0xFF);
+	unsigned char before[8];
+	unsigned char after[8];
+	unsigned int haveold = 0;
+	unsigned int stack[WATCHTREEDEPTH][2];
+	unsigned int depth = 0;
+	unsigned int low = 0;
+	unsigned int high = list->count;
+	char* p;
+
+	if (!watch_page(list, address))
+		return;
+
+	// In order through the tree, leaving out the subtrees that end too early
+	while(1)
+	{
+		watchrange* range;
+		unsigned int middle;
+		unsigned long long first;
+		unsigned long long last;
+		unsigned int bytes;
+		unsigned long long value;
+
+		while(low < high && list->maxend[low + (high - low) / 2] > address)
+		{
+			stack[depth][0] = low;
+			stack[depth][1] = high;
+			depth++;
+			high = low + (high - low) / 2;
+		}
+
+		if (depth == 0)
+			break;
+		depth--;
+		low = stack[depth][0];
+		high = stack[depth][1];
+		middle = low + (high - low) / 2;
+		low = middle + 1;
+
+		// The ones after it start past the word
+		range = &list->ranges[middle];
+		if (range->start >= (unsigned long long)address + 8)
+			break;
+
+		first = (range->start > address)? range->start : address;
+		last = (range->end < (unsigned long long)address + 8)? range->end : (unsigned long long)address + 8;
+
+		if (range->end <= address || (range->types & types) == 0)
+			continue;
+
+		bytes = ((1 << (last - first)) - 1) << (first - address);
+		if ((bytes & written) == 0)
+			continue;
+
+		if (range->predicate != WATCH_ANY)
+		{
+			if (type == WRITE && !haveold)
+			{
+				unsigned long long keep = mem_bytemask(mask);
+				unsigned long long oldword;
+				unsigned long long newword;
+
+				mem_read(mem, address, before);
+				memcpy(&oldword, before, 8);
+				memcpy(&newword, data, 8);
+				newword = (oldword & keep) | (newword & ~keep);
+				memcpy(after, &newword, 8);
+				haveold = 1;
+			}
+
+			value = watch_value(range, address, (type == WRITE)? after : data);
+
+			if (range->predicate == WATCH_EQUALS && value != range->value)
+				continue;
+			if (range->predicate == WATCH_BITSET && ((value >> range->value) & 1) == 0)
+				continue;
+			if (range->predicate == WATCH_CHANGED && (type != WRITE || value == watch_value(range, address, before)))
+				continue;
+		}
+
+		out_printf(out, " %8llu: WATCH %d %s %08x ", sampleindex, range->line, (type == READ)? "READ" : "WRITE", address);
+		p = out_reserve(out, OUTLINEMAX);
+		p = fmt_data(p, data);
+		p = fmt_str(p, " mask=");
+		p = fmt_bits(p, mask, 7, 8);
+		*p++ = '\n';
+		out_commit(out, p);
+	}
+}
+
+#endif // __WATCHLIST_H_
@@ -0,0 +1,683 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "eventrecord.h"
+
+// Index file, see buildindex
+#define INDEXMAGIC 0x494D5452
+#define INDEXVERSION 1
+#define INDEXHEADERSIZE 48
+#define LINESIZE 8
+#define LINEENTRYSIZE 16
+#define WRITEENTRYSIZE 24
+
+// Per line counters are kept in pages allocated on demand, covering 32 bit byte addresses
+#define COUNTPAGESHIFT 12
+#define COUNTPAGESIZE (1<<COUNTPAGESHIFT)
+#define COUNTPAGES ((0x100000000ULL / LINESIZE) >> COUNTPAGESHIFT)
+
+#define DUMPWIDTH 16
+
+typedef struct
+{
+	unsigned char* data;
+	unsigned long long size;
+	unsigned long long linecount;
+	unsigned long long writecount;
+	unsigned char* lines;
+	unsigned char* writes;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} memindex;
+
+unsigned int getle32(const unsigned char* p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24);
+}
+
+unsigned long long getle64(const unsigned char* p)
+{
+	return getle32(p) | ((unsigned long long)getle32(p + 4) << 32);
+}
+
+void putle32(unsigned char* p, unsigned int value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+void putle64(unsigned char* p, unsigned long long value)
+{
+	putle32(p, (unsigned int)value);
+	putle32(p + 4, (unsigned int)(value >> 32));
+}
+
+/*
+ * Reads every write event of the events file, calling 'handler' for each.
+ */
+int forwrites(FILE* f, void (*handler)(void* arg, unsigned char* event), void* arg)
+{
+	unsigned char* buffer = malloc(EVENTSIZE * 4096);
+	unsigned int count;
+	unsigned int i;
+
+	if (buffer == 0)
+		return -1;
+
+	rewind(f);
+	while((count = fread(buffer, EVENTSIZE, 4096, f)) != 0)
+	{
+		for(i=0; i<count; i++)
+		{
+			if (buffer[i*EVENTSIZE + EVENTOFFSET_TYPE] == EVENT_WRITE)
+				handler(arg, buffer + i*EVENTSIZE);
+		}
+	}
+
+	free(buffer);
+	return ferror(f)? -1 : 0;
+}
+
+typedef struct
+{
+	unsigned long long** counts;
+	unsigned long long writecount;
+	unsigned char* writes;
+	int error;
+} indexbuilder;
+
+unsigned long long* builder_counter(indexbuilder* builder, unsigned int line)
+{
+	unsigned long long** page = &builder->counts[line >> COUNTPAGESHIFT];
+
+	if (*page == 0)
+	{
+		*page = calloc(COUNTPAGESIZE, sizeof(unsigned long long));
+		if (*page == 0)
+		{
+			printf("error allocating memory\n");
+			exit(1);
+		}
+	}
+
+	return &(*page)[line & (COUNTPAGESIZE - 1)];
+}
+
+void builder_count(void* arg, unsigned char* event)
+{
+	indexbuilder* builder = arg;
+
+	(*builder_counter(builder, getle32(event + EVENTOFFSET_ADDRESS) / LINESIZE))++;
+	builder->writecount++;
+}
+
+void builder_place(void* arg, unsigned char* event)
+{
+	indexbuilder* builder = arg;
+	unsigned long long* slot = builder_counter(builder, getle32(event + EVENTOFFSET_ADDRESS) / LINESIZE);
+	unsigned char* entry = builder->writes + (*slot)++ * WRITEENTRYSIZE;
+
+	memcpy(entry, event + EVENTOFFSET_SAMPLE, 8);
+	memcpy(entry + 8, event + EVENTOFFSET_DATA, 8);
+	entry[17] = ~event[EVENTOFFSET_MASK];
+}
+
+/*
+ * Index file format, all values little-endian, every table 8 byte aligned so
+ * the file can be used mapped into memory as it is:
+ *
+ *   header
+ *     0  le32  magic
+ *     4  le32  version
+ *     8  le32  line size, 8 bytes
+ *    12  le32  reserved
+ *    16  le64  line count
+ *    24  le64  write count
+ *    32  le64  file offset of the line table
+ *    40  le64  file offset of the write table
+ *
+ *   line table, one entry per line ever written, by address
+ *     0  le32  line number, the byte address / 8
+ *     4  le32  reserved
+ *     8  le64  first write of the line in the write table
+ *
+ *   write table, the writes of each line together, by sample index
+ *     0  le64  sample index
+ *     8  u8[8] line contents after the write
+ *    16  u8    bytes written so far, bit i for byte i
+ *    17  u8    bytes written by this write
+ *    18  u8[6] reserved
+ *
+ * A line's writes end where the next line's begin. Since every write holds the
+ * contents it left behind, a line at any sample is found with one binary search
+ * in its writes.
+ */
+int buildindex(FILE* fevents, FILE* f)
+{
+	indexbuilder builder;
+	unsigned char header[INDEXHEADERSIZE];
+	unsigned char* lines = 0;
+	unsigned char* entry;
+	unsigned char contents[LINESIZE];
+	unsigned long long linecount = 0;
+	unsigned long long position = 0;
+	unsigned long long first;
+	unsigned long long last;
+	unsigned long long count;
+	unsigned long long i, j;
+	unsigned int written;
+	unsigned int k;
+	int result = -1;
+
+	memset(&builder, 0, sizeof(builder));
+	builder.counts = calloc(COUNTPAGES, sizeof(unsigned long long*));
+	if (builder.counts == 0)
+		goto clean;
+
+	// Count the writes of every line
+	if (0 != forwrites(fevents, builder_count, &builder))
+		goto clean;
+
+	for(i=0; i<COUNTPAGES; i++)
+		if (builder.counts[i])
+			for(j=0; j<COUNTPAGESIZE; j++)
+				if (builder.counts[i][j])
+					linecount++;
+
+	lines = malloc(linecount * LINEENTRYSIZE + 1);
+	builder.writes = malloc(builder.writecount * WRITEENTRYSIZE + 1);
+	if (lines == 0 || builder.writes == 0)
+	{
+		printf("error allocating memory\n");
+		goto clean;
+	}
+
+	// Lay out the line table, turning the counts into where each line's writes go
+	entry = lines;
+	for(i=0; i<COUNTPAGES; i++)
+	{
+		if (builder.counts[i] == 0)
+			continue;
+
+		for(j=0; j<COUNTPAGESIZE; j++)
+		{
+			count = builder.counts[i][j];
+			if (count == 0)
+				continue;
+
+			putle32(entry, (unsigned int)((i << COUNTPAGESHIFT) | j));
+			putle32(entry + 4, 0);
+			putle64(entry + 8, position);
+			entry += LINEENTRYSIZE;
+
+			builder.counts[i][j] = position;
+			position += count;
+		}
+	}
+
+	memset(builder.writes, 0, builder.writecount * WRITEENTRYSIZE);
+	if (0 != forwrites(fevents, builder_place, &builder))
+		goto clean;
+
+	// Turn every write into the line contents it left behind
+	for(i=0; i<linecount; i++)
+	{
+		first = getle64(lines + i*LINEENTRYSIZE + 8);
+		last = (i + 1 < linecount)? getle64(lines + (i + 1)*LINEENTRYSIZE + 8) : builder.writecount;
+
+		memset(contents, 0, LINESIZE);
+		written = 0;
+		for(j=first; j<last; j++)
+		{
+			entry = builder.writes + j*WRITEENTRYSIZE;
+			if (j > first && getle64(entry) < getle64(entry - WRITEENTRYSIZE))
+			{
+				printf("error events are not in sample order\n");
+				goto clean;
+			}
+
+			for(k=0; k<LINESIZE; k++)
+				if (entry[17] & (1<<k))
+					contents[k] = entry[8 + k];
+			written |= entry[17];
+
+			memcpy(entry + 8, contents, LINESIZE);
+			entry[16] = written;
+		}
+	}
+
+	memset(header, 0, INDEXHEADERSIZE);
+	putle32(header + 0, INDEXMAGIC);
+	putle32(header + 4, INDEXVERSION);
+	putle32(header + 8, LINESIZE);
+	putle64(header + 16, linecount);
+	putle64(header + 24, builder.writecount);
+	putle64(header + 32, INDEXHEADERSIZE);
+	putle64(header + 40, INDEXHEADERSIZE + linecount * LINEENTRYSIZE);
+
+	if (fwrite(header, INDEXHEADERSIZE, 1, f) != 1 ||
+		fwrite(lines, LINEENTRYSIZE, linecount, f) != linecount ||
+		fwrite(builder.writes, WRITEENTRYSIZE, builder.writecount, f) != builder.writecount)
+	{
+		printf("error writing index file\n");
+		goto clean;
+	}
+
+	printf("%llu lines, %llu writes\n", linecount, builder.writecount);
+	result = 0;
+
+clean:
+	if (builder.counts)
+	{
+		for(i=0; i<COUNTPAGES; i++)
+			free(builder.counts[i]);
+		free(builder.counts);
+	}
+	free(builder.writes);
+	free(lines);
+	return result;
+}
+
+void index_close(memindex* index)
+{
+	if (index->data == 0)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(index->data);
+	CloseHandle(index->mapping);
+	CloseHandle(index->file);
+#else
+	munmap(index->data, index->size);
+#endif
+	index->data = 0;
+}
+
+int index_open(memindex* index, const char* fname)
+{
+	memset(index, 0, sizeof(memindex));
+
+#ifdef _WIN32
+	{
+		LARGE_INTEGER size;
+
+		index->file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+		if (index->file == INVALID_HANDLE_VALUE)
+			return -1;
+		if (!GetFileSizeEx(index->file, &size) || size.QuadPart < INDEXHEADERSIZE)
+		{
+			CloseHandle(index->file);
+			return -1;
+		}
+		index->size = size.QuadPart;
+		index->mapping = CreateFileMapping(index->file, 0, PAGE_READONLY, 0, 0, 0);
+		if (index->mapping)
+			index->data = MapViewOfFile(index->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (index->data == 0)
+		{
+			if (index->mapping)
+				CloseHandle(index->mapping);
+			CloseHandle(index->file);
+			return -1;
+		}
+	}
+#else
+	{
+		struct stat st;
+		int fd = open(fname, O_RDONLY);
+		void* data;
+
+		if (fd < 0)
+			return -1;
+		if (fstat(fd, &st) != 0 || st.st_size < INDEXHEADERSIZE)
+		{
+			close(fd);
+			return -1;
+		}
+		index->size = st.st_size;
+		data = mmap(0, index->size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED)
+			return -1;
+		index->data = data;
+	}
+#endif
+
+	index->linecount = getle64(index->data + 16);
+	index->writecount = getle64(index->data + 24);
+	index->lines = index->data + getle64(index->data + 32);
+	index->writes = index->data + getle64(index->data + 40);
+
+	if (getle32(index->data) != INDEXMAGIC || getle32(index->data + 4) != INDEXVERSION || getle32(index->data + 8) != LINESIZE ||
+		getle64(index->data + 32) + index->linecount * LINEENTRYSIZE > index->size ||
+		getle64(index->data + 40) + index->writecount * WRITEENTRYSIZE > index->size)
+	{
+		index_close(index);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Finds the writes of 'line', returning 0 when it was never written.
+ */
+int index_findline(memindex* index, unsigned int line, unsigned long long* first, unsigned long long* last)
+{
+	unsigned long long low = 0;
+	unsigned long long high = index->linecount;
+	unsigned long long middle;
+	unsigned int value;
+
+	while(low < high)
+	{
+		middle = low + (high - low) / 2;
+		value = getle32(index->lines + middle*LINEENTRYSIZE);
+		if (value < line)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low == index->linecount || getle32(index->lines + low*LINEENTRYSIZE) != line)
+		return 0;
+
+	*first = getle64(index->lines + low*LINEENTRYSIZE + 8);
+	*last = (low + 1 < index->linecount)? getle64(index->lines + (low + 1)*LINEENTRYSIZE + 8) : index->writecount;
+	return 1;
+}
+
+/*
+ * Gets the contents of 'line' before sample 'sampleindex', returning which bytes
+ * had been written by then.
+ */
+unsigned int index_readline(memindex* index, unsigned int line, unsigned long long sampleindex, unsigned char* contents)
+{
+	unsigned long long first, last, middle;
+	unsigned char* entry;
+
+	memset(contents, 0, LINESIZE);
+	if (!index_findline(index, line, &first, &last))
+		return 0;
+
+	// Find the first write at or after sampleindex, the one before it is the answer
+	while(first < last)
+	{
+		middle = first + (last - first) / 2;
+		if (getle64(index->writes + middle*WRITEENTRYSIZE) < sampleindex)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+
+	if (first == 0 || !index_findline(index, line, &middle, &last) || first == middle)
+		return 0;
+
+	entry = index->writes + (first - 1)*WRITEENTRYSIZE;
+	memcpy(contents, entry + 8, LINESIZE);
+	return entry[16];
+}
+
+void showrange(memindex* index, unsigned long long sampleindex, unsigned int address, unsigned int size)
+{
+	unsigned char contents[LINESIZE];
+	unsigned int written = 0;
+	unsigned int line = ~0;
+	unsigned int offset;
+	unsigned int i;
+
+	for(i=0; i<size; i++)
+	{
+		if ((address + i) / LINESIZE != line)
+		{
+			line = (address + i) / LINESIZE;
+			written = index_readline(index, line, sampleindex, contents);
+		}
+
+		if (i % DUMPWIDTH == 0)
+			printf("%s%08X:", (i == 0)? "" : "\n", address + i);
+
+		offset = (address + i) % LINESIZE;
+		if (written & (1<<offset))
+			printf(" %02X", contents[offset]);
+		else
+			printf(" --");
+	}
+	printf("\n");
+}
+
+void showhistory(memindex* index, unsigned long long sampleindex, unsigned int address, unsigned int size)
+{
+	unsigned long long first, last, j;
+	unsigned char* entry;
+	unsigned int line;
+	unsigned int k;
+
+	for(line=address/LINESIZE; line<=(address+size-1)/LINESIZE; line++)
+	{
+		if (!index_findline(index, line, &first, &last))
+			continue;
+
+		for(j=first; j<last; j++)
+		{
+			entry = index->writes + j*WRITEENTRYSIZE;
+			if (getle64(entry) >= sampleindex)
+				break;
+
+			printf("%9llu: %08X", getle64(entry), line * LINESIZE);
+			for(k=0; k<LINESIZE; k++)
+			{
+				if (entry[17] & (1<<k))
+					printf(" %02X", entry[8 + k]);
+				else
+					printf(" --");
+			}
+			printf("\n");
+		}
+	}
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		   "memquery -- memory contents at any point of a decoded RAM trace\n"
+		   "Usage: %s [options...] <index file>\n"
+           "\n"
+           "Options:\n"
+           "  -h, --help              Print this help info.\n"
+		   "      --build=file        Build the index from an events file, as written by the\n"
+		   "                          decoders with --events.\n"
+		   "  -s, --sample=x          Show memory as it was before sample x, like the decoders\n"
+		   "                          leave it with --stop=x (default the end of the trace).\n"
+		   "  -a, --address=x         Start of the memory range to show.\n"
+		   "  -n, --size=x            Size of the memory range (default 64).\n"
+		   "      --history           List the writes to the range before --sample instead.\n"
+		   "      --queries=file      Answer every line of file, '<sample> <address> [size]'.\n"
+		   "\n"
+		   "Bytes never written show as --.\n"
+           "\n",
+		   argv0);
+   exit(1);
+}
+
+enum opts
+{
+	OPT_HELP = 'h',
+	OPT_SAMPLE = 's',
+	OPT_ADDRESS = 'a',
+	OPT_SIZE = 'n',
+	OPT_BUILD = 256,
+	OPT_HISTORY = 257,
+	OPT_QUERIES = 258,
+};
+
+int main(int argc, char* argv[])
+{
+	char* indexfname = 0;
+	char* eventsfname = 0;
+	char* queriesfname = 0;
+	unsigned long long sampleindex = ~0ULL;
+	unsigned int address = 0;
+	unsigned int size = 64;
+	int history = 0;
+	int status = 1;
+	memindex index;
+
+	index.data = 0;
+
+	while (1)
+	{
+		int option_index;
+		int c;
+		static struct option long_options[] =
+		{
+			{"build", 1, NULL, OPT_BUILD},
+			{"sample", 1, NULL, OPT_SAMPLE},
+			{"address", 1, NULL, OPT_ADDRESS},
+			{"size", 1, NULL, OPT_SIZE},
+			{"history", 0, NULL, OPT_HISTORY},
+			{"queries", 1, NULL, OPT_QUERIES},
+			{"help", 0, NULL, OPT_HELP},
+			{NULL},
+		};
+
+		c = getopt_long(argc, argv, "hs:a:n:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c)
+		{
+			case OPT_BUILD:
+				eventsfname = optarg;
+			break;
+
+			case OPT_SAMPLE:
+				sampleindex = strtoull(optarg, 0, 0);
+			break;
+
+			case OPT_ADDRESS:
+				address = strtoul(optarg, 0, 0);
+			break;
+
+			case OPT_SIZE:
+				size = strtoul(optarg, 0, 0);
+			break;
+
+			case OPT_HISTORY:
+				history = 1;
+			break;
+
+			case OPT_QUERIES:
+				queriesfname = optarg;
+			break;
+
+			case OPT_HELP:
+				usage(argv[0]);
+			break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+	if ( optind == argc - 1)
+	{
+		// Exactly one extra argument -- the index file
+		indexfname = argv[optind];
+	}
+	else
+	{
+		usage(argv[0]);
+	}
+
+	if (eventsfname)
+	{
+		FILE* fevents = fopen(eventsfname, "rb");
+		FILE* findex;
+
+		if (fevents == 0)
+		{
+			printf("error opening events file\n");
+			goto clean;
+		}
+
+		findex = fopen(indexfname, "wb");
+		if (findex == 0)
+		{
+			printf("error opening index file\n");
+			fclose(fevents);
+			goto clean;
+		}
+
+		status = buildindex(fevents, findex)? 1 : 0;
+		fclose(fevents);
+		if (fclose(findex) != 0)
+			status = 1;
+		goto clean;
+	}
+
+	if (0 != index_open(&index, indexfname))
+	{
+		printf("error opening index file\n");
+		goto clean;
+	}
+
+	if (queriesfname)
+	{
+		FILE* fqueries = fopen(queriesfname, "r");
+		char line[256];
+
+		if (fqueries == 0)
+		{
+			printf("error opening queries file\n");
+			goto clean;
+		}
+
+		while(fgets(line, sizeof(line), fqueries))
+		{
+			unsigned long long querysample;
+			unsigned int queryaddress;
+			unsigned int querysize = size;
+			char* p = line;
+
+			querysample = strtoull(p, &p, 0);
+			if (p == line)
+				continue;
+			queryaddress = strtoul(p, &p, 0);
+			querysize = strtoul(p, 0, 0);
+			if (querysize == 0)
+				querysize = size;
+
+			printf("sample %llu:\n", querysample);
+			if (history)
+				showhistory(&index, querysample, queryaddress, querysize);
+			else
+				showrange(&index, querysample, queryaddress, querysize);
+		}
+		fclose(fqueries);
+	}
+	else if (size)
+	{
+		if (history)
+			showhistory(&index, sampleindex, address, size);
+		else
+			showrange(&index, sampleindex, address, size);
+	}
+
+	status = 0;
+
+clean:
+	index_close(&index);
+	return status;
+}
@@ -0,0 +1,569 @@
+#include <stdio.h>
+#include <zlib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+// Sample sizes of the raw SDRAM bus traces (decoder) and the smart traces (decodersmart)
+#define RAW_SAMPLESIZE 11
+#define SMART_SAMPLESIZE 13
+
+#define MEMORYSIZE (128 * 1024 * 1024)
+#define OUTBUFFERSIZE (64 * 1024)
+
+// Samples after a READ command before its data is on the bus, as the decoder expects
+#define READLATENCY 7
+
+enum formats
+{
+	FORMAT_RAW,
+	FORMAT_SMART,
+};
+
+enum commands
+{
+	CMD_MSR = 0,
+	CMD_PRECHARGE = 1,
+	CMD_READ = 2,
+	CMD_WRITE = 4,
+	CMD_BST = 5,
+	CMD_ACTIVATE = 6,
+	CMD_NOP = 7,
+};
+
+typedef struct
+{
+	unsigned int format;
+	unsigned long long samplecount;
+	unsigned int readpercent;
+	unsigned int localitypercent;
+	unsigned int partialpercent;
+	unsigned int burstmin;
+	unsigned int burstmax;
+	unsigned int memorysize;
+	unsigned long long seed;
+	int level;
+} genparams;
+
+typedef struct
+{
+	genparams params;
+	unsigned char* memory;
+	unsigned long long random;
+	unsigned long long samplecount;
+	unsigned long long readcount;
+	unsigned long long writecount;
+	unsigned int nextaddress;
+	unsigned int openrow[8];
+	unsigned int rowopen[8];
+	z_stream stream;
+	FILE* f;
+	unsigned char outbuffer[OUTBUFFERSIZE];
+	unsigned char samplebuffer[OUTBUFFERSIZE];
+	unsigned int samplebuffersize;
+} gencontext;
+
+
+/*
+ * xorshift64*, so a seed always gives the same trace.
+ */
+unsigned int gen_random(gencontext* context)
+{
+	context->random ^= context->random >> 12;
+	context->random ^= context->random << 25;
+	context->random ^= context->random >> 27;
+	return (unsigned int)((context->random * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+unsigned int gen_range(gencontext* context, unsigned int min, unsigned int max)
+{
+	return min + gen_random(context) % (max - min + 1);
+}
+
+int gen_chance(gencontext* context, unsigned int percent)
+{
+	return (gen_random(context) % 100) < percent;
+}
+
+/*
+ * Inverse of fix_data_order in the decoders, so they see 'data' and 'mask' again.
+ */
+void unfix_data_order(unsigned int *mask, unsigned char *data)
+{
+	unsigned long long word;
+
+	*mask = ((*mask >> 2) | (*mask << 6)) & 0xFF;
+
+	memcpy(&word, data, 8);
+	word = (word >> 16) | (word << 48);
+	memcpy(data, &word, 8);
+}
+
+int gen_flush(gencontext* context, int flush)
+{
+	z_stream* stream = &context->stream;
+	unsigned int have;
+	int result;
+
+	stream->avail_in = context->samplebuffersize;
+	stream->next_in = context->samplebuffer;
+
+	do
+	{
+		stream->avail_out = OUTBUFFERSIZE;
+		stream->next_out = context->outbuffer;
+
+		result = deflate(stream, flush);
+		if (result == Z_STREAM_ERROR)
+			return -1;
+
+		have = OUTBUFFERSIZE - stream->avail_out;
+		if (fwrite(context->outbuffer, 1, have, context->f) != have)
+			return -1;
+	} while(stream->avail_out == 0);
+
+	context->samplebuffersize = 0;
+	return 0;
+}
+
+int gen_emit(gencontext* context, unsigned char* sample, unsigned int size)
+{
+	if (context->samplebuffersize + size > OUTBUFFERSIZE)
+	{
+		if (0 != gen_flush(context, Z_NO_FLUSH))
+			return -1;
+	}
+
+	memcpy(context->samplebuffer + context->samplebuffersize, sample, size);
+	context->samplebuffersize += size;
+	context->samplecount++;
+	return 0;
+}
+
+/*
+ * Raw SDRAM bus sample. Control format, as decoded by the decoder:
+ * BANK[1:0] | ADDR[12:0] | UNK[3:0] | CTRL[2:0] | CS[1:0], with CS active low.
+ * The byte mask of the data goes on the address lines.
+ */
+int gen_rawsample(gencontext* context, unsigned int cs, unsigned int command, unsigned int bank, unsigned int address, unsigned char* data, unsigned int mask)
+{
+	unsigned char sample[RAW_SAMPLESIZE];
+	unsigned char busdata[8];
+	unsigned int control;
+	unsigned int csbits;
+
+	memset(busdata, 0, 8);
+	if (data)
+	{
+		memcpy(busdata, data, 8);
+		unfix_data_order(&mask, busdata);
+		address |= mask << 2;
+	}
+
+	if (cs == 0)
+		csbits = 2;
+	else if (cs == 1)
+		csbits = 1;
+	else
+		csbits = 3;
+
+	control = csbits | (command << 2) | ((address & 0x1FFF) << 9) | ((bank & 3) << 22);
+
+	sample[0] = control;
+	sample[1] = control >> 8;
+	sample[2] = control >> 16;
+	memcpy(sample + 3, busdata, 8);
+
+	return gen_emit(context, sample, RAW_SAMPLESIZE);
+}
+
+int gen_smartsample(gencontext* context, unsigned int isread, unsigned int address, unsigned char* data, unsigned int mask)
+{
+	unsigned char sample[SMART_SAMPLESIZE];
+
+	sample[0] = isread;
+	sample[1] = address;
+	sample[2] = address >> 8;
+	sample[3] = address >> 16;
+	memcpy(sample + 4, data, 8);
+	unfix_data_order(&mask, sample + 4);
+	sample[12] = mask;
+
+	return gen_emit(context, sample, SMART_SAMPLESIZE);
+}
+
+/*
+ * Fills in the data of a write to 'address' and applies it to the shadow memory,
+ * so that later reads return what the decoder has in its memory.
+ */
+unsigned int gen_writedata(gencontext* context, unsigned int address, unsigned char* data)
+{
+	unsigned int mask = 0;
+	unsigned int i;
+
+	if (gen_chance(context, context->params.partialpercent))
+		mask = gen_range(context, 1, 0xFE);
+
+	for(i=0; i<8; i++)
+	{
+		data[i] = gen_random(context);
+		if ((mask & (1<<i)) == 0)
+			context->memory[address*8 + i] = data[i];
+	}
+
+	return mask;
+}
+
+/*
+ * Picks the word address and length of the next burst. With 'locality', the burst
+ * mostly continues where the last one ended or stays in the same row.
+ */
+unsigned int gen_burstaddress(gencontext* context, unsigned int* length)
+{
+	unsigned int words = context->params.memorysize / 8;
+	unsigned int address;
+
+	*length = gen_range(context, context->params.burstmin, context->params.burstmax);
+
+	if (gen_chance(context, context->params.localitypercent))
+	{
+		if (gen_chance(context, 50))
+			address = context->nextaddress;
+		else
+			address = (context->nextaddress & ~0xFF) | gen_range(context, 0, 0xFF);
+	}
+	else
+	{
+		address = gen_random(context);
+	}
+	address %= words;
+
+	// A burst doesn't cross the end of a row
+	if ((address & 0xFF) + *length > 0x100)
+		*length = 0x100 - (address & 0xFF);
+
+	context->nextaddress = (address + *length) % words;
+	return address;
+}
+
+int gen_rawburst(gencontext* context, unsigned int isread, unsigned int address, unsigned int length)
+{
+	unsigned char data[8];
+	unsigned int column = address & 0xFF;
+	unsigned int bank = (address >> 8) & 3;
+	unsigned int row = (address >> 10) & 0x1FFF;
+	unsigned int cs = (address >> 23) & 1;
+	unsigned int slot = bank + cs*4;
+	unsigned int mask;
+	unsigned int i;
+
+	// Open the row, unless it already is
+	if (!context->rowopen[slot] || context->openrow[slot] != row)
+	{
+		if (context->rowopen[slot])
+		{
+			if (0 != gen_rawsample(context, cs, CMD_PRECHARGE, bank, 0, 0, 0))
+				return -1;
+		}
+		if (0 != gen_rawsample(context, cs, CMD_ACTIVATE, bank, row, 0, 0))
+			return -1;
+		context->openrow[slot] = row;
+		context->rowopen[slot] = 1;
+	}
+
+	if (isread)
+	{
+		// The read data follows the command with the bus latency
+		if (0 != gen_rawsample(context, cs, CMD_READ, bank, column, 0, 0))
+			return -1;
+
+		for(i=1; i<length + READLATENCY; i++)
+		{
+			unsigned int command = (i == length)? CMD_BST : CMD_NOP;
+			unsigned int datacs = (i == length)? cs : 3;
+
+			if (i >= READLATENCY)
+			{
+				memcpy(data, context->memory + (address + i - READLATENCY)*8, 8);
+				if (0 != gen_rawsample(context, datacs, command, bank, 0, data, 0))
+					return -1;
+			}
+			else
+			{
+				if (0 != gen_rawsample(context, datacs, command, bank, 0, 0, 0))
+					return -1;
+			}
+		}
+		context->readcount += length;
+	}
+	else
+	{
+		// Each write sample carries the data for the column of the sample before
+		if (0 != gen_rawsample(context, cs, CMD_WRITE, bank, column, 0, 0))
+			return -1;
+
+		for(i=1; i<=length; i++)
+		{
+			unsigned int command = (i == length)? CMD_BST : CMD_NOP;
+			unsigned int datacs = (i == length)? cs : 3;
+
+			mask = gen_writedata(context, address + i - 1, data);
+			if (0 != gen_rawsample(context, datacs, command, bank, 0, data, mask))
+				return -1;
+		}
+		context->writecount += length;
+	}
+
+	return 0;
+}
+
+int gen_smartburst(gencontext* context, unsigned int isread, unsigned int address, unsigned int length)
+{
+	unsigned char data[8];
+	unsigned int mask;
+	unsigned int i;
+
+	for(i=0; i<length; i++)
+	{
+		if (isread)
+		{
+			memcpy(data, context->memory + (address + i)*8, 8);
+			mask = 0;
+		}
+		else
+		{
+			mask = gen_writedata(context, address + i, data);
+		}
+
+		if (0 != gen_smartsample(context, isread, address + i, data, mask))
+			return -1;
+	}
+
+	if (isread)
+		context->readcount += length;
+	else
+		context->writecount += length;
+
+	return 0;
+}
+
+int generate(gencontext* context, FILE* f)
+{
+	genparams* params = &context->params;
+	int result;
+
+	context->f = f;
+	context->random = params->seed? params->seed : 1;
+	context->stream.zalloc = Z_NULL;
+	context->stream.zfree = Z_NULL;
+	context->stream.opaque = Z_NULL;
+	result = deflateInit(&context->stream, params->level);
+	if (result != Z_OK)
+		return -1;
+
+	while(context->samplecount < params->samplecount)
+	{
+		unsigned int isread = gen_chance(context, params->readpercent);
+		unsigned int length;
+		unsigned int address = gen_burstaddress(context, &length);
+
+		if (params->format == FORMAT_RAW)
+			result = gen_rawburst(context, isread, address, length);
+		else
+			result = gen_smartburst(context, isread, address, length);
+
+		if (result != 0)
+			goto clean;
+	}
+
+	result = gen_flush(context, Z_FINISH);
+
+clean:
+	deflateEnd(&context->stream);
+	return result;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		   "tracegen -- synthetic RAM traces for the decoders\n"
+		   "Usage: %s [options...] <trace file>\n"
+           "\n"
+           "Options:\n"
+           "  -h, --help              Print this help info.\n"
+		   "      --format=x          Trace format, 'raw' SDRAM bus samples (decoder, default)\n"
+		   "                          or 'smart' access samples (decodersmart).\n"
+		   "  -n, --samples=x         Number of samples to generate (default 10000000).\n"
+		   "      --reads=x           Percentage of bursts that are reads (default 70).\n"
+		   "      --locality=x        Percentage of bursts that continue the previous one or stay\n"
+		   "                          in its row (default 80).\n"
+		   "      --burst=min:max     Burst length range in 64-bit words (default 1:8).\n"
+		   "      --partial=x         Percentage of written words with a byte mask (default 10).\n"
+		   "      --memory=x          Size of the address space in MB (default 128).\n"
+		   "      --seed=x            Random seed, the same seed gives the same trace (default 1).\n"
+		   "      --level=x           zlib compression level (default 1, like memhost).\n"
+           "\n",
+		   argv0);
+   exit(1);
+}
+
+enum opts
+{
+	OPT_HELP = 'h',
+	OPT_SAMPLES = 'n',
+	OPT_FORMAT = 256,
+	OPT_READS = 257,
+	OPT_LOCALITY = 258,
+	OPT_BURST = 259,
+	OPT_PARTIAL = 260,
+	OPT_MEMORY = 261,
+	OPT_SEED = 262,
+	OPT_LEVEL = 263,
+};
+
+int main(int argc, char* argv[])
+{
+	char* tracefname = 0;
+	FILE* ftrace = 0;
+	gencontext* context = 0;
+	genparams* params;
+	char* pchr;
+	int status = 1;
+
+	context = calloc(1, sizeof(gencontext));
+	if (context)
+		context->memory = calloc(1, MEMORYSIZE);
+	if (context == 0 || context->memory == 0)
+	{
+		printf("error allocating RAM memory\n");
+		goto clean;
+	}
+
+	params = &context->params;
+	params->format = FORMAT_RAW;
+	params->samplecount = 10000000;
+	params->readpercent = 70;
+	params->localitypercent = 80;
+	params->partialpercent = 10;
+	params->burstmin = 1;
+	params->burstmax = 8;
+	params->memorysize = MEMORYSIZE;
+	params->seed = 1;
+	params->level = 1;
+
+	while (1)
+	{
+		int option_index;
+		int c;
+		static struct option long_options[] =
+		{
+			{"format", 1, NULL, OPT_FORMAT},
+			{"samples", 1, NULL, OPT_SAMPLES},
+			{"reads", 1, NULL, OPT_READS},
+			{"locality", 1, NULL, OPT_LOCALITY},
+			{"burst", 1, NULL, OPT_BURST},
+			{"partial", 1, NULL, OPT_PARTIAL},
+			{"memory", 1, NULL, OPT_MEMORY},
+			{"seed", 1, NULL, OPT_SEED},
+			{"level", 1, NULL, OPT_LEVEL},
+			{"help", 0, NULL, OPT_HELP},
+			{NULL},
+		};
+
+		c = getopt_long(argc, argv, "hn:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c)
+		{
+			case OPT_FORMAT:
+				if (strcmp(optarg, "raw") == 0)
+					params->format = FORMAT_RAW;
+				else if (strcmp(optarg, "smart") == 0)
+					params->format = FORMAT_SMART;
+				else
+					usage(argv[0]);
+			break;
+
+			case OPT_SAMPLES:
+				params->samplecount = strtoull(optarg, 0, 0);
+			break;
+
+			case OPT_READS:
+				params->readpercent = strtoul(optarg, 0, 0);
+			break;
+
+			case OPT_LOCALITY:
+				params->localitypercent = strtoul(optarg, 0, 0);
+			break;
+
+			case OPT_BURST:
+				params->burstmin = strtoul(optarg, &pchr, 0);
+				params->burstmax = (*pchr == ':')? strtoul(pchr + 1, 0, 0) : params->burstmin;
+			break;
+
+			case OPT_PARTIAL:
+				params->partialpercent = strtoul(optarg, 0, 0);
+			break;
+
+			case OPT_MEMORY:
+				params->memorysize = strtoul(optarg, 0, 0) * 1024 * 1024;
+			break;
+
+			case OPT_SEED:
+				params->seed = strtoull(optarg, 0, 0);
+			break;
+
+			case OPT_LEVEL:
+				params->level = strtol(optarg, 0, 0);
+			break;
+
+			case OPT_HELP:
+				usage(argv[0]);
+			break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+	if ( optind == argc - 1)
+	{
+		// Exactly one extra argument -- the trace file
+		tracefname = argv[optind];
+	}
+	else
+	{
+		usage(argv[0]);
+	}
+
+	if (params->burstmin < 1 || params->burstmax < params->burstmin || params->burstmax > 0x100 ||
+		params->memorysize < 2048 || params->memorysize > MEMORYSIZE)
+	{
+		printf("error invalid burst or memory size\n");
+		goto clean;
+	}
+
+	ftrace = fopen(tracefname, "wb");
+	if (ftrace == 0)
+	{
+		printf("error opening file\n");
+		goto clean;
+	}
+
+	if (0 != generate(context, ftrace))
+	{
+		printf("error writing file\n");
+		goto clean;
+	}
+
+	printf("%llu samples, %llu words read, %llu words written\n", context->samplecount, context->readcount, context->writecount);
+	status = 0;
+
+clean:
+	if (ftrace)
+		fclose(ftrace);
+	if (context)
+		free(context->memory);
+	free(context);
+	return status;
+}